@@ -7,10 +7,6 @@
 
 #include "acl-helper.h"
 
-#ifdef HAVE_SYS_AUXV_H
-  #include <sys/auxv.h>
-#endif
-
 #include "tree.h"
 #include "log.h"
 #include "conf.h"
@@ -18,8 +14,17 @@
 #include "source.h"
 #include "checker.h"
 #include "ssl.h"
+#include "sslcache.h"
+#include "stats.h"
+#include "mem.h"
+#include "bench.h"
+#include "capture.h"
 #include "geoip2.h"
 #include "options.h"
+#include "snapshot.h"
+#include "query.h"
+
+#include <semaphore.h>
 
 
 //! supported drivers/features list
@@ -81,6 +86,8 @@ void clean_exit(void) {
     unlink(config.pidfile);
   // try to log our exit
   wlog(L_INFO, "Exiting.");
+  capture_flush();
+  log_flush();
 }
 
 
@@ -93,15 +100,115 @@ sighandler_t sighandler(int sig) {
 } 
 
 
-//! reconfig/restart signal handler
+//! reload request semaphore (posted from signal handler)
+static sem_t reload_sem;
+
+//! reconfig signal handler: wake up reloader
 //! \param sig signal number
 void restart(int sig) {
-  wlog(L_INFO, "got SIGHUP, executing self from '%s'", config.execpath);
-  execve(config.execpath, config.argv, NULL);
-  wlog(L_ERR, "execve() failed: %s", strerror(errno));
+  sem_post(&reload_sem);
 } 
 
 
+//! reload checkers data: new one is built aside while current one
+//! keeps serving requests (caches and records of unchanged sources
+//! are kept), then it is swapped in; on any failure current sources,
+//! options and checkers are kept
+static void reload(void) {
+
+  time_t started = time(NULL);
+
+  if (config_reload()) {
+    wlog(L_ERR, "config reload failed, keeping current checkers data");
+    return;
+  }
+
+  if (sources_init()) {
+    wlog(L_ERR, "failed to init source(s), keeping current checkers data");
+    checkers_config_free();
+    options_config_free();
+    sources_config_free();
+    return;
+  }
+
+  if (options_init()) {
+    wlog(L_ERR, "failed to init runtime options, keeping current checkers data");
+    checkers_config_free();
+    sources_restore();
+    return;
+  }
+
+  if (checkers_init(config.snapshot_file ? snapshot_open(config.snapshot_file) : NULL)) {
+    wlog(L_ERR, "failed to init checker(s), keeping current checkers data");
+    options_restore();
+    sources_restore();
+    return;
+  }
+
+  wlog(L_INFO, "checkers data reloaded in %ld secs", (long)(time(NULL) - started));
+  mem_log();
+}
+
+
+//! reloader thread: reload on SIGHUP or on sources data change
+//! \param arg unused
+//! \return nothing, actually
+static void *reload_run(void *arg) {
+
+  while (1) {
+
+    // sources are not watched: just wait for a signal
+    if (! config.source_check_interval) {
+      if (! sem_wait(&reload_sem)) {
+        wlog(L_INFO, "got SIGHUP, reloading checkers data");
+        reload();
+      }
+      continue;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += config.source_check_interval;
+
+    if (! sem_timedwait(&reload_sem, &deadline)) {
+      wlog(L_INFO, "got SIGHUP, reloading checkers data");
+      reload();
+    } else if (errno == ETIMEDOUT && sources_check()) {
+      wlog(L_INFO, "sources data changed, reloading checkers data");
+      reload();
+    }
+  }
+
+  return NULL;
+}
+
+
+//! start reloader and setup SIGHUP handler
+//! \return 0 if ok
+static int reload_init(void) {
+
+  sem_init(&reload_sem, 0, 0);
+
+  pthread_t thread_id;
+  pthread_attr_t thread_attr;
+  pthread_attr_init(&thread_attr);
+  pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+  int err = pthread_create(&thread_id, &thread_attr, reload_run, NULL);
+  pthread_attr_destroy(&thread_attr);
+  if (err)
+    return 1;
+
+  struct sigaction sig_action;
+  memset(&sig_action, 0, sizeof(sig_action));
+  sig_action.sa_handler = restart;
+  sigemptyset(&sig_action.sa_mask);
+  sig_action.sa_flags = SA_RESTART;
+  sigaction(SIGHUP, &sig_action, NULL);
+
+  return 0;
+}
+
+
 
 //! show the help and nothing more
 static void show_help(char *pname) {
@@ -110,7 +217,13 @@ static void show_help(char *pname) {
          "  -h          show this help and exit\n"
          "  -t          test config and exit\n"
          "  -v          show version and exit\n"
-         "  -c <file>   use 'file' as config (default is '%s')\n",
+         "  -c <file>   use 'file' as config (default is '%s')\n"
+         "  -b <file>   replay squid requests (text or capture file) through checkers,\n"
+         "              report throughput and latencies and exit\n"
+         "  -w <num>    number of replay workers (default is 'concurrency')\n"
+         "  -p          replay with recorded pacing (needs timestamped requests)\n"
+         "  -C, --compile\n"
+         "              load checkers data and write it into 'snapshot_file' and exit\n",
          pname, DEFAULT_CONFIG_FILE);
 }
 
@@ -126,6 +239,13 @@ int main(int argc, char *argv[]) {
   // this flag is for 'test config and exit'
   int test_config = 0;
 
+  // replay benchmark options
+  char *bench_file = NULL;
+  int bench_workers = 0, bench_paced = 0;
+
+  // compile checkers data snapshot and exit
+  int compile = 0;
+
   // extract and store our visible prog name (for logging, etc)
   config.progname = rindex(argv[0], '/');
   if (config.progname)
@@ -133,35 +253,16 @@ int main(int argc, char *argv[]) {
   else
     config.progname = argv[0];
 
-  // guess our exec path (needed for execve())
-  // or if this fails we disable SIGHUP handling
-  // 1. try argv[0] method
-  config.execpath = realpath(argv[0], NULL);
-
-  // 2. try linux specific /proc method
-  if (! config.execpath) {
-     config.execpath = calloc(1, PATH_MAX + 1);
-     if (readlink("/proc/self/exe", config.execpath, PATH_MAX) < 0) {
-       free(config.execpath);
-       config.execpath = NULL;
-     }
-  }
-
-  // 3. try ELF loader
-  #ifdef HAVE_GETAUXVAL
-  if (! config.execpath)
-    config.execpath = (char *)getauxval(AT_EXECFN);
-  #endif
-
-  // preserve args for further execve() call
-  config.argv = calloc(argc + 1, sizeof(char *));
-  int i;
-  for (i = 0; argv[i]; i ++)
-    config.argv[i] = strdup(argv[i]);
-
   // get cmdline options
+  // (the only long option is an alias, getopt_long() 'struct option'
+  // clashes with runtime options one)
+  int i;
+  for (i = 1; i < argc && strcmp(argv[i], "--"); i ++) {
+    if (! strcmp(argv[i], "--compile"))
+      argv[i] = "-C";
+  }
   int opt;
-  while ((opt = getopt(argc, argv, "tvhc:")) != -1) {
+  while ((opt = getopt(argc, argv, "tvhc:b:w:pC")) != -1) {
 
     switch (opt) {
 
@@ -183,6 +284,26 @@ int main(int argc, char *argv[]) {
         test_config ++;
         break;
 
+      case 'b':
+        bench_file = optarg;
+        break;
+
+      case 'w':
+        bench_workers = str2int(optarg, 1, 1024);
+        if (errno) {
+          show_help(config.progname);
+          exit(1);
+        }
+        break;
+
+      case 'p':
+        bench_paced = 1;
+        break;
+
+      case 'C':
+        compile = 1;
+        break;
+
       default:
         show_help(config.progname);
         exit(1);
@@ -213,9 +334,20 @@ int main(int argc, char *argv[]) {
   config.ssl_ca_file = DEFAULT_CA_FILE;
   config.ssl_timeout = DEFAULT_SSL_TIMEOUT;
   config.ssl_verify_ttl = DEFAULT_SSL_VERIFY_TTL;
+  config.ssl_max_handshakes = DEFAULT_SSL_MAX_HANDSHAKES;
+  config.ssl_race_delay = DEFAULT_SSL_RACE_DELAY;
+  config.ssl_cert_only = DEFAULT_SSL_CERT_ONLY;
+  config.ssl_ocsp = DEFAULT_SSL_OCSP;
+  config.ssl_cache_slots = DEFAULT_SSLCACHE_SLOTS;
   config.resolve_ttl = DEFAULT_RESOLVE_TTL;
   config.resolve_neg_ttl = DEFAULT_NEG_RESOLVE_TTL;
+  config.resolve_prefetch = DEFAULT_RESOLVE_PREFETCH;
+  config.query_ttl = DEFAULT_QUERY_TTL;
+  config.query_cache_slots = DEFAULT_QUERY_CACHE_SLOTS;
   config.geoip2_db = DEFAULT_GEOIP2_DB_FILE;
+  config.stats_interval = DEFAULT_STATS_INTERVAL;
+  config.capture_sample = 1;
+  config.capture_keep = DEFAULT_CAPTURE_KEEP;
 
   // adjust stdout buffering
   setlinebuf(stdout);
@@ -227,6 +359,15 @@ int main(int argc, char *argv[]) {
     exit(2);
   }
 
+  // replay benchmark and compilation must not touch running helper pid file
+  if (bench_file || compile)
+    config.pidfile = NULL;
+
+  if (compile && ! config.snapshot_file) {
+    fprintf(stderr, "No 'snapshot_file' configured, nothing to compile\n");
+    exit(2);
+  }
+
   // init logging
   if (log_init())
     wlog(L_WARN, "failed to init logging, using STDERR");
@@ -245,7 +386,7 @@ int main(int argc, char *argv[]) {
       wlog(L_WARN, "invalid pid in '%s', overwriting...", config.pidfile);
     else {
       // see if pid is alive
-      // saved pid must not be our current pid (got SIGHUP and execve() was called)
+      // saved pid may be our own one reused by a stale pid file
       if (pid != config.pid) {
         if (! kill(pid, 0)) {
           wlog(L_CRIT, "another copy is running (pid: %u)", (unsigned)pid);
@@ -297,21 +438,33 @@ int main(int argc, char *argv[]) {
     exit(13);
   }
 
+  // map precompiled checkers data (compilation needs sources data)
+  struct snapshot *snap = NULL;
+  if (config.snapshot_file && ! compile && ! (snap = snapshot_open(config.snapshot_file)))
+    wlog(L_WARN, "failed to map snapshot '%s', loading checkers data from sources", config.snapshot_file);
+
   // init checkers
-  if (checkers_init()) {
+  if (checkers_init(snap)) {
     wlog(L_CRIT, "failed to init checker(s), exiting");
     exit(14);
   }
 
-  // we do have our exec paths, so we can setup SIGHUP handler
-  if (config.execpath) {
-    struct sigaction sig_action;
-    sig_action.sa_handler = restart;
-    sigemptyset(&sig_action.sa_mask);
-    sig_action.sa_flags = SA_NODEFER;
-    sigaction(SIGHUP, &sig_action, NULL);
-  } else
-    wlog(L_WARN, "Failed to guess our exec path, reconfig via SIGHUP is DISABLED");
+  // where loaded data memory goes
+  mem_log();
+
+  // snapshot compilation requested
+  if (compile)
+    exit(checkers_compile(config.snapshot_file) ? 15 : 0);
+
+  // replay benchmark requested
+  if (bench_file) {
+    stats_init();
+    exit(bench_run(bench_file, bench_workers, bench_paced));
+  }
+
+  // setup SIGHUP reload
+  if (reload_init())
+    wlog(L_WARN, "Failed to start reloader, reconfig via SIGHUP is DISABLED");
 
   // only config test was requested, exiting
   if (test_config) {
@@ -320,6 +473,15 @@ int main(int argc, char *argv[]) {
   } else
     wlog(L_INFO, "Ready to process requests");
 
+  // start stats collection
+  stats_init();
+  if (stats_run())
+    wlog(L_WARN, "failed to start stats export");
+
+  // start traffic capture
+  if (capture_init())
+    wlog(L_WARN, "failed to start traffic capture");
+
   // run main loop
   if (loop_run()) {
     wlog(L_CRIT, "main loop failure, exiting");
@@ -0,0 +1,221 @@
+/** \file */
+
+
+#include "acl-helper.h"
+#include "log.h"
+#include "conf.h"
+#include "loop.h"
+#include "stats.h"
+#include "capture.h"
+
+#include "bench.h"
+
+
+// replay benchmark: captured squid input lines are run through the
+// checkers chain by a number of workers (as fast as possible or with
+// recorded pacing), then throughput and latencies are reported;
+// nothing is written to stdout
+
+//! requests to replay
+static struct bench_req *reqs;
+
+//! number of requests
+static size_t reqs_num;
+
+//! next request to replay
+static size_t reqs_next;
+
+//! replay start time (see stats_now())
+static uint64_t bench_started;
+
+//! replay with recorded pacing
+static int bench_paced;
+
+
+//! add request to replay
+//! \param ts request time, secs (-1 if unknown)
+//! \param line request line
+//! \param len request line length
+static void bench_add(double ts, char *line, size_t len) {
+
+  static size_t size = 0;
+
+  if (reqs_num == size) {
+    size = size ? size * 2 : 1024;
+    reqs = realloc(reqs, size * sizeof(struct bench_req));
+    assert(reqs);
+  }
+  reqs[reqs_num].ts = ts;
+  reqs[reqs_num].line = strndup(line, len);
+  assert(reqs[reqs_num].line);
+  reqs_num ++;
+}
+
+
+//! load requests from binary capture file (see capture.h)
+//! \param fp capture file, positioned after the magic
+//! \return 0 if ok, !0 otherwise
+static int bench_load_capture(FILE *fp) {
+
+  struct capture_header hdr;
+  if (fread((char *)&hdr + sizeof(hdr.magic), sizeof(hdr) - sizeof(hdr.magic), 1, fp) != 1)
+    return 1;
+
+  char *data = malloc(UINT16_MAX + 1);
+  assert(data);
+
+  struct capture_rec rec;
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    if (rec.len && fread(data, rec.len, 1, fp) != 1) {
+      wlog(L_WARN, "bench: truncated capture record, ignoring the rest");
+      break;
+    }
+    if (rec.type == CAPTURE_REQUEST)
+      bench_add(rec.ts / 1e9, data, rec.len);
+  }
+
+  free(data);
+  return 0;
+}
+
+
+//! load requests file: binary capture file or one squid input line
+//! per line, optionally prefixed with 'unix_time<TAB>' (needed for
+//! paced replay)
+//! \param file file path
+//! \return 0 if ok, !0 otherwise
+static int bench_load(char *file) {
+
+  FILE *fp = fopen(file, "r");
+  if (! fp) {
+    wlog(L_ERR, "bench: failed to open '%s': %s", file, strerror(errno));
+    return 1;
+  }
+
+  // captured traffic?
+  char magic[sizeof(CAPTURE_MAGIC) - 1];
+  if (fread(magic, sizeof(magic), 1, fp) == 1 && ! memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+    int err = bench_load_capture(fp);
+    fclose(fp);
+    if (err || ! reqs_num) {
+      wlog(L_ERR, "bench: no requests in capture file '%s'", file);
+      return 1;
+    }
+    return 0;
+  }
+  rewind(fp);
+
+  size_t len = 0;
+  char *line = NULL;
+  ssize_t n;
+  while ((n = getline(&line, &len, fp)) >= 0) {
+
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+      line[-- n] = '\0';
+
+    // optional timestamp
+    double ts = -1;
+    char *req = line, *end;
+    char *tab = strchr(line, '\t');
+    if (tab) {
+      ts = strtod(line, &end);
+      if (end == tab)
+        req = tab + 1;
+      else
+        ts = -1;
+    }
+
+    if (*req)
+      bench_add(ts, req, strlen(req));
+  }
+
+  free(line);
+  fclose(fp);
+
+  if (! reqs_num) {
+    wlog(L_ERR, "bench: no requests in '%s'", file);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+//! replay worker
+static void *bench_worker(void *arg) {
+
+  while (1) {
+
+    size_t idx = __atomic_fetch_add(&reqs_next, 1, __ATOMIC_RELAXED);
+    if (idx >= reqs_num)
+      break;
+
+    // wait for recorded request time
+    if (bench_paced) {
+      // capture lines may be slightly out of order: earlier ones go at once
+      double delta = reqs[idx].ts - reqs[0].ts;
+      uint64_t at = bench_started + (delta > 0 ? (uint64_t)(delta * 1e9) : 0);
+      uint64_t now = stats_now();
+      if (at > now) {
+        struct timespec ts = {(at - now) / 1000000000, (at - now) % 1000000000};
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    // the line is modified while parsed
+    char *buf = strdup(reqs[idx].line);
+    assert(buf);
+    free(loop_request(buf));
+    free(buf);
+  }
+
+  return NULL;
+}
+
+
+//! replay captured requests and report results to stderr
+//! \param file requests file
+//! \param workers number of workers (0 to use configured concurrency)
+//! \param paced 1 to keep recorded pacing, 0 to run at max speed
+//! \return 0 if ok, !0 otherwise
+int bench_run(char *file, int workers, int paced) {
+
+  if (bench_load(file))
+    return 1;
+
+  if (workers < 1)
+    workers = config.concurrency > 0 ? config.concurrency : 1;
+
+  bench_paced = paced;
+  if (paced && reqs[0].ts < 0) {
+    wlog(L_WARN, "bench: no timestamps in '%s', replaying at max speed", file);
+    bench_paced = 0;
+  }
+
+  fprintf(stderr, "replaying %zu requests from '%s' with %d workers%s\n",
+          reqs_num, file, workers, bench_paced ? " (paced)" : "");
+
+  pthread_t *threads = calloc(workers, sizeof(pthread_t));
+  assert(threads);
+
+  bench_started = stats_now();
+  int i, err, started = 0;
+  for (i = 0; i < workers; i ++) {
+    if ((err = pthread_create(&threads[started], NULL, bench_worker, NULL)))
+      wlog(L_ERR, "bench: failed to start worker: %s", strerror(err));
+    else
+      started ++;
+  }
+  for (i = 0; i < started; i ++)
+    pthread_join(threads[i], NULL);
+  double elapsed = (stats_now() - bench_started) / 1e9;
+
+  free(threads);
+
+  fprintf(stderr, "%zu requests in %.3f secs, %.1f req/s\n",
+          reqs_num, elapsed, elapsed > 0 ? reqs_num / elapsed : 0.0);
+  stats_print(stderr);
+
+  return started ? 0 : 1;
+}
+
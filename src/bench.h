@@ -0,0 +1,16 @@
+/** \file */
+
+
+#ifndef __ACLH_BENCH_H__
+#define __ACLH_BENCH_H__
+
+//! request to replay
+struct bench_req {
+  double ts;                 //!< recorded request time (-1 if unknown)
+  char *line;                //!< squid input line
+};
+
+extern int bench_run(char *, int, int);
+
+#endif //__ACLH_BENCH_H__
+
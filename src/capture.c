@@ -0,0 +1,311 @@
+/** \file */
+
+
+#include "acl-helper.h"
+#include "log.h"
+#include "conf.h"
+#include "stats.h"
+
+#include <sys/stat.h>
+
+#include "capture.h"
+
+
+// traffic capture: sampled squid input lines and our responses are
+// appended as binary records (see struct capture_rec) into a memory
+// buffer; a writer thread swaps the buffers and writes the full one out,
+// so requests never wait for the disk (records are dropped and counted
+// if both buffers are full)
+
+//! capture buffers (one is filled, another one is written out)
+static char *cap_buf[2];
+
+//! capture buffers fill
+static size_t cap_len[2];
+
+//! buffer being filled
+static int cap_cur;
+
+//! buffers mutex
+static pthread_mutex_t cap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! writer wakeup condvar
+static pthread_cond_t cap_cond = PTHREAD_COND_INITIALIZER;
+
+//! capture file mutex (writer vs flush at exit)
+static pthread_mutex_t cap_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! capture file
+static FILE *cap_fp;
+
+//! capture file size
+static size_t cap_size;
+
+//! requests sequence (ids of captured requests are taken from it)
+static uint32_t cap_seq;
+
+//! dropped records counter
+static uint64_t cap_dropped;
+
+
+//! open capture file for appending, write header into a new one
+//! \return 0 if ok
+static int capture_open(void) {
+
+  cap_fp = fopen(config.capture_file, "a");
+  if (! cap_fp) {
+    wlog(L_ERR, "capture: failed to open '%s': %s", config.capture_file, strerror(errno));
+    return 1;
+  }
+
+  struct stat st;
+  cap_size = fstat(fileno(cap_fp), &st) ? 0 : st.st_size;
+  if (cap_size)
+    return 0;
+
+  struct capture_header hdr;
+  struct timespec ts;
+  memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+  clock_gettime(CLOCK_REALTIME, &ts);
+  hdr.realtime = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  hdr.monotime = stats_now();
+  if (fwrite(&hdr, sizeof(hdr), 1, cap_fp) != 1) {
+    wlog(L_ERR, "capture: failed to write '%s': %s", config.capture_file, strerror(errno));
+    fclose(cap_fp);
+    cap_fp = NULL;
+    return 1;
+  }
+  cap_size = sizeof(hdr);
+
+  return 0;
+}
+
+
+//! rotate capture file: file -> file.1 -> ... -> file.N (dropped)
+static void capture_rotate(void) {
+
+  fclose(cap_fp);
+  cap_fp = NULL;
+
+  size_t len = strlen(config.capture_file) + 16;
+  char *from = malloc(len), *to = malloc(len);
+  assert(from && to);
+
+  int i;
+  for (i = config.capture_keep; i > 0; i --) {
+    if (i > 1)
+      snprintf(from, len, "%s.%d", config.capture_file, i - 1);
+    else
+      snprintf(from, len, "%s", config.capture_file);
+    snprintf(to, len, "%s.%d", config.capture_file, i);
+    if (rename(from, to) && errno != ENOENT)
+      wlog(L_WARN, "capture: failed to rename '%s' to '%s': %s", from, to, strerror(errno));
+  }
+  if (! config.capture_keep)
+    unlink(config.capture_file);
+
+  free(from);
+  free(to);
+
+  wlog(L_INFO, "capture: rotated '%s'", config.capture_file);
+
+  capture_open();
+}
+
+
+//! take buffer to write out: the full one or the current one (swapped)
+//! \return buffer index
+static int capture_take(void) {
+  pthread_mutex_lock(&cap_mutex);
+  if (! cap_len[! cap_cur] && cap_len[cap_cur])
+    cap_cur = ! cap_cur;
+  int idx = ! cap_cur;
+  pthread_mutex_unlock(&cap_mutex);
+  return idx;
+}
+
+
+//! write buffer out (under cap_file_mutex)
+//! \param idx buffer index
+static void capture_write(int idx) {
+
+  if (! cap_len[idx])
+    return;
+
+  if (cap_fp) {
+    if (fwrite(cap_buf[idx], cap_len[idx], 1, cap_fp) != 1 || fflush(cap_fp))
+      wlog(L_ERR, "capture: failed to write '%s': %s", config.capture_file, strerror(errno));
+    cap_size += cap_len[idx];
+    if (config.capture_rotate && cap_size >= config.capture_rotate)
+      capture_rotate();
+  }
+
+  pthread_mutex_lock(&cap_mutex);
+  cap_len[idx] = 0;
+  pthread_mutex_unlock(&cap_mutex);
+}
+
+
+//! capture writer thread
+static void *capture_writer(void *arg) {
+
+  uint64_t dropped = 0;
+
+  while (1) {
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CAPTURE_FLUSH_MSECS / 1000;
+    deadline.tv_nsec += (CAPTURE_FLUSH_MSECS % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec ++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&cap_file_mutex);
+
+    pthread_mutex_lock(&cap_mutex);
+    if (! cap_len[! cap_cur])
+      pthread_cond_timedwait(&cap_cond, &cap_mutex, &deadline);
+    pthread_mutex_unlock(&cap_mutex);
+
+    capture_write(capture_take());
+
+    pthread_mutex_unlock(&cap_file_mutex);
+
+    uint64_t now_dropped = __atomic_load_n(&cap_dropped, __ATOMIC_RELAXED);
+    if (now_dropped != dropped) {
+      wlog(L_WARN, "capture: %llu records dropped (writer is too slow)",
+           (unsigned long long)(now_dropped - dropped));
+      dropped = now_dropped;
+    }
+  }
+
+  return NULL;
+}
+
+
+//! append capture record
+//! \param type record type
+//! \param id request id
+//! \param ts record time, nsecs
+//! \param latency response latency, usecs
+//! \param data record data
+static void capture_put(int type, uint32_t id, uint64_t ts, uint32_t latency, char *data) {
+
+  size_t len = strlen(data);
+  if (len > UINT16_MAX)
+    len = UINT16_MAX;
+
+  struct capture_rec rec;
+  rec.ts = ts;
+  rec.id = id;
+  rec.latency = latency;
+  rec.len = len;
+  rec.type = type;
+  rec.reserved = 0;
+
+  pthread_mutex_lock(&cap_mutex);
+
+  // no room: pass this buffer to the writer if it is idle
+  if (cap_len[cap_cur] + sizeof(rec) + len > CAPTURE_BUF_SIZE) {
+    if (cap_len[! cap_cur]) {
+      pthread_mutex_unlock(&cap_mutex);
+      __atomic_add_fetch(&cap_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    cap_cur = ! cap_cur;
+    pthread_cond_signal(&cap_cond);
+  }
+
+  char *p = cap_buf[cap_cur] + cap_len[cap_cur];
+  memcpy(p, &rec, sizeof(rec));
+  memcpy(p + sizeof(rec), data, len);
+  cap_len[cap_cur] += sizeof(rec) + len;
+
+  pthread_mutex_unlock(&cap_mutex);
+}
+
+
+//! capture request line (if sampled)
+//! \param line squid input line
+//! \param received when the line was read (see stats_now())
+//! \return request id to capture its response with (0 if not sampled)
+uint32_t capture_request(char *line, uint64_t received) {
+
+  if (! cap_fp)
+    return 0;
+
+  uint32_t id = __atomic_add_fetch(&cap_seq, 1, __ATOMIC_RELAXED);
+  if (! id || (config.capture_sample > 1 && id % config.capture_sample))
+    return 0;
+
+  capture_put(CAPTURE_REQUEST, id, received, 0, line);
+
+  return id;
+}
+
+
+//! capture response line
+//! \param id request id (see capture_request(), 0 is ignored)
+//! \param line response line
+//! \param received when the request was read (see stats_now())
+void capture_response(uint32_t id, char *line, uint64_t received) {
+
+  if (! id)
+    return;
+
+  uint64_t now = stats_now();
+  uint64_t usecs = (now - received) / 1000;
+  capture_put(CAPTURE_RESPONSE, id, now, usecs > UINT32_MAX ? UINT32_MAX : usecs, line);
+}
+
+
+//! write out buffered records (to be called before exit/exec)
+void capture_flush(void) {
+
+  if (! cap_fp)
+    return;
+
+  pthread_mutex_lock(&cap_file_mutex);
+  capture_write(capture_take());
+  capture_write(capture_take());
+  pthread_mutex_unlock(&cap_file_mutex);
+}
+
+
+//! start traffic capture (if configured)
+//! \return 0 if ok
+int capture_init(void) {
+
+  if (! config.capture_file)
+    return 0;
+
+  int i;
+  for (i = 0; i < 2; i ++) {
+    cap_buf[i] = malloc(CAPTURE_BUF_SIZE);
+    assert(cap_buf[i]);
+  }
+
+  if (capture_open())
+    return 1;
+
+  pthread_t thread_id;
+  pthread_attr_t thread_attr;
+  pthread_attr_init(&thread_attr);
+  pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+  int err = pthread_create(&thread_id, &thread_attr, capture_writer, NULL);
+  pthread_attr_destroy(&thread_attr);
+  if (err) {
+    wlog(L_ERR, "capture: failed to start writer thread");
+    fclose(cap_fp);
+    cap_fp = NULL;
+    return 1;
+  }
+
+  wlog(L_INFO, "capture: writing 1 of %d requests into '%s'",
+       config.capture_sample > 1 ? config.capture_sample : 1, config.capture_file);
+
+  return 0;
+}
+
@@ -0,0 +1,48 @@
+/** \file */
+
+
+#ifndef __ACLH_CAPTURE_H__
+#define __ACLH_CAPTURE_H__
+
+//! capture file magic (followed by struct capture_header)
+#define CAPTURE_MAGIC       "ACLHCAP1"
+
+//! capture buffer size (there are two of them)
+#define CAPTURE_BUF_SIZE    (1024 * 1024)
+
+//! capture writer wakeup period, msecs
+#define CAPTURE_FLUSH_MSECS 1000
+
+//! default number of rotated capture files to keep
+#define DEFAULT_CAPTURE_KEEP  5
+
+//! capture records types
+enum capture_type {
+  CAPTURE_REQUEST = 1,          //!< squid input line
+  CAPTURE_RESPONSE = 2,         //!< our response line
+};
+
+//! capture file header (written once into a new file)
+struct capture_header {
+  char magic[8];                //!< CAPTURE_MAGIC
+  uint64_t realtime;            //!< wall clock time at file creation, nsecs
+  uint64_t monotime;            //!< monotonic time at file creation, nsecs
+} __attribute__((packed));
+
+//! capture record (host byte order), followed by 'len' bytes of data
+struct capture_rec {
+  uint64_t ts;                  //!< monotonic time, nsecs (see stats_now())
+  uint32_t id;                  //!< request id (pairs response with its request)
+  uint32_t latency;             //!< response only: usecs since request was read
+  uint16_t len;                 //!< data length (no trailing '\0')
+  uint8_t type;                 //!< record type (enum capture_type)
+  uint8_t reserved;             //!< zero
+} __attribute__((packed));
+
+extern int capture_init(void);
+extern uint32_t capture_request(char *, uint64_t);
+extern void capture_response(uint32_t, char *, uint64_t);
+extern void capture_flush(void);
+
+#endif //__ACLH_CAPTURE_H__
+
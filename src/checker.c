@@ -11,30 +11,38 @@
 #include "misc.h"
 #include "loop.h"
 #include "source.h"
+#include "stats.h"
+#include "mem.h"
+#include "snapshot.h"
+#include "query.h"
 
 #include "checker.h"
 
 
-static void *rmatch_dummy(int, node_t **, int, char **);
-static void *rmatch_string(int, node_t **, int, char **);
-static void *rmatch_shell(int, node_t **, int, char **);
+static void *rmatch_dummy(int, node_t **, int, char **, struct checker *);
+static void *rmatch_string(int, node_t **, int, char **, struct checker *);
+static void *rmatch_shell(int, node_t **, int, char **, struct checker *);
 #ifdef USE_REGEX
-static void *rmatch_regex(int, node_t **, int, char **);
+static void *rmatch_regex(int, node_t **, int, char **, struct checker *);
 #endif
 #ifdef USE_PCRE
-static void *rmatch_pcre(int, node_t **, int, char **);
+static void *rmatch_pcre(int, node_t **, int, char **, struct checker *);
 #endif
 #ifdef USE_SSL
-static void *rmatch_ssl(int, node_t **, int,  char **);
+static void *rmatch_ssl(int, node_t **, int,  char **, struct checker *);
 #endif
 #ifdef USE_GEOIP2
-static void *rmatch_geoip2(int, node_t **, int,  char **);
+static void *rmatch_geoip2(int, node_t **, int,  char **, struct checker *);
+static void *rmatch_geo(int, node_t **, int,  char **, struct checker *);
 #endif
 #ifdef USE_RESOLVE
-static void *rmatch_resolve(int, node_t **, int, char **);
-static void *rmatch_dresolve(int, node_t **, int, char **);
+static void *rmatch_resolve(int, node_t **, int, char **, struct checker *);
+static void *rmatch_dresolve(int, node_t **, int, char **, struct checker *);
+#endif
+static void *rmatch_ip(int, node_t **, int, char **, struct checker *);
+#ifdef USE_SQLITE3
+static void *rmatch_query(int, node_t **, int, char **, struct checker *);
 #endif
-static void *rmatch_ip(int, node_t **, int, char **);
 
 //! available checkers drivers
 static cdriver_t checker_drivers[] = {
@@ -44,7 +52,7 @@ static cdriver_t checker_drivers[] = {
   {"string",        TYPE_STRING,      0,  rmatch_string},
   {"istring",       TYPE_STRING,      1,  rmatch_string},
   {"ip",            TYPE_IP,          0,  rmatch_ip},
-  {"resolve",       TYPE_IP,          0,  rmatch_resolve},
+  {"resolve",       TYPE_IP,          0,  rmatch_resolve,   1},
   {"dresolve",      TYPE_LIST,        1,  rmatch_dresolve},
   // shell pattern based checkers
   {"match",         TYPE_SHELL,       0,  rmatch_shell},
@@ -61,11 +69,17 @@ static cdriver_t checker_drivers[] = {
 #endif
   // special ssl based checkers
 #ifdef USE_SSL
-  {"ssl",           TYPE_SSL,         0,  rmatch_ssl},
+  {"ssl",           TYPE_SSL,         0,  rmatch_ssl,       1},
 #endif
   // geoip2 checker
 #ifdef USE_GEOIP2
-  {"geoip2",        TYPE_IP,         0,  rmatch_geoip2},
+  {"geoip2",        TYPE_IP,          0,  rmatch_geoip2,    1},
+  {"geoip2country",   TYPE_GEO,       1,  rmatch_geo,       1},
+  {"geoip2continent", TYPE_GEO,       1,  rmatch_geo,       1},
+#endif
+  // on-demand sqlite3 query checker
+#ifdef USE_SQLITE3
+  {"query",         TYPE_QUERY,       0,  rmatch_query},
 #endif
 
   // terminator!
@@ -73,9 +87,38 @@ static cdriver_t checker_drivers[] = {
 };
 
 
-//! private configured checkers data
+//! configured checkers (to be loaded by checkers_init())
 static struct checker *checkers;
 
+//! checkers generation: loaded checkers and everything their data
+//! depends on; on reload a new one is built aside and published with
+//! a single atomic pointer store, the old one is freed when requests
+//! which may be using it are done
+struct checkers_gen {
+  struct checker *checkers;  //!< checkers list
+  struct snapshot *snap;     //!< mapped snapshot records are taken from (NULL if none)
+};
+
+//! current checkers generation
+static struct checkers_gen *current;
+
+//! reclamation epoch: bumped on every generation publication
+static uint64_t epoch;
+
+//! requests in flight per epoch parity and shard (shards counters are
+//! a cache line apart, so requests don't bounce it between cpus)
+static int readers[2][RECORD_HITS_SHARDS][16];
+
+//! counters shard of current thread (record hits and readers)
+static __thread int thread_shard = -1;
+
+//! next counters shard to give to a thread
+static int thread_shard_next;
+
+static int checker_reuse(struct checker *);
+static void checkers_publish(struct checkers_gen *);
+static void checkers_discard(struct checkers_gen *);
+
 
 
 //! parse checker config line and create new checker in list
@@ -252,188 +295,692 @@ static int rec_cmp_p(const void *r1, const void *r2) {
 
 
 
-//! parse loaded checker data into records and build a tree from them
+#ifdef USE_GEOIP2
+//! compiled geo checker data: it replaces geo codes tree as the only
+//! key of checker records root
+struct geo_table {
+  struct geoip2_range *ranges;  //!< sorted IPv4 ranges of wanted codes
+  int n_ranges;                 //!< number of ranges
+  struct record **recs;         //!< wanted codes records (range code is index here)
+  int n_recs;                   //!< number of wanted codes
+};
+
+//! collect geo code record into table
+static void geo_collect(void *key, void *arg) {
+  struct geo_table *gt = arg;
+  gt->recs[gt->n_recs ++] = key;
+}
+
+//! compile loaded geo codes into ip ranges table
 //! \param cp checker pointer
-//! \param data raw records data
-//! \return num of loaded records or -1 on error
-static int checker_store_records(struct checker *cp, char *data) {
-
-  int recnum = 0;
-
-  // data must be 'one record per line'
-  char *d1 = data, *d2;
-  while (*d1) {
-
-    // search for '\n' or '\0'
-    d2 = strchrnul(d1, '\n');
-
-    // found!
-    if (d2 != d1) {
-
-      // extract line and strip it from excessive blanks
-      char *line = strndup(d1, d2 - d1);
-      assert(line);
-      char *stripped_line = strip_blanks(line);
-      // the line is empty - ignore it
-      if (! *stripped_line) {
-        free(line);
-        d1 = ++ d2;
-        continue;
+//! \param recnum number of loaded codes
+//! \return 0 if ok, !0 otherwise
+static int checker_geo_compile(struct checker *cp, int recnum) {
+
+  struct geo_table *gt = calloc(1, sizeof(struct geo_table));
+  assert(gt);
+  gt->recs = calloc(recnum, sizeof(struct record *));
+  assert(gt->recs);
+  tree_walk(cp->records, geo_collect, gt);
+
+  char **codes = calloc(gt->n_recs, sizeof(char *));
+  assert(codes);
+  int i;
+  for (i = 0; i < gt->n_recs; i ++)
+    codes[i] = gt->recs[i]->data;
+
+  // walk geo db once
+  gt->n_ranges = geoip2_ranges(codes, gt->n_recs, ! strcmp(cp->driver->name, "geoip2continent"), &gt->ranges);
+  free(codes);
+  if (gt->n_ranges < 0) {
+    free(gt->recs);
+    free(gt);
+    return 1;
+  }
+
+  wlog(L_INFO, "checker '%s': %d geo codes compiled into %d IPv4 ranges", cp->name, gt->n_recs, gt->n_ranges);
+
+  // codes records are kept in the table, the tree is replaced by it
+  tree_free(cp->records, NULL);
+  cp->records = calloc(1, sizeof(node_t));
+  assert(cp->records);
+  cp->records->key = gt;
+
+  return 0;
+}
+#endif
+
+
+//! checker records mapped from snapshot: they replace records tree,
+//! only compiled patterns (if any) are kept in memory
+struct snap_table {
+  struct snapshot *sp;       //!< mapped snapshot
+  struct snap_set *set;      //!< mapped snapshot set
+  void **compiled;           //!< compiled regex/pcre patterns (NULL if none)
+};
+
+
+//! check if checker driver records may be taken from snapshot
+//! \param driver checker driver
+//! \return !0 if so
+static int checker_snapshotable(cdriver_t *driver) {
+  void *(*f)() = driver->match_func;
+  if (f == rmatch_string || f == rmatch_ip || f == rmatch_shell)
+    return 1;
+#ifdef USE_RESOLVE
+  if (f == rmatch_resolve || f == rmatch_dresolve)
+    return 1;
+#endif
+#ifdef USE_REGEX
+  if (f == rmatch_regex)
+    return 1;
+#endif
+#ifdef USE_PCRE
+  if (f == rmatch_pcre)
+    return 1;
+#endif
+  return 0;
+}
+
+
+//! take checker records from mapped snapshot
+//! \param cp checker pointer
+//! \param sp mapped snapshot (may be NULL)
+//! \return 0 if ok, !0 if snapshot has no (up to date) records of this checker
+static int checker_snap_load(struct checker *cp, struct snapshot *sp) {
+
+  if (! sp || ! checker_snapshotable(cp->driver))
+    return 1;
+
+  // data changed on reload is loaded from the source even if the snapshot
+  // can't tell it (sources with unknown data version are always changed)
+  if (current && source_changed(cp->source))
+    return 1;
+
+  struct source *src = source_get(cp->source);
+  struct snap_set *set = snapshot_set(sp, cp->name, cp->driver->name, cp->source, cp->source_filter,
+                                      src ? src->params : NULL, src ? src->stamp : NULL);
+  if (! set)
+    return 1;
+
+  struct snap_table *st = calloc(1, sizeof(struct snap_table));
+  assert(st);
+  st->sp = sp;
+  st->set = set;
+  cp->records_num = set->n_recs;
+
+  // patterns are compiled in runtime, there is no way to map them
+  uint32_t i;
+  switch (cp->driver->type) {
+#ifdef USE_REGEX
+    case TYPE_REGEX :
+      st->compiled = calloc(set->n_recs + 1, sizeof(void *));
+      assert(st->compiled);
+      for (i = 0; i < set->n_recs; i ++) {
+        regex_t *r = malloc(sizeof(regex_t));
+        assert(r);
+        if (regcomp(r, snapshot_data(sp, set, i), REG_EXTENDED | (cp->driver->icase ? REG_ICASE : 0))) {
+          wlog(L_WARN, "skipping invalid regex pattern [%s]", snapshot_data(sp, set, i));
+          free(r);
+        } else
+          st->compiled[i] = r;
+      }
+      break;
+#endif
+#ifdef USE_PCRE
+    case TYPE_PCRE :
+      st->compiled = calloc(set->n_recs + 1, sizeof(void *));
+      assert(st->compiled);
+      for (i = 0; i < set->n_recs; i ++) {
+        const char *err_str;
+        int err_off;
+        st->compiled[i] = pcre_compile(snapshot_data(sp, set, i), PCRE_ANCHORED | (cp->driver->icase ? PCRE_CASELESS : 0),
+                                       &err_str, &err_off, NULL);
+        if (! st->compiled[i])
+          wlog(L_WARN, "skipping invalid pcre pattern [%s] => %s:%d", snapshot_data(sp, set, i), err_str, err_off);
+      }
+      break;
+#endif
+    default:
+      break;
+  }
+
+  cp->snap = st;
+
+  return 0;
+}
+
+
+//! matched snapshot record (valid until next match in this thread)
+static __thread struct record snap_record;
+
+//! find data in checker snapshot records
+//! \param cp checker pointer
+//! \param tokens broken squid input string array
+//! \return pointer to found record or NULL
+static struct record *checker_snap_match(struct checker *cp, char **tokens) {
+
+  struct snapshot *sp = cp->snap->sp;
+  struct snap_set *set = cp->snap->set;
+  char *token = tokens[cp->field_idx];
+  int64_t found = -1;
+  uint32_t i;
+
+  switch (cp->driver->type) {
+
+    // sorted strings: binary search
+    case TYPE_STRING :
+      found = snapshot_find_string(sp, set, token);
+      break;
+
+    // grouped networks: binary search per mask
+    case TYPE_IP :
+      if (cp->driver->resolves) {
+        in_addr_t ips[MAX_RESOLVED_IPS + 1];
+        int n_ips = resolve_host(token, ips, MAX_RESOLVED_IPS);
+        if (n_ips < 1)
+          wlog(L_WARN, "failed to resolve '%s'", token);
+        for (-- n_ips; n_ips >= 0 && found < 0; n_ips --)
+          found = snapshot_find_ip(sp, set, ips[n_ips]);
+      } else {
+        in_addr_t ip, net;
+        if (str2ipaddr(token, &ip, &net))
+          wlog(L_WARN, "invalid ip '%s'", token);
+        else
+          found = snapshot_find_ip(sp, set, ip);
       }
+      break;
 
-      // create new record
-      struct record *rp = calloc(1, sizeof(struct record));
-      assert(rp);
-      rp->data = line;
- 
-      wlog(L_DEBUG9, "will add [%s]", rp->data);
-
-      // add new record node to the tree
-      int not_added = 0;
-      switch (cp->driver->type) {
-
-        // list (degraded tree) ops for exact matches
-        case TYPE_LIST :
-          // add to list but skip duplicates
-          if (cp->driver->icase)
-            tree_search(rp, &cp->records, rec_cmp_li);
-          else
-            tree_search(rp, &cp->records, rec_cmp_l);
-          // attempt to insert already existing entry?
-          if (errno != ENOENT)
-            not_added ++;
-          break;
+    // patterns: scan them all
+    case TYPE_SHELL :
+      for (i = 0; i < set->n_recs && found < 0; i ++) {
+        if (! fnmatch(snapshot_data(sp, set, i), token, cp->driver->icase ? FNM_CASEFOLD : 0))
+          found = i;
+      }
+      break;
 
-        // full tree ops for exact matches
-        case TYPE_STRING :
-        case TYPE_DUMMY :
-          // add to tree but skip duplicates
-          if (cp->driver->icase)
-            tree_search(rp, &cp->records, rec_cmp_si);
-          else
-            tree_search(rp, &cp->records, rec_cmp_s);
-          // attempt to insert already existing entry?
-          if (errno != ENOENT)
-            not_added ++;
+#ifdef USE_REGEX
+    case TYPE_REGEX :
+      for (i = 0; i < set->n_recs && found < 0; i ++) {
+        if (cp->snap->compiled[i] && ! regexec(cp->snap->compiled[i], token, 0, NULL, 0))
+          found = i;
+      }
+      break;
+#endif
+
+#ifdef USE_PCRE
+    case TYPE_PCRE :
+      for (i = 0; i < set->n_recs && found < 0; i ++) {
+        if (cp->snap->compiled[i] && pcre_exec(cp->snap->compiled[i], NULL, token, strlen(token), 0, 0, 0, 0) >= 0)
+          found = i;
+      }
+      break;
+#endif
+
+    // dynamic hosts: resolve them all ('dresolve')
+    case TYPE_LIST :
+      {
+        in_addr_t ip;
+        if (str2ipaddr(token, &ip, NULL)) {
+          wlog(L_WARN, "dresolve: invalid IP [%s]", token);
           break;
+        }
+        for (i = 0; i < set->n_recs && found < 0; i ++) {
+          in_addr_t ips[MAX_RESOLVED_IPS + 1];
+          int n_ips = resolve_host(snapshot_data(sp, set, i), ips, MAX_RESOLVED_IPS);
+          for (; n_ips > 0; n_ips --) {
+            if (ips[n_ips - 1] == ip) {
+              found = i;
+              break;
+            }
+          }
+        }
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  if (found < 0)
+    return NULL;
+
+  snap_record.data = snapshot_data(sp, set, found);
+  snap_record.id = found + 1;
+  snap_record.ret = NULL;
+
+  return &snap_record;
+}
+
+
+//! interned records data string: lists having the same entries
+//! share one copy of it
+struct interned {
+  struct interned *next;     //!< next in hash chain
+  uint32_t refs;             //!< number of records using it
+  char data[];               //!< the string
+};
+
+//! interned strings hash table (chains), grown to keep chains short
+static struct interned **intern_table;
+
+//! interned strings hash table size (power of 2)
+static size_t intern_size;
+
+//! number of interned strings
+static size_t intern_num;
+
+//! interned strings lock (records are loaded and freed concurrently)
+static pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//! interned string hash (FNV-1a)
+static uint32_t intern_hash(char *str) {
+  uint32_t h = 2166136261u;
+  while (*str)
+    h = (h ^ (unsigned char)*str ++) * 16777619u;
+  return h;
+}
+
+
+//! get interned copy of a string (or just a copy if interning is off)
+//! \param str the string
+//! \return interned string (to be released by record_unintern())
+static char *record_intern(char *str) {
+
+  if (! config.intern_records) {
+    char *copy = strdup(str);
+    assert(copy);
+    return copy;
+  }
+
+  uint32_t h = intern_hash(str);
+  pthread_mutex_lock(&intern_mutex);
+
+  // grow the table
+  if (intern_num >= intern_size) {
+    size_t size = intern_size ? intern_size * 2 : 1024, i;
+    struct interned **table = calloc(size, sizeof(struct interned *));
+    assert(table);
+    for (i = 0; i < intern_size; i ++) {
+      struct interned *in = intern_table[i], *next;
+      for (; in; in = next) {
+        next = in->next;
+        struct interned **slot = &table[intern_hash(in->data) & (size - 1)];
+        in->next = *slot;
+        *slot = in;
+      }
+    }
+    free(intern_table);
+    intern_table = table;
+    intern_size = size;
+  }
+
+  struct interned **slot = &intern_table[h & (intern_size - 1)], *in;
+  for (in = *slot; in; in = in->next) {
+    if (! strcmp(in->data, str)) {
+      in->refs ++;
+      pthread_mutex_unlock(&intern_mutex);
+      return in->data;
+    }
+  }
+
+  size_t len = strlen(str);
+  in = malloc(sizeof(struct interned) + len + 1);
+  assert(in);
+  in->refs = 1;
+  memcpy(in->data, str, len + 1);
+  in->next = *slot;
+  *slot = in;
+  intern_num ++;
+
+  pthread_mutex_unlock(&intern_mutex);
+  return in->data;
+}
+
+
+//! release interned string
+//! \param data interned string
+static void record_unintern(char *data) {
+
+  if (! config.intern_records) {
+    free(data);
+    return;
+  }
+
+  struct interned *in = (struct interned *)(data - offsetof(struct interned, data));
+
+  pthread_mutex_lock(&intern_mutex);
+  if (! -- in->refs) {
+    struct interned **slot = &intern_table[intern_hash(data) & (intern_size - 1)];
+    while (*slot != in)
+      slot = &(*slot)->next;
+    *slot = in->next;
+    intern_num --;
+    free(in);
+  }
+  pthread_mutex_unlock(&intern_mutex);
+}
+
+
+//! records load state
+struct store_state {
+  struct checker *cp;        //!< checker pointer
+  int recnum;                //!< number of stored records
+};
+
+//! parse source data line into a record and add it to checker tree
+//! \param data source data line
+//! \param len line length
+//! \param arg records load state
+static void checker_store_record(char *data, size_t len, void *arg) {
+
+  struct store_state *ss = arg;
+  struct checker *cp = ss->cp;
+
+  // strip the line from excessive blanks
+  char *stripped_line = strip_blanks(data);
+  // the line is empty - ignore it
+  if (! *stripped_line)
+    return;
+
+  // create new record (its data is interned)
+  struct record *rp = calloc(1, sizeof(struct record));
+  assert(rp);
+  rp->data = record_intern(data);
+ 
+  wlog(L_DEBUG9, "will add [%s]", rp->data);
+
+  // add new record node to the tree
+  int not_added = 0;
+  switch (cp->driver->type) {
+
+    // list (degraded tree) ops for exact matches
+    case TYPE_LIST :
+      // add to list but skip duplicates
+      if (cp->driver->icase)
+        tree_search(rp, &cp->records, rec_cmp_li);
+      else
+        tree_search(rp, &cp->records, rec_cmp_l);
+      // attempt to insert already existing entry?
+      if (errno != ENOENT)
+        not_added ++;
+      break;
+
+    // full tree ops for exact matches
+    case TYPE_STRING :
+    case TYPE_DUMMY :
+      // add to tree but skip duplicates
+      if (cp->driver->icase)
+        tree_search(rp, &cp->records, rec_cmp_si);
+      else
+        tree_search(rp, &cp->records, rec_cmp_s);
+      // attempt to insert already existing entry?
+      if (errno != ENOENT)
+        not_added ++;
+      break;
 
 #ifdef USE_MATCH
-        // patterns, regexes and pcre need no tree :(
-        case TYPE_SHELL :
-          // add to tree but skip duplicates
-          if (cp->driver->icase)
-            tree_search(rp, &cp->records, rec_cmp_mi);
-          else
-            tree_search(rp, &cp->records, rec_cmp_m);
-          // attempt to insert already existing entry?
-          if (errno != ENOENT) 
-            not_added ++;
-          break;
+    // patterns, regexes and pcre need no tree :(
+    case TYPE_SHELL :
+      // add to tree but skip duplicates
+      if (cp->driver->icase)
+        tree_search(rp, &cp->records, rec_cmp_mi);
+      else
+        tree_search(rp, &cp->records, rec_cmp_m);
+      // attempt to insert already existing entry?
+      if (errno != ENOENT) 
+        not_added ++;
+      break;
 #endif
 
-        case TYPE_IP :
-          if (str2ipaddr(rp->data, &rp->rec.a.ip, &rp->rec.a.net)) {
-            wlog(L_WARN, "skipping invalid IP [%s]", rp->data);
-            not_added ++;
-          } else {
-            rp->rec.a.ipnet = rp->rec.a.ip & rp->rec.a.net;
-            // add to tree but skip duplicates
-            tree_search(rp, &cp->records, rec_cmp_ip);
-            if (errno != ENOENT)
-              not_added ++;
-          }
-          break;
+    case TYPE_IP :
+      if (str2ipaddr(rp->data, &rp->rec.a.ip, &rp->rec.a.net)) {
+        wlog(L_WARN, "skipping invalid IP [%s]", rp->data);
+        not_added ++;
+      } else {
+        rp->rec.a.ipnet = rp->rec.a.ip & rp->rec.a.net;
+        // add to tree but skip duplicates
+        tree_search(rp, &cp->records, rec_cmp_ip);
+        if (errno != ENOENT)
+          not_added ++;
+        else
+          cp->ip_masks |= 1ULL << __builtin_popcount(rp->rec.a.net);
+      }
+      break;
 
 #ifdef USE_REGEX
-        // precompile regex
-        case TYPE_REGEX :
-          {
-            rp->rec.r = malloc(sizeof(regex_t));
-            assert(rp->rec.r);
-            int rflags = REG_EXTENDED;
-            if (cp->driver->icase)
-              rflags |= REG_ICASE;
-            int reg_err = regcomp(rp->rec.r, rp->data, rflags);
-            if (reg_err) {
-              char err_buf[128];
-              regerror(reg_err, rp->rec.r, err_buf, sizeof(err_buf) - 1);
-              wlog(L_WARN, "skipping invalid regex pattern [%s] => %s", rp->data, err_buf);
-              //regfree(rp->rec.r);
-              free(rp->rec.r);
-              not_added ++;
-            } else {
-              tree_search(rp, &cp->records, rec_cmp_r);
-              // attempt to insert already existing entry?
-              if (errno != ENOENT) {
-                regfree(rp->rec.r);
-                free(rp->rec.r);
-                not_added ++;
-              }
-            }
+    // precompile regex
+    case TYPE_REGEX :
+      {
+        rp->rec.r = malloc(sizeof(regex_t));
+        assert(rp->rec.r);
+        int rflags = REG_EXTENDED;
+        if (cp->driver->icase)
+          rflags |= REG_ICASE;
+        int reg_err = regcomp(rp->rec.r, rp->data, rflags);
+        if (reg_err) {
+          char err_buf[128];
+          regerror(reg_err, rp->rec.r, err_buf, sizeof(err_buf) - 1);
+          wlog(L_WARN, "skipping invalid regex pattern [%s] => %s", rp->data, err_buf);
+          //regfree(rp->rec.r);
+          free(rp->rec.r);
+          not_added ++;
+        } else {
+          tree_search(rp, &cp->records, rec_cmp_r);
+          // attempt to insert already existing entry?
+          if (errno != ENOENT) {
+            regfree(rp->rec.r);
+            free(rp->rec.r);
+            not_added ++;
           }
-          break;
+        }
+      }
+      break;
 #endif
 
 #ifdef USE_PCRE
-        // precompile pcre
-        case TYPE_PCRE :
-          {
-            int pflags = PCRE_ANCHORED;
-            if (cp->driver->icase)
-              pflags |= PCRE_CASELESS;
-            const char *err_str;
-            int err_off;
-            rp->rec.p = pcre_compile(rp->data, pflags, &err_str, &err_off, NULL);
-            if (rp->rec.p == NULL)
-              wlog(L_WARN, "skipping invalid pcre pattern [%s] => %s:%d", rp->data, err_str, err_off);
-            else
-              tree_search(rp, &cp->records, rec_cmp_p);
-              // attempt to insert already existing entry?
-              if (errno != ENOENT)
-                not_added ++;
-          }
-          break;
+    // precompile pcre
+    case TYPE_PCRE :
+      {
+        int pflags = PCRE_ANCHORED;
+        if (cp->driver->icase)
+          pflags |= PCRE_CASELESS;
+        const char *err_str;
+        int err_off;
+        rp->rec.p = pcre_compile(rp->data, pflags, &err_str, &err_off, NULL);
+        if (rp->rec.p == NULL)
+          wlog(L_WARN, "skipping invalid pcre pattern [%s] => %s:%d", rp->data, err_str, err_off);
+        else
+          tree_search(rp, &cp->records, rec_cmp_p);
+          // attempt to insert already existing entry?
+          if (errno != ENOENT)
+            not_added ++;
+      }
+      break;
 #endif
 
-        // others (unknown?)
-        default:
-          break;
+#ifdef USE_GEOIP2
+    // geo codes: just collect them, ranges table is compiled later
+    case TYPE_GEO :
+      tree_search(rp, &cp->records, rec_cmp_si);
+      // attempt to insert already existing entry?
+      if (errno != ENOENT)
+        not_added ++;
+      break;
+#endif
 
-      } //switch(type...)
+    // others (unknown?)
+    default:
+      break;
 
-      // failed to add new record
-      if (not_added) {
-        if (line)
-          free(line);
-        if (rp)
-          free(rp);
-      } else
-        recnum ++;
+  } //switch(type...)
 
-      // last '\n' hit
-      if (! *d2)
-        break;
+  // failed to add new record
+  if (not_added) {
+    record_unintern(rp->data);
+    free(rp);
+  } else {
+    rp->id = ++ cp->records_num;
+    ss->recnum ++;
+  }
+}
 
-    } // if(found...)
 
-    // advance in data string
-    d1 = ++ d2;
+//! finish records load: build what is built over all of them
+//! \param cp checker pointer
+//! \param recnum num of loaded records
+//! \return 0 if ok, !0 otherwise
+static int checker_store_finish(struct checker *cp, int recnum) {
 
-  } // while(data...)
+#ifdef USE_GEOIP2
+  // geo codes are matched via compiled ranges table
+  if (cp->driver->type == TYPE_GEO && recnum > 0 && checker_geo_compile(cp, recnum))
+    return 1;
+#endif
 
   // done
   wlog(L_DEBUG9, "added %d records", recnum);
-  return recnum;
+  return 0;
+}
+
+
+//! checker records load job
+struct load_job {
+  struct checker *cp;        //!< checker pointer
+  struct snapshot *sp;       //!< mapped snapshot (NULL if none)
+  int failed;                //!< records load failed
+};
+
+//! load checker records: keep records of unchanged source, else take
+//! them from snapshot if it has them, else load them from source
+//! (failed checker is disabled)
+//! \param arg load job
+static void checker_load(void *arg) {
+
+  struct load_job *job = arg;
+  struct checker *cp = job->cp;
+  uint64_t started = stats_now();
+
+  if (! checker_reuse(cp))
+    return;
+
+#ifdef USE_SQLITE3
+  // nothing to load: the query is run per request
+  if (cp->driver->type == TYPE_QUERY) {
+    struct query *q = query_open(source_sqlite3_db(cp->source), cp->source_filter);
+    if (! q) {
+      wlog(L_WARN, "checker '%s': no sqlite3 source '%s' or invalid query", cp->name, cp->source);
+      wlog(L_WARN, "checker '%s' failed to init, disabling it", cp->name);
+      cp->enable = 0;
+      job->failed = 1;
+      return;
+    }
+    cp->records = calloc(1, sizeof(node_t));
+    assert(cp->records);
+    cp->records->key = q;
+    cp->loaded = 1;
+    wlog(L_INFO, "checker '%s': querying source '%s' on demand", cp->name, cp->source);
+    return;
+  }
+#endif
+
+  if (! checker_snap_load(cp, job->sp)) {
+    wlog(L_INFO, "checker '%s': mapped %u records from snapshot", cp->name, cp->snap->set->n_recs);
+    return;
+  }
+
+  // stream source data lines into records
+  struct store_state ss = {cp, 0};
+  if (source_scan(cp->source, cp->source_filter, checker_store_record, &ss)) {
+    wlog(L_WARN, "checker '%s': source '%s' failed", cp->name, cp->source);
+    wlog(L_WARN, "checker '%s' failed to init, disabling it", cp->name);
+    cp->enable = 0;
+    job->failed = 1;
+  } else if (checker_store_finish(cp, ss.recnum)) {
+    wlog(L_ERR, "checker '%s': failed to load records from source '%s'", cp->name, cp->source);
+    job->failed = 1;
+  } else {
+    wlog(L_INFO, "checker '%s': loaded %d records from source '%s' in %.3f secs",
+         cp->name, ss.recnum, cp->source, (stats_now() - started) / 1e9);
+    cp->loaded = 1;
+  }
+}
+
+
+//! compare strings which may be NULL
+static int checker_strcmp(char *s1, char *s2) {
+  if (! s1 || ! s2)
+    return s1 != s2;
+  return strcmp(s1, s2);
+}
+
+
+//! check if checkers build the same records: they have the same source,
+//! filter and records kind (SSL caches and geo tables are not shared)
+//! \param cp1 checker pointer
+//! \param cp2 checker pointer
+//! \return !0 if so
+static int checker_shareable(struct checker *cp1, struct checker *cp2) {
+  cdriver_t *d1 = cp1->driver, *d2 = cp2->driver;
+  return d1->type == d2->type && d1->icase == d2->icase &&
+         d1->type != TYPE_DUMMY && d1->type != TYPE_SSL && d1->type != TYPE_GEO &&
+         checker_snapshotable(d1) == checker_snapshotable(d2) &&
+         ! checker_strcmp(cp1->source, cp2->source) && ! checker_strcmp(cp1->source_filter, cp2->source_filter);
+}
+
+
+//! use records of another checker of the same generation
+//! \param cp checker pointer
+//! \param owner checker owning the records
+static void checker_share(struct checker *cp, struct checker *owner) {
+
+  if (! owner->loaded && ! owner->snap) {
+    wlog(L_WARN, "checker '%s': source '%s' failed", cp->name, cp->source);
+    wlog(L_WARN, "checker '%s' failed to init, disabling it", cp->name);
+    cp->enable = 0;
+    return;
+  }
+
+  cp->records = owner->records;
+  cp->snap = owner->snap;
+  cp->records_num = owner->records_num;
+  cp->ip_masks = owner->ip_masks;
+  cp->loaded = owner->loaded;
+
+  wlog(L_INFO, "checker '%s': sharing %u records of checker '%s'", cp->name, cp->records_num, owner->name);
 }
 
 
-//! init all configured checkers
-//! \return 0 if ok
-int checkers_init(void) {
+//! init all configured checkers and put them in use
+//! (previously used ones are freed when requests are done with them);
+//! failed checkers are disabled on first init, on reload they keep
+//! checkers in use
+//! \param sp mapped snapshot to take records from (NULL if none),
+//!        it is owned by checkers since now
+//! \return 0 if ok, !0 if some checker failed and checkers in use are kept
+int checkers_init(struct snapshot *sp) {
+
+  struct checkers_gen *gen = calloc(1, sizeof(struct checkers_gen));
+  assert(gen);
+  gen->checkers = checkers;
+  gen->snap = sp;
+  checkers = NULL;
+
+  // checkers records load jobs
+  int n_jobs = 0;
+  struct checker *cp;
+  for (cp = gen->checkers; cp; cp = cp->next)
+    n_jobs ++;
+  struct load_job *jobs = calloc(n_jobs + 1, sizeof(struct load_job));
+  assert(jobs);
+  void **args = calloc(n_jobs + 1, sizeof(void *));
+  assert(args);
+  n_jobs = 0;
 
   // init each checker
-  struct checker *cp = checkers;
-  int err = 0;
+  cp = gen->checkers;
+  int err = 0, failed = 0;
   while (cp) {
 
     // check and init checker settings
@@ -525,26 +1072,18 @@ int checkers_init(void) {
       cp->notes = substed;
     }
 
-    // load data from source
-    char *data = source_data(cp->source, cp->source_filter);
-    if (! data) {
-      wlog(L_WARN, "checker '%s': source '%s' failed", cp->name, cp->source);
-      err ++;
-    } else {
-      // parse loaded data and store it
-      int recnum = checker_store_records(cp, data);
-      if (recnum < 0)
-        wlog(L_ERR, "checker '%s': failed to load records from source '%s'", cp->name, cp->source);
-      else
-        wlog(L_INFO, "checker '%s': loaded %d records from source '%s'", cp->name, recnum, cp->source);
-      free(data);
-    }
+    // records are loaded later, all checkers at once
+    jobs[n_jobs].cp = cp;
+    jobs[n_jobs].sp = sp;
+    args[n_jobs] = &jobs[n_jobs];
+    n_jobs ++;
 
 BAD_CHECKER:
     // checker problems? disable it!
     if (err) {
       wlog(L_WARN, "checker '%s' failed to init, disabling it", cp->name);
       cp->enable = 0;
+      failed ++;
       err = 0;
     }
 
@@ -553,41 +1092,342 @@ BAD_CHECKER:
 
   } //while(checker...)
 
+  // checkers with the same records load them once
+  int i, j, n_own = 0;
+  for (i = 0; i < n_jobs; i ++) {
+    for (j = 0; j < n_own; j ++) {
+      if (checker_shareable(jobs[i].cp, ((struct load_job *)args[j])->cp)) {
+        jobs[i].cp->shares = ((struct load_job *)args[j])->cp;
+        break;
+      }
+    }
+    if (! jobs[i].cp->shares)
+      args[n_own ++] = &jobs[i];
+  }
+
+  // load checkers records on a bounded threads pool: checkers data is
+  // independent, sources are only read
+  uint64_t started = stats_now();
+  run_jobs(checker_load, args, n_own, config.init_threads);
+  wlog(L_INFO, "%d checkers loaded in %.3f secs", n_own, (stats_now() - started) / 1e9);
+
+  for (i = 0; i < n_jobs; i ++) {
+    struct checker *owner = jobs[i].cp->shares;
+    if (owner)
+      checker_share(jobs[i].cp, owner);
+    failed += jobs[i].failed;
+  }
+
+  free(jobs);
+  free(args);
+
+  // reload must not put partial data in use
+  if (failed && current) {
+    checkers_discard(gen);
+    return failed;
+  }
+
+  // register checkers latency stats
+  for (cp = gen->checkers; cp; cp = cp->next)
+    cp->stats_idx = cp->driver ? stats_series_add(cp->name, cp->driver->name) : -1;
+
+  // per record hit counters are wanted (kept ones go on counting)
+  if (config.record_hits_file) {
+    uint32_t records_num = 0;
+    for (cp = gen->checkers; cp; cp = cp->next) {
+      int i;
+      for (i = 0; i < RECORD_HITS_SHARDS && ! cp->record_hits[i]; i ++) {
+        cp->record_hits[i] = calloc(cp->records_num + 1, sizeof(uint32_t));
+        assert(cp->record_hits[i]);
+      }
+      records_num += cp->records_num;
+    }
+    wlog(L_INFO, "counting hits of %u records", records_num);
+  }
+
+  checkers_publish(gen);
 
   // all done
   return 0;
 }
 
 
-//! dummy matching func, always matches anything
-static struct record dummy_record = { .data = "DUMMY", .rec = {0,}, .ret = NULL };
-static void *rmatch_dummy(int dummy1, node_t **dummy2, int dummy3, char **dummy4) {
-  return &dummy_record;
+//! snapshot records collect state
+struct snap_collect {
+  char **recs;               //!< collected records data
+  uint32_t n;                //!< number of collected records
+};
+
+//! collect record data for snapshot
+static void snap_collect(void *key, void *arg) {
+  struct snap_collect *sc = arg;
+  sc->recs[sc->n ++] = ((struct record *)key)->data;
 }
 
 
-//! find data in records tree by ip addr match
-//! \param idx token index
-//! \param root pointer to records root
-//! \param icase 0 to ignore case
+//! write checkers records into snapshot file
+//! \param file snapshot file path
+//! \return 0 if ok, !0 otherwise
+int checkers_compile(char *file) {
+
+  struct snap_writer *w = snapshot_create();
+  struct checker *cp;
+
+  for (cp = current->checkers; cp; cp = cp->next) {
+
+    // failed checkers and ones with no static data are loaded as usual
+    if (! cp->driver || ! checker_snapshotable(cp->driver) || (! cp->enable && ! cp->records))
+      continue;
+
+    // collect records data in tree order (load order for lists)
+    size_t num = mem_tree_keys(cp->records);
+    char **recs = calloc(num + 1, sizeof(char *));
+    assert(recs);
+    struct snap_collect sc = {recs, 0};
+    tree_walk(cp->records, snap_collect, &sc);
+
+    struct source *src = source_get(cp->source);
+    if (snapshot_add(w, cp->name, cp->driver->name, cp->source, cp->source_filter,
+                     src ? src->params : NULL, src ? src->stamp : NULL, cp->driver->type, cp->driver->icase, recs, sc.n))
+      wlog(L_WARN, "checker '%s': can't be compiled", cp->name);
+    else
+      wlog(L_INFO, "checker '%s': compiled %u records", cp->name, sc.n);
+
+    free(recs);
+  }
+
+  return snapshot_save(w, file);
+}
+
+
+//! get counters shard of current thread
+//! threads are spread over shards, so hot counters
+//! are not bounced between all cpus caches
+static int checkers_shard(void) {
+  if (thread_shard < 0)
+    thread_shard = __atomic_fetch_add(&thread_shard_next, 1, __ATOMIC_RELAXED) % RECORD_HITS_SHARDS;
+  return thread_shard;
+}
+
+
+//! enter current checkers generation: it is not freed until left
+//! \param parity where to store epoch parity (to leave the generation)
+//! \return current checkers generation
+static struct checkers_gen *checkers_enter(int *parity) {
+
+  int shard = checkers_shard();
+
+  // count ourselves in current epoch; if the epoch is over meanwhile,
+  // its generation might have been retired without waiting for us
+  while (1) {
+    uint64_t e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&readers[e & 1][shard][0], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) == e) {
+      *parity = e & 1;
+      return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+    }
+    __atomic_sub_fetch(&readers[e & 1][shard][0], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+
+//! leave checkers generation
+//! \param parity epoch parity given by checkers_enter()
+static void checkers_leave(int parity) {
+  __atomic_sub_fetch(&readers[parity][checkers_shard()][0], 1, __ATOMIC_RELEASE);
+}
+
+
+//! count record hit
+//! \param cp checker of the record
+//! \param rp matched record
+static void record_hit(struct checker *cp, struct record *rp) {
+
+  if (! cp->record_hits[0] || ! rp->id || rp->id > cp->records_num)
+    return;
+
+  __atomic_add_fetch(&cp->record_hits[checkers_shard()][rp->id], 1, __ATOMIC_RELAXED);
+}
+
+
+//! record hits dump state
+struct hits_dump {
+  FILE *fp;                  //!< where to write
+  struct checker *cp;        //!< checker of records
+};
+
+//! write record hits csv line
+static void record_hits_print(void *key, void *arg) {
+
+  struct record *rp = key;
+  struct hits_dump *hd = arg;
+
+  if (! hd->cp->record_hits[0] || ! rp->id || rp->id > hd->cp->records_num)
+    return;
+
+  unsigned long hits = 0;
+  int i;
+  for (i = 0; i < RECORD_HITS_SHARDS; i ++)
+    hits += __atomic_load_n(&hd->cp->record_hits[i][rp->id], __ATOMIC_RELAXED);
+
+  // csv quoting: the record is always quoted, quotes are doubled
+  fprintf(hd->fp, "%s,\"", hd->cp->name);
+  char *p;
+  for (p = rp->data; *p; p ++) {
+    if (*p == '"')
+      fputc('"', hd->fp);
+    fputc(*p, hd->fp);
+  }
+  fprintf(hd->fp, "\",%lu\n", hits);
+}
+
+
+//! dump record hit counters as 'checker,record,hits' csv
+void checkers_hits_dump(void) {
+
+  int parity;
+  struct checkers_gen *gen = checkers_enter(&parity);
+  if (! config.record_hits_file) {
+    checkers_leave(parity);
+    return;
+  }
+
+  char *tmp = malloc(strlen(config.record_hits_file) + 8);
+  assert(tmp);
+  sprintf(tmp, "%s.tmp", config.record_hits_file);
+
+  FILE *fp = fopen(tmp, "w");
+  if (! fp) {
+    wlog(L_ERR, "failed to open '%s': %s", tmp, strerror(errno));
+    free(tmp);
+    checkers_leave(parity);
+    return;
+  }
+
+  fputs("checker,record,hits\n", fp);
+
+  struct checker *cp;
+  for (cp = gen->checkers; cp; cp = cp->next) {
+    if (! cp->enable || (! cp->records && ! cp->snap))
+      continue;
+    struct hits_dump hd = {fp, cp};
+    // snapshot records have sequential ids
+    if (cp->snap) {
+      struct record r = {0,};
+      uint32_t i;
+      for (i = 0; i < cp->snap->set->n_recs; i ++) {
+        r.data = snapshot_data(cp->snap->sp, cp->snap->set, i);
+        r.id = i + 1;
+        record_hits_print(&r, &hd);
+      }
+      continue;
+    }
+#ifdef USE_GEOIP2
+    // geo codes records are kept in compiled table
+    if (cp->driver->type == TYPE_GEO) {
+      struct geo_table *gt = cp->records->key;
+      int i;
+      for (i = 0; i < gt->n_recs; i ++)
+        record_hits_print(gt->recs[i], &hd);
+      continue;
+    }
+#endif
+    // query checkers have no records
+    if (cp->driver->type == TYPE_QUERY)
+      continue;
+    tree_walk(cp->records, record_hits_print, &hd);
+  }
+
+  checkers_leave(parity);
+
+  if (fclose(fp) || rename(tmp, config.record_hits_file))
+    wlog(L_ERR, "failed to write record hits file '%s': %s", config.record_hits_file, strerror(errno));
+  else
+    wlog(L_INFO, "record hits dumped into '%s'", config.record_hits_file);
+
+  free(tmp);
+}
+
+
+//! dummy matching func, always matches anything
+static struct record dummy_record = { .data = "DUMMY", .rec = {0,}, .ret = NULL };
+static void *rmatch_dummy(int dummy1, node_t **dummy2, int dummy3, char **dummy4, struct checker *dummy5) {
+  return &dummy_record;
+}
+
+
+#ifdef USE_SQLITE3
+//! query result record (per request thread)
+static __thread struct record query_record;
+static __thread char query_result[QUERY_MAX_RESULT];
+
+//! run on-demand db query for the token: any returned row is a match,
+//! its first column (if not empty) will be placed in record->ret field
+//! \param idx token index
+//! \param root pointer to records root (query handle is its key)
+//! \param icase ignored
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_ip(int idx, node_t **root, int icase, char **tokens) {
+static void *rmatch_query(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
 
-  struct record *found = NULL;
-  struct record *rec_to_find = calloc(1, sizeof(struct record));
-  assert(rec_to_find);
+  if (! *root || query_lookup((*root)->key, tokens[idx], query_result, sizeof(query_result)) <= 0)
+    return NULL;
 
-  if (str2ipaddr(tokens[idx], &rec_to_find->rec.a.ip, &rec_to_find->rec.a.net))
-    wlog(L_WARN, "invalid ip '%s'", tokens[idx]);
-  else
-    found = tree_find(rec_to_find, root, rec_cmp_ip);
+  query_record.data = tokens[idx];
+  query_record.ret = query_result;
+  return &query_record;
+}
+#endif
 
- //wlog(L_DEBUG9, "found IP [%u] [%u] %p", rec_to_find->rec.a.ip, rec_to_find->rec.a.net, found);
 
-  free(rec_to_find);
+//! find the most specific network holding ip in ip records tree: the
+//! tree is ordered by networks addresses, so ip is looked up with each
+//! networks mask length there is, the longest first (as in snapshot)
+//! \param cp checker pointer
+//! \param ip ip to find
+//! \return pointer to found record or NULL
+static struct record *checker_find_ip(struct checker *cp, in_addr_t ip) {
 
-  return found;
+  int len;
+  for (len = 32; len > 0; len --) {
+    if (! (cp->ip_masks & (1ULL << len)))
+      continue;
+    in_addr_t key = ip & (0xFFFFFFFF << (32 - len));
+    node_t *p = cp->records;
+    while (p) {
+      struct record *r = p->key;
+      if (r->rec.a.ipnet == key) {
+        // a network of other mask may have the same address
+        if ((ip & r->rec.a.net) == key)
+          return r;
+        break;
+      }
+      // right branch holds greater networks
+      p = r->rec.a.ipnet < key ? p->right : p->left;
+    }
+  }
+
+  return NULL;
+}
+
+
+//! find data in records tree by ip addr match
+//! \param idx token index
+//! \param root pointer to records root
+//! \param icase 0 to ignore case
+//! \param tokens broken squid input string array
+//! \param cp checker pointer
+//! \return pointer to found record or NULL
+static void *rmatch_ip(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
+
+  in_addr_t ip, net;
+  if (str2ipaddr(tokens[idx], &ip, &net)) {
+    wlog(L_WARN, "invalid ip '%s'", tokens[idx]);
+    return NULL;
+  }
+
+  return checker_find_ip(cp, ip);
 };
 
 
@@ -596,38 +1436,24 @@ static void *rmatch_ip(int idx, node_t **root, int icase, char **tokens) {
 //! \param root pointer to records root
 //! \param icase 0 to ignore case
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_resolve(int idx, node_t **root, int icase, char **tokens) {
+static void *rmatch_resolve(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
 
   // first - resolve the domain
-  in_addr_t *ips = calloc(MAX_RESOLVED_IPS + 1, sizeof(in_addr_t));
-  assert(ips);
+  in_addr_t ips[MAX_RESOLVED_IPS + 1];
   int n_ips = resolve_host(tokens[idx], ips, MAX_RESOLVED_IPS);
   if (n_ips < 1) {
     wlog(L_WARN, "failed to resolve '%s'", (char *)tokens[idx]);
-    free(ips);
     return NULL;
   }
  
-  // alloc new matching record 
-  struct record *rec_to_find = calloc(1, sizeof(struct record));
-  assert(rec_to_find);
-  struct record *found = NULL;
-  
   // match over all resolved ips
-  for (-- n_ips; n_ips >= 0; n_ips --) {
-    rec_to_find->rec.a.ip = ips[n_ips];
-    rec_to_find->rec.a.net = 0xFFFFFFFF;
-    // rec_to_find->rec.a.ipnet = ips[n_ips] & 0xFFFFFFFF;
-    rec_to_find->rec.a.ipnet = 0;
-    found = tree_find(rec_to_find, root, rec_cmp_ip);
-    if (found)
-      break;
-  }
+  struct record *found = NULL;
+  for (-- n_ips; n_ips >= 0 && ! found; n_ips --)
+    found = checker_find_ip(cp, ips[n_ips]);
 
   // done
-  free(rec_to_find);
-  free(ips);
   return found;
 };
 
@@ -642,8 +1468,9 @@ static void *rmatch_resolve(int idx, node_t **root, int icase, char **tokens) {
 //! \param root pointer to records root
 //! \param icase 0 to ignore case
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_dresolve(int idx, node_t **root, int icase, char **tokens) {
+static void *rmatch_dresolve(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
 
   // convert string into ip
   in_addr_t ip;
@@ -671,8 +1498,9 @@ static void *rmatch_dresolve(int idx, node_t **root, int icase, char **tokens) {
 //! \param root pointer to records root
 //! \param icase 0 to ignore case
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_string(int idx, node_t **root, int icase, char **tokens) {
+static void *rmatch_string(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
   struct record *rec_to_find = malloc(sizeof(struct record));
   assert(rec_to_find);
 
@@ -695,8 +1523,9 @@ static void *rmatch_string(int idx, node_t **root, int icase, char **tokens) {
 //! \param root pointer to records root
 //! \param icase 0 if to ignore case
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_shell(int idx, node_t **root, int icase, char **tokens) {
+static void *rmatch_shell(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
   struct record *rec_to_find = calloc(1, sizeof(struct record));
   assert(rec_to_find);
 
@@ -719,8 +1548,9 @@ static void *rmatch_shell(int idx, node_t **root, int icase, char **tokens) {
 //! \param root pointer to records root
 //! \param icase 0 if to ignore case
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_regex(int idx, node_t **root, int icase, char **tokens) {
+static void *rmatch_regex(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
   struct record *rec_to_find = calloc(1, sizeof(struct record));
   assert(rec_to_find);
 
@@ -740,8 +1570,9 @@ static void *rmatch_regex(int idx, node_t **root, int icase, char **tokens) {
 //! \param root pointer to records root
 //! \param icase 0 if to ignore case
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_pcre(int idx, node_t **root, int icase, char **tokens) {
+static void *rmatch_pcre(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
   struct record *rec_to_find = calloc(1, sizeof(struct record));
   assert(rec_to_find);
 
@@ -758,71 +1589,76 @@ static void *rmatch_pcre(int idx, node_t **root, int icase, char **tokens) {
 
 
 #ifdef USE_GEOIP2
-//! mutex for geoip cache searches
+//! mutex for geoip records searches
 static pthread_mutex_t geoip2_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+//! geoip records: one per distinct lookup result
+//! (networks are cached by geoip2_lookup() itself)
+static node_t *geoip2_records;
+
 //! guess geo location of an ip/host
 //! guessed country and city codes will be placed in record->ret field
 //! \param idx tokens idx
-//! \param root pointer to records root
+//! \param root pointer to records root (not used)
 //! \param icase 0 if to ignore case
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_geoip2(int idx, node_t **root, int icase, char **tokens) {
+static void *rmatch_geoip2(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
+
+  // do geoip2 lookup (it is cached by networks)
+  char *notes = geoip2_lookup(tokens[idx]);
 
   // prepare search data
   struct record *rec_to_find = calloc(1, sizeof(struct record));
   assert(rec_to_find);
 
-  // will use provided token as tree key
-  rec_to_find->data = strdup(tokens[idx]);
-  assert(rec_to_find->data);
-  
-  // search the cache first (tree_search() always return valid pointer or... crashes :)
+  // will use lookup result as tree key (notes are never freed)
+  rec_to_find->data = notes;
+  rec_to_find->ret = notes;
+
+  // find the record for this result or install new one
   pthread_mutex_lock(&geoip2_mutex);
-  struct record *found = tree_search(rec_to_find, root, rec_cmp_si);
+  struct record *found = tree_search(rec_to_find, &geoip2_records, rec_cmp_s);
   pthread_mutex_unlock(&geoip2_mutex);
 
-  // found cached entry (expiration > 0) - return it
-  if (found->rec.t > 0) {
-    free(rec_to_find->data);
+  if (found != rec_to_find)
     free(rec_to_find);
-    wlog(L_DEBUG5, "found cached GeoIP2 entry for '%s'", found->data);
-    return found;
-  } else {
- }
- 
-  // now 'found' points to newly created record (rec_to_find)
 
-  // do geoip2 lookup
-  geoip2_data *gi2 = malloc(sizeof(geoip2_data));
-  assert(gi2);
-  geoip2_lookup(tokens[idx], gi2);
+  // all done, return data
+  return found;
+}
+#endif
 
-  // critical part again...
-  pthread_mutex_lock(&geoip2_mutex);
 
-  // alloc space for new geoip result
-  found->ret = malloc(sizeof(GEOIP2_NOTES_TMPL) + sizeof(geoip2_data) + 1);
-  assert(found->ret);
 
-  // save new ssl result
-  //! \todo replace sprintf() with something simpler: we actually have to place 3 short
-  //! \todo strings into one fixed sized template
-  sprintf(found->ret, GEOIP2_NOTES_TMPL, gi2->continent, gi2->country, gi2->city);
-  free(gi2);
+#ifdef USE_GEOIP2
+//! match resolved ip(s) against geo checker ranges table
+//! (no geo db lookups here: the table is compiled at load time)
+//! \param idx tokens idx
+//! \param root pointer to records root (holding compiled table)
+//! \param icase 0 if to ignore case
+//! \param tokens broken squid input string array
+//! \param cp checker pointer
+//! \return pointer to matched geo code record or NULL
+static void *rmatch_geo(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
 
-  // mark record as 'not expired'
-  // (actually it will never expire, so we use this feature to
-  // distinguish new records from already created)
-  found->rec.t = 1;
+  // no codes loaded
+  if (! *root)
+    return NULL;
 
-  // critical part end
-  pthread_mutex_unlock(&geoip2_mutex);
+  struct geo_table *gt = (*root)->key;
 
+  // any of host ips will do
+  in_addr_t ips[MAX_RESOLVED_IPS + 1];
+  int i, n_ips = resolve_host(tokens[idx], ips, MAX_RESOLVED_IPS);
+  for (i = 0; i < n_ips; i ++) {
+    int code = geoip2_range_find(gt->ranges, gt->n_ranges, ips[i]);
+    if (code >= 0)
+      return gt->recs[code];
+  }
 
-  // all done, return data
-  return found;
+  return NULL;
 }
 #endif
 
@@ -832,18 +1668,42 @@ static void *rmatch_geoip2(int idx, node_t **root, int icase, char **tokens) {
 //! mutex for ssl operations
 static pthread_mutex_t ssl_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+//! SSL cache entry: a record and its in-flight verification state
+//! (ssl checker tree holds nothing but these)
+struct ssl_record {
+  struct record r;           //!< cached record, r.rec.t is expiration time
+  int in_progress;           //!< verification is running
+  pthread_cond_t cond;       //!< signalled when verification is done
+};
+
+//! interned SSL result notes: there are just a few distinct ones and they
+//! are never freed, so a note handed out to checkers_call() stays valid
+static node_t *ssl_notes;
+
+//! intern SSL result note (ssl_mutex must be held)
+//! \param note note to intern
+//! \return interned copy of the note
+static char *ssl_note_intern(char *note) {
+  char *found = tree_find(note, &ssl_notes, (int (*)(const void *, const void *))strcmp);
+  if (! found) {
+    found = strdup(note);
+    assert(found);
+    tree_search(found, &ssl_notes, (int (*)(const void *, const void *))strcmp);
+  }
+  return found;
+}
+
 //! get remote host SSL cert data
-//! discovered data will be placed in returned record->ret field
+//! discovered data will be placed in returned record->ret field;
+//! exactly one verification runs per host:port, concurrent requests
+//! for it wait for its result (no longer than ssl_timeout)
 //! \param idx tokens index
 //! \param root pointer to records root (will be used as cache)
 //! \param icase 0 if to ignore case
 //! \param tokens broken squid input string array
+//! \param cp checker pointer
 //! \return pointer to found record or NULL
-static void *rmatch_ssl(int idx, node_t **root, int icase, char **tokens) {
-
-  // prepare search data
-  struct record *rec_to_find = calloc(1, sizeof(struct record));
-  assert(rec_to_find);
+static void *rmatch_ssl(int idx, node_t **root, int icase, char **tokens, struct checker *cp) {
 
   // prepare and check port
   errno = 0;
@@ -854,54 +1714,74 @@ static void *rmatch_ssl(int idx, node_t **root, int icase, char **tokens) {
     return NULL;
   }
 
+  // prepare search data
+  struct ssl_record *rec_to_find = calloc(1, sizeof(struct ssl_record));
+  assert(rec_to_find);
+
   // will use 'DomainPort' as tree key
-  rec_to_find->data = malloc(strlen(tokens[idx]) + strlen(port_s) + 1);
-  assert(rec_to_find->data);
-  strcpy(rec_to_find->data, tokens[idx]);
-  strcat(rec_to_find->data, port_s);
-  
+  rec_to_find->r.data = malloc(strlen(tokens[idx]) + strlen(port_s) + 1);
+  assert(rec_to_find->r.data);
+  strcpy(rec_to_find->r.data, tokens[idx]);
+  strcat(rec_to_find->r.data, port_s);
+
   // search the cache first (tree_search() always return valid pointer or... crashes :)
   pthread_mutex_lock(&ssl_mutex);
-  struct record *found = tree_search(rec_to_find, root, rec_cmp_si);
-  pthread_mutex_unlock(&ssl_mutex);
+  struct ssl_record *found = tree_search(rec_to_find, root, rec_cmp_si);
 
   // installed new entry? no need in 'rec_to_find' anymore
   // (new entry has expire time set to 0)
-  if (found->rec.t > 0) {
-    free(rec_to_find->data);
+  if (found != rec_to_find) {
+    free(rec_to_find->r.data);
     free(rec_to_find);
-  }
- 
+  } else
+    pthread_cond_init(&found->cond, NULL);
+
   // now 'found' points to newly created record (rec_to_find) or found one
 
-  // check if record is new or not yet expired
-  if (found->rec.t > time(NULL)) {
-    wlog(L_DEBUG5, "found cached non-expired SSL entry for '%s'", found->data);
-    return found;
+  // the host is being verified by another request: wait for its result
+  int waited = found->in_progress;
+  if (waited) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += config.ssl_timeout + 1;
+    int rc = 0;
+    while (found->in_progress && rc != ETIMEDOUT)
+      rc = pthread_cond_timedwait(&found->cond, &ssl_mutex, &deadline);
+    wlog(L_DEBUG5, "waited for in-flight SSL verification of '%s'%s",
+         found->r.data, found->in_progress ? " (timed out)" : "");
+  }
+
+  // check if record is just verified or not yet expired
+  // (on wait timeout an old result is still better than nothing)
+  if (waited || found->r.rec.t > time(NULL)) {
+    char *ret = found->r.ret;
+    pthread_mutex_unlock(&ssl_mutex);
+    if (! waited)
+      wlog(L_DEBUG5, "found cached non-expired SSL entry for '%s'", found->r.data);
+    return ret ? found : NULL;
   }
 
   // cache record is new or expired - (re)validate host cert
+  found->in_progress = 1;
+  pthread_mutex_unlock(&ssl_mutex);
 
   // ok, have to get an SSL cert and examine it
-  int ssl_error = ssl_verify_host(tokens[idx], (unsigned)port, config.ssl_timeout); 
-
-  // critical part again...
-  pthread_mutex_lock(&ssl_mutex);
+  int ssl_ocsp;
+  int ssl_error = ssl_verify_host(tokens[idx], (unsigned)port, config.ssl_timeout, &ssl_ocsp);
 
-  // free (possibly existing) old ssl check result
-  if (found->ret)
-    free(found->ret);
-
-  // alloc space for new ssl result
-  found->ret = malloc(sizeof(SSL_ERROR_NOTE_TMPL) + 8);
-  assert(found->ret);
-
-  // save new ssl result
+  // prepare new ssl result
   //! \todo replace sprintf() with something simple: we actually have to convert 2 digits into chars
-  sprintf(found->ret, SSL_ERROR_NOTE_TMPL, ssl_error);
-  found->rec.t = time(NULL) + config.ssl_verify_ttl;
+  char note[sizeof(SSL_ERROR_NOTE_TMPL) + 8 + sizeof(SSL_OCSP_NOTE_TMPL) + 8];
+  int len = sprintf(note, SSL_ERROR_NOTE_TMPL, ssl_error);
+  if (config.ssl_ocsp)
+    sprintf(note + len, SSL_OCSP_NOTE_TMPL, ssl_ocsp_str(ssl_ocsp));
 
-  // critical part end
+  // critical part again: save the result and wake up waiters
+  pthread_mutex_lock(&ssl_mutex);
+  found->r.ret = ssl_note_intern(note);
+  found->r.rec.t = time(NULL) + config.ssl_verify_ttl;
+  found->in_progress = 0;
+  pthread_cond_broadcast(&found->cond);
   pthread_mutex_unlock(&ssl_mutex);
 
   // all done, return data
@@ -910,6 +1790,282 @@ static void *rmatch_ssl(int idx, node_t **root, int icase, char **tokens) {
 #endif
 
 
+//! free checker record
+static void checker_free_record(void *key) {
+  struct record *rp = key;
+  record_unintern(rp->data);
+  free(rp);
+}
+
+#ifdef USE_REGEX
+//! free checker record with compiled regex
+static void checker_free_regex(void *key) {
+  struct record *rp = key;
+  regfree(rp->rec.r);
+  free(rp->rec.r);
+  checker_free_record(rp);
+}
+#endif
+
+#ifdef USE_PCRE
+//! free checker record with compiled pcre
+static void checker_free_pcre(void *key) {
+  struct record *rp = key;
+  pcre_free(rp->rec.p);
+  checker_free_record(rp);
+}
+#endif
+
+#ifdef USE_SSL
+//! free SSL cache entry (its note is interned)
+static void checker_free_ssl(void *key) {
+  struct ssl_record *sr = key;
+  pthread_cond_destroy(&sr->cond);
+  free(sr->r.data);
+  free(sr);
+}
+#endif
+
+
+//! free checker and its records
+//! \param cp checker pointer
+static void checker_free(struct checker *cp) {
+
+  // records are kept by reloaded checker or are not ours
+  if (cp->records_moved || cp->shares)
+    ;
+  // records mapped from snapshot: only compiled patterns are ours
+  else if (cp->snap) {
+    uint32_t i;
+    for (i = 0; cp->snap->compiled && i < cp->snap->set->n_recs; i ++) {
+      if (! cp->snap->compiled[i])
+        continue;
+#ifdef USE_REGEX
+      if (cp->driver->type == TYPE_REGEX) {
+        regfree(cp->snap->compiled[i]);
+        free(cp->snap->compiled[i]);
+      }
+#endif
+#ifdef USE_PCRE
+      if (cp->driver->type == TYPE_PCRE)
+        pcre_free(cp->snap->compiled[i]);
+#endif
+    }
+    free(cp->snap->compiled);
+    free(cp->snap);
+  } else if (cp->records) {
+    switch (cp->driver->type) {
+#ifdef USE_REGEX
+      case TYPE_REGEX :
+        tree_free(cp->records, checker_free_regex);
+        break;
+#endif
+#ifdef USE_PCRE
+      case TYPE_PCRE :
+        tree_free(cp->records, checker_free_pcre);
+        break;
+#endif
+#ifdef USE_SSL
+      case TYPE_SSL :
+        tree_free(cp->records, checker_free_ssl);
+        break;
+#endif
+#ifdef USE_GEOIP2
+      case TYPE_GEO :
+        {
+          struct geo_table *gt = cp->records->key;
+          int i;
+          for (i = 0; i < gt->n_recs; i ++)
+            checker_free_record(gt->recs[i]);
+          free(gt->recs);
+          free(gt->ranges);
+          free(gt);
+          tree_free(cp->records, NULL);
+        }
+        break;
+#endif
+#ifdef USE_SQLITE3
+      case TYPE_QUERY :
+        query_close(cp->records->key);
+        tree_free(cp->records, NULL);
+        break;
+#endif
+      default:
+        tree_free(cp->records, checker_free_record);
+        break;
+    }
+  }
+
+  int i;
+  for (i = 0; i < RECORD_HITS_SHARDS && ! cp->records_moved; i ++)
+    free(cp->record_hits[i]);
+
+  free(cp->name);
+  free(cp->enable_s);
+  free(cp->field_idx_s);
+  free(cp->driver_s);
+  free(cp->action_s);
+  free(cp->notes);
+  free(cp->source);
+  free(cp->source_filter);
+  free(cp);
+}
+
+
+//! free checkers list
+//! \param cp list head
+static void checkers_free(struct checker *cp) {
+  while (cp) {
+    struct checker *next = cp->next;
+    checker_free(cp);
+    cp = next;
+  }
+}
+
+
+//! drop configured checkers (config reload failed)
+void checkers_config_free(void) {
+  checkers_free(checkers);
+  checkers = NULL;
+}
+
+
+//! take records of the same checker in use if its source data has not
+//! changed since they were loaded (SSL results caches are always taken)
+//! \param cp checker pointer
+//! \return 0 if records are taken, !0 if they must be loaded
+static int checker_reuse(struct checker *cp) {
+
+  struct checker *old;
+  for (old = current ? current->checkers : NULL; old; old = old->next) {
+    if (! strcmp(old->name, cp->name) && old->driver == cp->driver)
+      break;
+  }
+  if (! old)
+    return 1;
+
+#ifdef USE_SSL
+  // the cache tree is updated by requests, so it is moved, not shared
+  if (cp->driver->type == TYPE_SSL) {
+    pthread_mutex_lock(&ssl_mutex);
+    cp->records = old->records;
+    old->records = NULL;
+    pthread_mutex_unlock(&ssl_mutex);
+    return 0;
+  }
+#endif
+
+  if (! old->loaded || old->snap || old->shares || checker_strcmp(old->source, cp->source) ||
+      checker_strcmp(old->source_filter, cp->source_filter) || source_changed(cp->source))
+    return 1;
+
+  // records are never modified after load, so they are shared with
+  // previous generation until it is freed
+  cp->records = old->records;
+  cp->records_num = old->records_num;
+  cp->ip_masks = old->ip_masks;
+  memcpy(cp->record_hits, old->record_hits, sizeof(cp->record_hits));
+  cp->loaded = 1;
+  old->records_moved = 1;
+
+  wlog(L_INFO, "checker '%s': source '%s' unchanged, %u records kept", cp->name, cp->source, cp->records_num);
+
+  return 0;
+}
+
+
+//! put new checkers generation in use and free the previous one
+//! when no request may be using it anymore
+//! \param gen new checkers generation
+static void checkers_publish(struct checkers_gen *gen) {
+
+  struct checkers_gen *old = __atomic_exchange_n(&current, gen, __ATOMIC_SEQ_CST);
+
+  // new requests count themselves in the next epoch, so wait
+  // for requests of this one to be done with the old generation
+  uint64_t e = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST) - 1;
+  while (1) {
+    int i, busy = 0;
+    for (i = 0; i < RECORD_HITS_SHARDS; i ++)
+      busy += __atomic_load_n(&readers[e & 1][i][0], __ATOMIC_SEQ_CST);
+    if (! busy)
+      break;
+    usleep(10000);
+  }
+
+  if (! old)
+    return;
+
+  checkers_free(old->checkers);
+  snapshot_close(old->snap);
+  free(old);
+
+  wlog(L_INFO, "previous checkers data freed");
+}
+
+
+//! free rejected checkers generation: records and caches taken from
+//! checkers in use are given back to them
+//! \param gen rejected checkers generation
+static void checkers_discard(struct checkers_gen *gen) {
+
+  struct checker *cp, *old;
+  for (cp = gen->checkers; cp; cp = cp->next) {
+    if (! cp->driver || cp->shares)
+      continue;
+    for (old = current->checkers; old; old = old->next) {
+      if (! strcmp(old->name, cp->name) && old->driver == cp->driver)
+        break;
+    }
+    if (! old)
+      continue;
+
+#ifdef USE_SSL
+    if (cp->driver->type == TYPE_SSL) {
+      pthread_mutex_lock(&ssl_mutex);
+      old->records = cp->records;
+      cp->records = NULL;
+      pthread_mutex_unlock(&ssl_mutex);
+      continue;
+    }
+#endif
+
+    if (old->records_moved && cp->records == old->records) {
+      old->records_moved = 0;
+      cp->records_moved = 1;
+    }
+  }
+
+  checkers_free(gen->checkers);
+  snapshot_close(gen->snap);
+  free(gen);
+}
+
+
+//! start resolving tokens wanted by enabled resolving checkers
+//! (they are resolved once per request anyway, this just starts it
+//! earlier, so DNS latency overlaps with cheap checkers)
+//! \param list checkers list
+//! \param tokens squid input parsed tokens array
+//! \param max_idx max tokens idx
+static void checkers_prefetch(struct checker *list, char **tokens, int max_idx) {
+
+  char *hosts[RESOLVE_CTX_SIZE];
+  int i, num = 0;
+  struct checker *cp;
+
+  for (cp = list; cp && num < RESOLVE_CTX_SIZE; cp = cp->next) {
+    if (! cp->enable || ! cp->driver->resolves || cp->field_idx > max_idx)
+      continue;
+    for (i = 0; i < num && strcasecmp(hosts[i], tokens[cp->field_idx]); i ++);
+    if (i == num)
+      hosts[num ++] = tokens[cp->field_idx];
+  }
+
+  resolve_ctx_prefetch(hosts, num);
+}
+
+
 //! call all checkers against give squid request
 //! \param tokens squid input parsed tokens array
 //! \param max_idx max tokens idx
@@ -918,7 +2074,16 @@ char *checkers_call(char **tokens, int max_idx) {
 
   char *notes = NULL;
   struct record *rp = NULL;
-  struct checker *cp = checkers;
+
+  // checkers can't be freed by reload until we are done
+  int parity;
+  struct checkers_gen *gen = checkers_enter(&parity);
+  struct checker *cp = gen->checkers;
+
+  // request tokens are resolved once and shared by all checkers
+  resolve_ctx_begin();
+  if (config.resolve_prefetch)
+    checkers_prefetch(gen->checkers, tokens, max_idx);
 
   // call all checkers in order
   while (cp) {
@@ -937,12 +2102,20 @@ char *checkers_call(char **tokens, int max_idx) {
            cp->name, cp->field_idx + 1, max_idx + 1);
       cp = cp->next;
       continue;
-    } else
-      rp = cp->driver->match_func(cp->field_idx, &cp->records, cp->driver->icase, tokens);
+    } else {
+      uint64_t started = stats_now();
+      if (cp->snap)
+        rp = checker_snap_match(cp, tokens);
+      else
+        rp = cp->driver->match_func(cp->field_idx, &cp->records, cp->driver->icase, tokens, cp);
+      stats_add(cp->stats_idx, rp != NULL, stats_now() - started);
+    }
 
     // matched!
     if (rp) {
 
+      record_hit(cp, rp);
+
       wlog(L_DEBUG3, "found '%s', action '%s'", rp->data, cp->action_s);
 
       // always save checker note for squid 'note' acls: glue to notes list if needed
@@ -982,6 +2155,8 @@ char *checkers_call(char **tokens, int max_idx) {
 
   } // while(checkers...)
 
+  resolve_ctx_end();
+
 
   // ok, got the result: compose a string for squid
   // ex: ERR notestring=YES message=\"notestring=YES\"
@@ -998,6 +2173,8 @@ char *checkers_call(char **tokens, int max_idx) {
            notes ? notes : "(none)"
   );
 
+  checkers_leave(parity);
+
   // clenaup
   if (notes)
     free(notes);
@@ -1007,4 +2184,216 @@ char *checkers_call(char **tokens, int max_idx) {
 }
 
 
+//! checker records memory usage walk state
+struct checker_mem {
+  struct checker *cp;         //!< checker
+  struct mem_usage records;   //!< records
+  struct mem_usage strings;   //!< records data strings
+  struct mem_usage compiled;  //!< compiled patterns
+  size_t num;                 //!< number of records (tree nodes)
+};
+
+//! add checker record to memory usage
+static void checker_mem_record(void *key, void *arg) {
+
+  struct record *rp = key;
+  struct checker_mem *cm = arg;
+
+  cm->num ++;
+
+  // interned strings are reported apart
+  if (! config.intern_records || cm->cp->driver->type == TYPE_SSL)
+    mem_add_str(&cm->strings, rp->data);
+
+  switch (cm->cp->driver->type) {
+#ifdef USE_SSL
+    case TYPE_SSL :
+      // ssl cache entry, result notes are interned
+      mem_add(&cm->records, rp, sizeof(struct ssl_record));
+      return;
+#endif
+#ifdef USE_REGEX
+    case TYPE_REGEX :
+      // regex internals are not visible, count the handle only
+      mem_add(&cm->compiled, rp->rec.r, sizeof(regex_t));
+      break;
+#endif
+#ifdef USE_PCRE
+    case TYPE_PCRE :
+      {
+        size_t size = 0;
+        if (! pcre_fullinfo(rp->rec.p, NULL, PCRE_INFO_SIZE, &size)) {
+          cm->compiled.bytes += size;
+          cm->compiled.objects ++;
+        }
+      }
+      break;
+#endif
+    default:
+      break;
+  }
+
+  mem_add(&cm->records, rp, sizeof(struct record));
+}
+
+
+//! add interned note to memory usage
+static void checker_mem_note(void *key, void *arg) {
+  mem_add_str(arg, key);
+}
+
+
+#ifdef USE_GEOIP2
+//! add geoip2 record to memory usage (its notes are interned by geoip2 cache)
+static void checker_mem_georec(void *key, void *arg) {
+  mem_add(arg, key, sizeof(struct record));
+}
+#endif
+
+
+//! report checkers memory usage
+//! \param func report function
+//! \param arg report function argument
+void checkers_mem(mem_report_f func, void *arg) {
+
+  struct checker *cp;
+  char owner[256];
+
+  int parity;
+  struct checkers_gen *gen = checkers_enter(&parity);
+
+  // snapshot is mapped, not allocated
+  if (gen->snap) {
+    struct mem_usage mapped = {gen->snap->hdr->size, gen->snap->hdr->n_sets};
+    func("snapshot", "mapped", &mapped, arg);
+  }
+
+  for (cp = gen->checkers; cp; cp = cp->next) {
+
+    // shared records are reported by their owner
+    if (! cp->driver || (! cp->records && ! cp->snap) || cp->shares)
+      continue;
+
+    struct checker_mem cm = {cp,};
+    struct mem_usage nodes = {0,};
+    snprintf(owner, sizeof(owner), "checker:%s", cp->name);
+
+    // snapshot records are mapped (and reported by snapshot), only
+    // compiled patterns are ours
+    if (cp->snap) {
+      mem_add(&cm.records, cp->snap, sizeof(struct snap_table));
+      uint32_t i;
+      for (i = 0; cp->snap->compiled && i < cp->snap->set->n_recs; i ++) {
+        switch (cp->driver->type) {
+#ifdef USE_REGEX
+          case TYPE_REGEX :
+            mem_add(&cm.compiled, cp->snap->compiled[i], sizeof(regex_t));
+            break;
+#endif
+#ifdef USE_PCRE
+          case TYPE_PCRE :
+            {
+              size_t size = 0;
+              if (cp->snap->compiled[i] && ! pcre_fullinfo(cp->snap->compiled[i], NULL, PCRE_INFO_SIZE, &size)) {
+                cm.compiled.bytes += size;
+                cm.compiled.objects ++;
+              }
+            }
+            break;
+#endif
+          default:
+            break;
+        }
+      }
+      if (cp->snap->compiled)
+        mem_add(&cm.compiled, cp->snap->compiled, (cp->snap->set->n_recs + 1) * sizeof(void *));
+      func(owner, "records", &cm.records, arg);
+      if (cm.compiled.objects)
+        func(owner, "compiled", &cm.compiled, arg);
+      continue;
+    }
+
+#ifdef USE_GEOIP2
+    // geo codes records are kept in compiled table
+    if (cp->driver->type == TYPE_GEO) {
+      struct geo_table *gt = cp->records->key;
+      int i;
+      for (i = 0; i < gt->n_recs; i ++)
+        checker_mem_record(gt->recs[i], &cm);
+      mem_add(&cm.compiled, gt, sizeof(struct geo_table));
+      mem_add(&cm.compiled, gt->recs, gt->n_recs * sizeof(struct record *));
+      mem_add(&cm.compiled, gt->ranges, gt->n_ranges * sizeof(struct geoip2_range));
+      mem_add_nodes(&nodes, cp->records, 1);
+    } else
+#endif
+#ifdef USE_SQLITE3
+    // query checkers have only results cache
+    if (cp->driver->type == TYPE_QUERY) {
+      struct mem_usage cache = {0,};
+      query_mem(cp->records->key, &cache);
+      mem_add_nodes(&cache, cp->records, 1);
+      func(owner, "cache", &cache, arg);
+      continue;
+    }
+#endif
+#ifdef USE_SSL
+    // ssl checker tree is the results cache
+    if (cp->driver->type == TYPE_SSL) {
+      pthread_mutex_lock(&ssl_mutex);
+      tree_walk(cp->records, checker_mem_record, &cm);
+      mem_add_nodes(&nodes, cp->records, cm.num);
+      pthread_mutex_unlock(&ssl_mutex);
+    } else
+#endif
+    {
+      tree_walk(cp->records, checker_mem_record, &cm);
+      mem_add_nodes(&nodes, cp->records, cm.num);
+    }
+
+    func(owner, "records", &cm.records, arg);
+    if (cm.strings.objects)
+      func(owner, "strings", &cm.strings, arg);
+    func(owner, "nodes", &nodes, arg);
+    if (cm.compiled.objects)
+      func(owner, "compiled", &cm.compiled, arg);
+  }
+
+  checkers_leave(parity);
+
+  // records data strings are interned (if enabled)
+  struct mem_usage strings = {0,}, table = {0,};
+  pthread_mutex_lock(&intern_mutex);
+  size_t i;
+  for (i = 0; i < intern_size; i ++) {
+    struct interned *in;
+    for (in = intern_table[i]; in; in = in->next)
+      mem_add(&strings, in, sizeof(struct interned) + strlen(in->data) + 1);
+  }
+  mem_add(&table, intern_table, intern_size * sizeof(struct interned *));
+  pthread_mutex_unlock(&intern_mutex);
+  if (intern_size) {
+    func("records_strings", "strings", &strings, arg);
+    func("records_strings", "table", &table, arg);
+  }
+
+#ifdef USE_SSL
+  struct mem_usage notes = {0,}, nodes = {0,};
+  pthread_mutex_lock(&ssl_mutex);
+  tree_walk(ssl_notes, checker_mem_note, &notes);
+  mem_add_nodes(&nodes, ssl_notes, notes.objects);
+  pthread_mutex_unlock(&ssl_mutex);
+  func("ssl_notes", "notes", &notes, arg);
+  func("ssl_notes", "nodes", &nodes, arg);
+#endif
+
+#ifdef USE_GEOIP2
+  struct mem_usage geo = {0,}, geo_nodes = {0,};
+  pthread_mutex_lock(&geoip2_mutex);
+  tree_walk(geoip2_records, checker_mem_georec, &geo);
+  mem_add_nodes(&geo_nodes, geoip2_records, geo.objects);
+  pthread_mutex_unlock(&geoip2_mutex);
+  func("geoip2_records", "records", &geo, arg);
+  func("geoip2_records", "nodes", &geo_nodes, arg);
+#endif
+}
 
@@ -30,6 +30,8 @@ enum checker_types {
   TYPE_IP,          //!< tree: ip addr[/network] match
   TYPE_LIST,        //!< list: plain records list
   TYPE_SSL,         //!< not a match, but get SSL verify info
+  TYPE_GEO,         //!< geo codes compiled into ip ranges table
+  TYPE_QUERY,       //!< not a match, but on-demand db query
 };
 
 
@@ -64,6 +66,7 @@ struct record {
 #endif
   } rec;
   void *ret;            //!< optional data to return to checker on record match
+  uint32_t id;          //!< record number for hit counters (0 if not counted)
 };
 
 
@@ -73,9 +76,16 @@ typedef struct checker_driver {
   int type;                    //!< checker match type
   int icase;                   //!< is case sensitive?
   void *(*match_func)();       //!< matching func for this checker
+  int resolves;                //!< matching needs token resolved into ips
 } cdriver_t;
 
 
+struct snap_table;
+struct snapshot;
+
+//! number of record hit counters shards
+#define RECORD_HITS_SHARDS 4
+
 //! checker config
 struct checker {
   // options from conf file
@@ -93,7 +103,15 @@ struct checker {
   int action;                //!< action on match
   // runtime options
   cdriver_t *driver;         //!< checker driver
+  int stats_idx;             //!< checker latency stats series
   node_t *records;           //!< stored data (read from 'source') to match over
+  struct snap_table *snap;   //!< records mapped from snapshot (NULL if read from 'source')
+  uint32_t records_num;      //!< number of loaded records (last given record id)
+  uint64_t ip_masks;         //!< ip records networks masks lengths (bit per length)
+  uint32_t *record_hits[RECORD_HITS_SHARDS];  //!< record hit counters shards, indexed by record id (NULL if disabled)
+  int loaded;                //!< records are loaded from source
+  int records_moved;         //!< records and hit counters are taken by reloaded checker
+  struct checker *shares;    //!< checker whose records are shared (NULL if own ones)
   struct checker *next;      //!< next checker in list
 };
 
@@ -102,8 +120,11 @@ struct checker {
 #define CHECKER_MAX_LINE_SIZE 32768
 
 extern int checker_config(char *);
-extern int checkers_init(void);
+extern int checkers_init(struct snapshot *);
 extern char *checkers_call(char **, int);
+extern void checkers_hits_dump(void);
+extern int checkers_compile(char *);
+extern void checkers_config_free(void);
 
 #endif //__ACLH_CHECKER_H__
 
@@ -13,16 +13,12 @@
 
 
 
-//! read config file.
+//! parse config file.
+//! \param fp opened config file
+//! \param reload read checkers datasets settings only (checkers,
+//!        sources, options and snapshot), others need a restart
 //! \return 0 on success or >0 on error
-int config_read(void) {
-
-  // open config file
-  FILE *fp = fopen(config.file, "r");
-  if (!fp) {
-    wlog(L_ERR, "failed to read config file '%s': %s", config.file, strerror(errno));
-    return 1;
-  }
+static int config_parse(FILE *fp, int reload) {
 
   // read and parse config file
   char buf[CONF_MAX_LINE_SIZE + 1];
@@ -108,6 +104,12 @@ int config_read(void) {
 
     wlog(L_DEBUG5, "CONFIG OPTION: [%s] => [%s]", param, value);
 
+    // reload takes checkers datasets settings only
+    if (reload && strcmp("checker", param) && strcmp("source", param) &&
+        strcmp("options", param) && strcmp("snapshot_file", param) &&
+        strcmp("source_check", param))
+      continue;
+
     // time to fill config structure
    
     // get checker (we expect 6 tokens) 
@@ -187,6 +189,48 @@ int config_read(void) {
       continue;
     }
 
+    // get source change tracking query
+    if (! strcmp("source_check", param)) {
+      if (source_check_config(value)) {
+        wlog(L_ERR, "invalid 'source_check' in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // intern records data strings?
+    if (! strcmp("intern_records", param)) {
+      if (! strcasecmp("on", value))
+        config.intern_records = 1;
+      else if (! strcasecmp("off", value))
+        config.intern_records = 0;
+      else {
+        wlog(L_WARN, "invalid 'intern_records' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get number of threads loading checkers and options data
+    if (! strcmp("init_threads", param)) {
+      config.init_threads = str2int(value, 0, 1024);
+      if (errno) {
+        wlog(L_WARN, "invalid 'init_threads' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get sources change check period
+    if (! strcmp("source_check_interval", param)) {
+      config.source_check_interval = str2int(value, 0, 86400);
+      if (errno) {
+        wlog(L_WARN, "invalid 'source_check_interval' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
     // get options
     if (! strcmp("options", param)) {
       if (option_config(value)) {
@@ -198,7 +242,7 @@ int config_read(void) {
 
     // get ssl CA file path
     if (! strcmp("ssl_ca_file", param)) {
-      config.ssl_ca_file = strdup(param);
+      config.ssl_ca_file = strdup(value);
       assert(config.ssl_ca_file);
       continue;
     }
@@ -223,6 +267,87 @@ int config_read(void) {
       continue;
     }
 
+    // get max concurrent ssl handshakes
+    if (! strcmp("ssl_max_handshakes", param)) {
+      config.ssl_max_handshakes = str2int(value, 1, 65535);
+      if (errno) {
+        wlog(L_WARN, "invalid 'ssl_max_handshakes' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get delay before racing next resolved ip
+    if (! strcmp("ssl_race_delay", param)) {
+      config.ssl_race_delay = str2int(value, 0, 60000);
+      if (errno) {
+        wlog(L_WARN, "invalid 'ssl_race_delay' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get ssl 'cert only' handshake mode
+    if (! strcmp("ssl_cert_only", param)) {
+      if (! strcasecmp("on", value))
+        config.ssl_cert_only = 1;
+      else if (! strcasecmp("off", value))
+        config.ssl_cert_only = 0;
+      else {
+        wlog(L_WARN, "invalid 'ssl_cert_only' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get ssl OCSP stapling mode
+    if (! strcmp("ssl_ocsp", param)) {
+      if (! strcasecmp("on", value))
+        config.ssl_ocsp = 1;
+      else if (! strcasecmp("off", value))
+        config.ssl_ocsp = 0;
+      else {
+        wlog(L_WARN, "invalid 'ssl_ocsp' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get revoked certs set source
+    if (! strcmp("ssl_revoked", param)) {
+      config.ssl_revoked = strdup(value);
+      assert(config.ssl_revoked);
+      continue;
+    }
+
+    // get revoked certs set refresh period
+    if (! strcmp("ssl_revoked_refresh", param)) {
+      config.ssl_revoked_refresh = str2int(value, 0, 86400 * 7);
+      if (errno) {
+        wlog(L_WARN, "invalid 'ssl_revoked_refresh' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get persistent ssl cache file
+    if (! strcmp("ssl_cache_file", param)) {
+      config.ssl_cache_file = strdup(value);
+      assert(config.ssl_cache_file);
+      continue;
+    }
+
+    // get persistent ssl cache size (rounded up to power of 2)
+    if (! strcmp("ssl_cache_slots", param)) {
+      int slots = str2int(value, 16, 1 << 24);
+      if (errno) {
+        wlog(L_WARN, "invalid 'ssl_cache_slots' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      for (config.ssl_cache_slots = 16; config.ssl_cache_slots < slots; config.ssl_cache_slots <<= 1);
+      continue;
+    }
+
     // get resolve ttl value
     if (! strcmp("resolve_ttl", param)) {
       config.resolve_ttl = (int)strtol(value, NULL, 10);
@@ -243,6 +368,109 @@ int config_read(void) {
       continue;
     }
 
+    // get resolve prefetch mode
+    if (! strcmp("resolve_prefetch", param)) {
+      if (! strcasecmp("on", value))
+        config.resolve_prefetch = 1;
+      else if (! strcasecmp("off", value))
+        config.resolve_prefetch = 0;
+      else {
+        wlog(L_WARN, "invalid 'resolve_prefetch' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get on-demand query results ttl
+    if (! strcmp("query_ttl", param)) {
+      config.query_ttl = str2int(value, 0, 86400 * 7);
+      if (errno) {
+        wlog(L_WARN, "invalid 'query_ttl' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get on-demand query results cache size (rounded up to power of 2)
+    if (! strcmp("query_cache_slots", param)) {
+      int slots = str2int(value, 0, 1 << 24);
+      if (errno) {
+        wlog(L_WARN, "invalid 'query_cache_slots' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      for (config.query_cache_slots = slots ? 16 : 0; config.query_cache_slots < slots; config.query_cache_slots <<= 1);
+      continue;
+    }
+
+    // get stats file location
+    if (! strcmp("stats_file", param)) {
+      config.stats_file = strdup(value);
+      assert(config.stats_file);
+      continue;
+    }
+
+    // get stats file write period
+    if (! strcmp("stats_interval", param)) {
+      config.stats_interval = str2int(value, 1, 86400);
+      if (errno) {
+        wlog(L_WARN, "invalid 'stats_interval' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get records hits dump file location
+    if (! strcmp("record_hits_file", param)) {
+      config.record_hits_file = strdup(value);
+      assert(config.record_hits_file);
+      continue;
+    }
+
+    // get traffic capture file location
+    if (! strcmp("capture_file", param)) {
+      config.capture_file = strdup(value);
+      assert(config.capture_file);
+      continue;
+    }
+
+    // get traffic capture sampling
+    if (! strcmp("capture_sample", param)) {
+      config.capture_sample = str2int(value, 1, 1000000);
+      if (errno) {
+        wlog(L_WARN, "invalid 'capture_sample' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get traffic capture file rotation size (MBytes)
+    if (! strcmp("capture_rotate", param)) {
+      int mbytes = str2int(value, 0, 1048576);
+      if (errno) {
+        wlog(L_WARN, "invalid 'capture_rotate' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      config.capture_rotate = (size_t)mbytes * 1024 * 1024;
+      continue;
+    }
+
+    // get number of rotated traffic capture files to keep
+    if (! strcmp("capture_keep", param)) {
+      config.capture_keep = str2int(value, 0, 1000);
+      if (errno) {
+        wlog(L_WARN, "invalid 'capture_keep' value in config file '%s:%d'", config.file, lines_num);
+        return 5;
+      }
+      continue;
+    }
+
+    // get precompiled checkers datasets file location
+    if (! strcmp("snapshot_file", param)) {
+      config.snapshot_file = strdup(value);
+      assert(config.snapshot_file);
+      continue;
+    }
+
     // get GeoIP db file location
     if (! strcmp("geoip2_db", param)) {
       config.geoip2_db = strdup(value);
@@ -254,11 +482,55 @@ int config_read(void) {
  
   } // while(fgets...)
 
+  // done
+  return 0;
+}
+
+
+//! read config file.
+//! \param reload read checkers datasets settings only
+//! \return 0 on success or >0 on error
+static int config_read_file(int reload) {
+
+  // open config file
+  FILE *fp = fopen(config.file, "r");
+  if (!fp) {
+    wlog(L_ERR, "failed to read config file '%s': %s", config.file, strerror(errno));
+    return 1;
+  }
+
+  int err = config_parse(fp, reload);
+
   // cleanups
   fclose(fp);
 
-  // done
-  return 0;
+  return err;
+}
+
+
+//! read config file.
+//! \return 0 on success or >0 on error
+int config_read(void) {
+  return config_read_file(0);
+}
+
+
+//! re-read checkers datasets settings from config file; parsed
+//! checkers, sources and options are put in use by their init
+//! \return 0 on success or >0 on error
+int config_reload(void) {
+
+  free(config.snapshot_file);
+  config.snapshot_file = NULL;
+
+  int err = config_read_file(1);
+  if (err) {
+    checkers_config_free();
+    sources_config_free();
+    options_config_free();
+  }
+
+  return err;
 }
 
 
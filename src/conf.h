@@ -8,10 +8,6 @@
 //! common config data structure
 struct config {
 
-  // preserved args
-  char *execpath;     //!< full path to our executable
-  char **argv;        //!< argv[] from main()
-
   // runtime generated options
   char *file;         //!< config file path
   char *progname;     //!< our prog name
@@ -26,9 +22,31 @@ struct config {
   char *ssl_ca_file;       //!< path to CA bundle for SSL checker
   int ssl_timeout;         //!< ssl connection timeout
   int ssl_verify_ttl;      //!< ttl for host SSL data cache entries
+  int ssl_max_handshakes;  //!< max concurrent SSL handshakes
+  int ssl_race_delay;      //!< delay before racing next host ip, msecs
+  int ssl_cert_only;       //!< abort SSL handshake right after peer chain verification
+  int ssl_ocsp;            //!< check stapled OCSP responses
+  char *ssl_revoked;       //!< revoked certs set 'source[:filter]' (NULL if none)
+  int ssl_revoked_refresh; //!< revoked certs set refresh period (0 - never)
+  char *ssl_cache_file;    //!< persistent SSL results cache file (NULL to disable)
+  int ssl_cache_slots;     //!< persistent SSL results cache size
   int resolve_ttl;         //!< ttl for resolved host ips
   int resolve_neg_ttl;     //!< ttl for NEG resolved host ips
+  int resolve_prefetch;    //!< start resolving request hosts before checkers need them
+  int query_ttl;           //!< ttl for on-demand db query results
+  int query_cache_slots;   //!< on-demand db query results cache size (0 - no cache)
   char *geoip2_db;         //!< geoip2 db file location
+  char *stats_file;        //!< stats file in Prometheus text format (NULL if none)
+  int stats_interval;      //!< stats file write period, secs
+  char *record_hits_file;  //!< checkers records hits dump file (NULL to disable counting)
+  char *capture_file;      //!< traffic capture file (NULL to disable capture)
+  int capture_sample;      //!< capture 1 of every N requests
+  size_t capture_rotate;   //!< rotate capture file at this size, bytes (0 - never)
+  int capture_keep;        //!< number of rotated capture files to keep
+  char *snapshot_file;     //!< precompiled checkers datasets file (NULL if none)
+  int source_check_interval; //!< sources data change check period, secs (0 - never)
+  int init_threads;        //!< threads loading checkers and options data (0 - number of cpus)
+  int intern_records;      //!< share records data strings between checkers lists
 };
 
 //! max configurable threads concurrency
@@ -43,12 +61,18 @@ struct config {
 //! default TTL values
 #define DEFAULT_SSL_VERIFY_TTL     86400
 #define DEFAULT_SSL_TIMEOUT        10
+#define DEFAULT_SSL_MAX_HANDSHAKES 256
+#define DEFAULT_SSL_RACE_DELAY     250
+#define DEFAULT_SSL_CERT_ONLY      0
+#define DEFAULT_SSL_OCSP           0
 #define DEFAULT_RESOLVE_TTL        3600
 #define DEFAULT_NEG_RESOLVE_TTL    60
+#define DEFAULT_RESOLVE_PREFETCH   1
 #define DEFAULT_CA_FILE            "/etc/ssl/certs/ca-bundle.crt"
 #define DEFAULT_GEOIP2_DB_FILE     "/usr/share/GeoIP/GeoLite2-City.mmdb"
 
 extern int config_read(void);
+extern int config_reload(void);
 
 
 #endif //__ACLH_CONF_H__
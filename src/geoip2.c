@@ -4,6 +4,7 @@
 #include "log.h"
 #include "conf.h"
 #include "resolve.h"
+#include "tree.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -14,6 +15,7 @@
   #include <maxminddb.h>
 #endif
 
+#include "mem.h"
 #include "geoip2.h"
 
 
@@ -22,6 +24,24 @@
 static struct MMDB_s mmdb;
 #endif
 
+//! networks cache: binary trie over IPv4 address bits, a node at depth N
+//! may hold notes for N bits long network prefix (as MMDB reports it),
+//! so one db lookup serves the whole network block
+typedef struct geoip2_node {
+  struct geoip2_node *child[2];  //!< 0 and 1 bit branches
+  char *notes;                   //!< notes for network ending here (or NULL)
+} geoip2_node_t;
+
+//! networks cache root
+static geoip2_node_t geoip2_root;
+
+//! interned notes strings (they are never freed)
+static node_t *geoip2_notes;
+
+//! mutex for cache operations
+static pthread_mutex_t geoip2_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
 //! init geoip2 (maxmind) lookup engine
 //! \return 0 if ok, !0 on error
 int geoip2_init(void) {
@@ -40,87 +60,445 @@ int geoip2_init(void) {
 }
 
 
+//! find cached network holding the ip (geoip2_mutex must be held)
+//! \param ip ip address (host byte order)
+//! \return network notes or NULL if not cached
+static char *geoip2_cache_find(in_addr_t ip) {
+  geoip2_node_t *np = &geoip2_root;
+  int bit = 31;
+  // networks never overlap, so the first one on the path is it
+  while (np) {
+    if (np->notes)
+      return np->notes;
+    if (bit < 0)
+      break;
+    np = np->child[(ip >> bit --) & 1];
+  }
+  return NULL;
+}
+
+
+//! cache network notes (geoip2_mutex must be held)
+//! \param ip any ip address of the network (host byte order)
+//! \param len network prefix length
+//! \param notes network notes
+static void geoip2_cache_add(in_addr_t ip, int len, char *notes) {
+  geoip2_node_t *np = &geoip2_root;
+  int i;
+  for (i = 0; i < len; i ++) {
+    int b = (ip >> (31 - i)) & 1;
+    if (! np->child[b]) {
+      np->child[b] = calloc(1, sizeof(geoip2_node_t));
+      assert(np->child[b]);
+    }
+    np = np->child[b];
+  }
+  np->notes = notes;
+}
+
+
+//! intern notes string (geoip2_mutex must be held)
+//! \param notes notes to intern
+//! \return interned copy of the notes
+static char *geoip2_intern(char *notes) {
+  char *found = tree_find(notes, &geoip2_notes, (int (*)(const void *, const void *))strcmp);
+  if (! found) {
+    found = strdup(notes);
+    assert(found);
+    tree_search(found, &geoip2_notes, (int (*)(const void *, const void *))strcmp);
+  }
+  return found;
+}
 
-//! perform geoip lookup by provided ip
-//! the function never fails: in case of error it will fill '*gi2'
-//! structure with 'N/A' values
-//! \param ip_in ip address (or host name) to lookup
-//! \param gi2 address of geolication data to store in
-//! \return nothing
-void geoip2_lookup(char *ip_in, geoip2_data *gi2) {
 
 #ifdef USE_GEOIP2
 
 #define MIN_OF(a, b) ((a) < (b) ? (a) : (b));
 
+//! fill geolocation data from db lookup result
+//! \param res db lookup result
+//! \param gi2 address of geolocation data to store in
+static void geoip2_fill(MMDB_lookup_result_s *res, geoip2_data *gi2) {
+
+  MMDB_entry_data_s entry_data;
+
+  // fetch continent (2 letters)
+  memset(&entry_data, 0, sizeof(entry_data));
+  MMDB_get_value(&res->entry, &entry_data, "continent", "code", NULL);
+  if (entry_data.has_data && entry_data.type == MMDB_DATA_TYPE_UTF8_STRING) {
+    size_t len = MIN_OF(entry_data.data_size, sizeof(gi2->continent) - 1);
+    strncpy(gi2->continent, entry_data.utf8_string, len);
+    *(gi2->continent + len) = '\0';
+  }
+
+  // fetch country (2 letters)
+  memset(&entry_data, 0, sizeof(entry_data));
+  MMDB_get_value(&res->entry, &entry_data, "country", "iso_code", NULL);
+  if (entry_data.has_data && entry_data.type == MMDB_DATA_TYPE_UTF8_STRING) {
+    size_t len = MIN_OF(entry_data.data_size, sizeof(gi2->country) - 1);
+    strncpy(gi2->country, entry_data.utf8_string, len);
+    *(gi2->country + len) = '\0';
+  }
+
+  // fetch city (many letters, English name only)
+  memset(&entry_data, 0, sizeof(entry_data));
+  MMDB_get_value(&res->entry, &entry_data, "city", "names", "en", NULL);
+  if (entry_data.has_data && entry_data.type == MMDB_DATA_TYPE_UTF8_STRING) {
+    size_t len = MIN_OF(entry_data.data_size, sizeof(gi2->city) - 1);
+    strncpy(gi2->city, entry_data.utf8_string, len);
+    *(gi2->city + len) = '\0';
+  }
+}
+
+#endif // USE_GEOIP2
+
+
+//! perform geoip lookup by provided ip or host name
+//! the function never fails: in case of error notes will be filled
+//! with 'N/A' values
+//! \param ip_in ip address (or host name) to lookup
+//! \return notes string (GEOIP2_NOTES_TMPL filled in), it is never freed
+char *geoip2_lookup(char *ip_in) {
+
+  char *notes = NULL;
+  int len = -1;
+
   // init lookup results storage
-  strcpy(gi2->continent, "N/A");  // it is 4 bytes long
-  strcpy(gi2->country, "N/A");    // it is 4 bytes long
-  strcpy(gi2->city, "N/A");       // it is 64 bytes long
+  geoip2_data gi2;
+  strcpy(gi2.continent, "N/A");
+  strcpy(gi2.country, "N/A");
+  strcpy(gi2.city, "N/A");
 
   // resolve ip (it MAY be not an ip, but a hostname, so try
   // to resolve it anyway)
-  in_addr_t *ips = calloc(MAX_RESOLVED_IPS + 1, sizeof(in_addr_t));
-  assert(ips);
+  in_addr_t ips[MAX_RESOLVED_IPS + 1];
   int n_ips = resolve_host(ip_in, ips, MAX_RESOLVED_IPS);
 
-  // try to lookup in geoip2 db
+  // take first resolved IP (dunno what to do if host resolves to multiple addressess)
+  // and check if its network was looked up already
+  if (n_ips > 0) {
+    pthread_mutex_lock(&geoip2_mutex);
+    notes = geoip2_cache_find(ips[0]);
+    pthread_mutex_unlock(&geoip2_mutex);
+    if (notes) {
+      wlog(L_DEBUG5, "geoip2: found cached network for '%s'", ip_in);
+      return notes;
+    }
+  }
+
+#ifdef USE_GEOIP2
+
   int gai_error = 0, mmdb_error = 0;
   MMDB_lookup_result_s res;
-  if (n_ips < 1) 
-    // resolve failed, will try to go on as-is
-    res = MMDB_lookup_string(&mmdb, ip_in, &gai_error, &mmdb_error);
-  else
-    // take first resolved IP (dunno what to do if host resolves to multiple addressess)
-    res = MMDB_lookup_string(&mmdb, inet_ntoa(*(struct in_addr *)&ips[0]), &gai_error, &mmdb_error);
 
-  // no need in this anymore
-  free(ips);
+  if (n_ips < 1) {
+    // resolve failed (IPv6?), will try to go on as-is
+    res = MMDB_lookup_string(&mmdb, ip_in, &gai_error, &mmdb_error);
+  } else {
+    struct sockaddr_in sin = {0,};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(ips[0]);
+    res = MMDB_lookup_sockaddr(&mmdb, (struct sockaddr *)&sin, &mmdb_error);
+    // IPv4 networks in IPv6 db are reported with IPv6 netmask
+    if (mmdb_error == MMDB_SUCCESS) {
+      len = res.netmask - (mmdb.metadata.ip_version == 6 ? 96 : 0);
+      if (len < 0 || len > 32)
+        len = 32;
+    }
+  }
 
   // lookup success!
   if (! gai_error && mmdb_error == MMDB_SUCCESS && res.found_entry) {
-
     wlog(L_DEBUG5, "geoip2: found entry for '%s'", ip_in);
+    geoip2_fill(&res, &gi2);
+  // lookup failure...
+  } else {
+    wlog(L_DEBUG0, "geoip2: no entry found for '%s'", ip_in);
+  }
 
-    MMDB_entry_data_s entry_data;
+#endif // USE_GEOIP2
 
-    // fetch continent (2 letters)
-    memset(&entry_data, 0, sizeof(entry_data));
-    MMDB_get_value(&res.entry, &entry_data, "continent", "code", NULL);
-    if (entry_data.has_data && entry_data.type == MMDB_DATA_TYPE_UTF8_STRING) {
-      size_t len = MIN_OF(entry_data.data_size, sizeof(gi2->continent) - 1);
-      strncpy(gi2->continent, entry_data.utf8_string, len);
-      *(gi2->continent + len) = '\0';
-      
-    }
+  char buf[sizeof(GEOIP2_NOTES_TMPL) + sizeof(geoip2_data) + 1];
+  snprintf(buf, sizeof(buf), GEOIP2_NOTES_TMPL, gi2.continent, gi2.country, gi2.city);
+
+  // intern the notes and cache the network (not found ones too: db
+  // reports the netmask of empty block as well)
+  pthread_mutex_lock(&geoip2_mutex);
+  notes = geoip2_intern(buf);
+  if (len >= 0)
+    geoip2_cache_add(ips[0], len, notes);
+  pthread_mutex_unlock(&geoip2_mutex);
+
+  // all done
+  return notes;
+}
+
+
+#ifdef USE_GEOIP2
+
+//! db search tree walk state
+struct geoip2_walk {
+  char **codes;                  //!< wanted codes
+  int n_codes;                   //!< number of wanted codes
+  int continent;                 //!< codes are continent codes (country ones otherwise)
+  uint32_t *entries;             //!< decoded data entries hash: offset + 1 (0 - empty slot)
+  int *entry_codes;              //!< decoded data entries wanted code indexes (or -1)
+  uint32_t entries_size;         //!< entries hash size (power of 2)
+  uint32_t n_entries;            //!< number of decoded entries
+  struct geoip2_range *ranges;   //!< found ranges
+  int n_ranges;                  //!< number of found ranges
+  int size;                      //!< ranges array size
+};
 
-    // fetch country (2 letters)
-    memset(&entry_data, 0, sizeof(entry_data));
-    MMDB_get_value(&res.entry, &entry_data, "country", "iso_code", NULL);
-    if (entry_data.has_data && entry_data.type == MMDB_DATA_TYPE_UTF8_STRING) {
-      size_t len = MIN_OF(entry_data.data_size, sizeof(gi2->country) - 1);
-      strncpy(gi2->country, entry_data.utf8_string, len);
-      *(gi2->country + len) = '\0';
-    }
 
-    // fetch city (many letters, English name only)
-    memset(&entry_data, 0, sizeof(entry_data));
-    MMDB_get_value(&res.entry, &entry_data, "city", "names", "en", NULL);
-    if (entry_data.has_data && entry_data.type == MMDB_DATA_TYPE_UTF8_STRING) {
-      size_t len = MIN_OF(entry_data.data_size, sizeof(gi2->city) - 1);
-      strncpy(gi2->city, entry_data.utf8_string, len);
-      *(gi2->city + len) = '\0';
+//! find decoded entry slot in entries hash
+//! \param w walk state
+//! \param key entry key (offset + 1)
+//! \return slot index (with the key or empty one)
+static uint32_t geoip2_entry_slot(struct geoip2_walk *w, uint32_t key) {
+  uint32_t mask = w->entries_size - 1;
+  uint32_t idx = (key * 2654435761U) & mask;
+  while (w->entries[idx] && w->entries[idx] != key)
+    idx = (idx + 1) & mask;
+  return idx;
+}
+
+
+//! get wanted code index of db data entry (each entry is decoded once:
+//! there are much less entries than networks)
+//! \param w walk state
+//! \param entry db data entry
+//! \return code index or -1 if the entry code is not wanted
+static int geoip2_entry_code(struct geoip2_walk *w, MMDB_entry_s *entry) {
+
+  // keep entries hash at most half full
+  if (w->n_entries * 2 >= w->entries_size) {
+    uint32_t *old = w->entries, old_size = w->entries_size, i;
+    int *old_codes = w->entry_codes;
+    w->entries_size = old_size ? old_size * 2 : 4096;
+    w->entries = calloc(w->entries_size, sizeof(uint32_t));
+    w->entry_codes = calloc(w->entries_size, sizeof(int));
+    assert(w->entries && w->entry_codes);
+    for (i = 0; i < old_size; i ++)
+      if (old[i]) {
+        uint32_t idx = geoip2_entry_slot(w, old[i]);
+        w->entries[idx] = old[i];
+        w->entry_codes[idx] = old_codes[i];
+      }
+    free(old);
+    free(old_codes);
+  }
+
+  uint32_t key = entry->offset + 1;
+  uint32_t idx = geoip2_entry_slot(w, key);
+  if (w->entries[idx])
+    return w->entry_codes[idx];
+
+  // new entry: decode its code
+  int code = -1;
+  MMDB_entry_data_s entry_data;
+  memset(&entry_data, 0, sizeof(entry_data));
+  if (w->continent)
+    MMDB_get_value(entry, &entry_data, "continent", "code", NULL);
+  else
+    MMDB_get_value(entry, &entry_data, "country", "iso_code", NULL);
+
+  if (entry_data.has_data && entry_data.type == MMDB_DATA_TYPE_UTF8_STRING) {
+    int i;
+    for (i = 0; i < w->n_codes; i ++)
+      if (strlen(w->codes[i]) == entry_data.data_size &&
+          ! strncasecmp(w->codes[i], entry_data.utf8_string, entry_data.data_size)) {
+        code = i;
+        break;
+      }
+  }
+
+  w->entries[idx] = key;
+  w->entry_codes[idx] = code;
+  w->n_entries ++;
+
+  return code;
+}
+
+
+//! add found range (merging it with previous adjacent one of the same code)
+//! \param w walk state
+//! \param start first address
+//! \param end last address
+//! \param code wanted code index
+static void geoip2_range_add(struct geoip2_walk *w, uint32_t start, uint32_t end, int code) {
+
+  struct geoip2_range *last = w->n_ranges ? &w->ranges[w->n_ranges - 1] : NULL;
+  if (last && last->code == code && last->end + 1 == start) {
+    last->end = end;
+    return;
+  }
+
+  if (w->n_ranges == w->size) {
+    w->size = w->size ? w->size * 2 : 1024;
+    w->ranges = realloc(w->ranges, w->size * sizeof(struct geoip2_range));
+    assert(w->ranges);
+  }
+
+  w->ranges[w->n_ranges].start = start;
+  w->ranges[w->n_ranges].end = end;
+  w->ranges[w->n_ranges].code = code;
+  w->n_ranges ++;
+}
+
+
+static void geoip2_walk_node(struct geoip2_walk *, uint32_t, int, uint32_t);
+
+//! walk db search tree record
+//! \param w walk state
+//! \param rec record value
+//! \param type record type
+//! \param entry record data entry (if data record)
+//! \param depth record network prefix length
+//! \param prefix record network address
+static void geoip2_walk_record(struct geoip2_walk *w, uint64_t rec, uint8_t type, MMDB_entry_s *entry, int depth, uint32_t prefix) {
+  switch (type) {
+    case MMDB_RECORD_TYPE_SEARCH_NODE:
+      if (depth < 32)
+        geoip2_walk_node(w, (uint32_t)rec, depth, prefix);
+      break;
+    case MMDB_RECORD_TYPE_DATA: {
+      int code = geoip2_entry_code(w, entry);
+      if (code >= 0)
+        geoip2_range_add(w, prefix, prefix + (uint32_t)((1ULL << (32 - depth)) - 1), code);
+      break;
     }
+    default:
+      // empty or invalid record: nothing is there
+      break;
+  }
+}
 
-  // lookup failure...
-  } else {
-    wlog(L_DEBUG0, "geoip2: no entry found for '%s'", ip_in);
+
+//! walk db search tree node: left (0 bit) branch first, so ranges come sorted
+//! \param w walk state
+//! \param node node number
+//! \param depth node depth (network prefix length)
+//! \param prefix node network address
+static void geoip2_walk_node(struct geoip2_walk *w, uint32_t node, int depth, uint32_t prefix) {
+  MMDB_search_node_s sn;
+  if (MMDB_read_node(&mmdb, node, &sn) != MMDB_SUCCESS) {
+    wlog(L_WARN, "geoip2: failed to read search tree node %u", node);
+    return;
   }
+  geoip2_walk_record(w, sn.left_record, sn.left_record_type, &sn.left_record_entry, depth + 1, prefix);
+  geoip2_walk_record(w, sn.right_record, sn.right_record_type, &sn.right_record_entry, depth + 1, prefix | (1U << (31 - depth)));
+}
 
 #endif // USE_GEOIP2
 
-  // all done
-  return;
+
+//! walk db search tree once and extract IPv4 networks of wanted
+//! country or continent codes into sorted ranges table
+//! \param codes wanted codes
+//! \param n_codes number of wanted codes
+//! \param continent codes are continent codes (country ones otherwise)
+//! \param ranges where to store ranges array (to be freed)
+//! \return number of ranges or -1 on error
+int geoip2_ranges(char **codes, int n_codes, int continent, struct geoip2_range **ranges) {
+
+  *ranges = NULL;
+
+#ifdef USE_GEOIP2
+
+  struct geoip2_walk w = {0,};
+  w.codes = codes;
+  w.n_codes = n_codes;
+  w.continent = continent;
+
+  // IPv4 space of IPv6 db is ::/96 subtree
+  uint32_t node = 0;
+  if (mmdb.metadata.ip_version == 6) {
+    int i;
+    for (i = 0; i < 96; i ++) {
+      MMDB_search_node_s sn;
+      if (MMDB_read_node(&mmdb, node, &sn) != MMDB_SUCCESS) {
+        wlog(L_ERR, "geoip2: failed to read search tree node %u", node);
+        return -1;
+      }
+      if (sn.left_record_type != MMDB_RECORD_TYPE_SEARCH_NODE) {
+        // whole IPv4 space is one record
+        geoip2_walk_record(&w, sn.left_record, sn.left_record_type, &sn.left_record_entry, 0, 0);
+        break;
+      }
+      node = (uint32_t)sn.left_record;
+    }
+    if (i == 96)
+      geoip2_walk_node(&w, node, 0, 0);
+  } else
+    geoip2_walk_node(&w, node, 0, 0);
+
+  // decoded entries are not needed anymore
+  free(w.entries);
+  free(w.entry_codes);
+
+  wlog(L_DEBUG1, "geoip2: found %d IPv4 ranges of %d wanted %s codes", w.n_ranges, n_codes, continent ? "continent" : "country");
+
+  *ranges = w.ranges;
+  return w.n_ranges;
+
+#else
+  return -1;
+#endif
 }
 
 
+//! find ip in sorted ranges table
+//! \param ranges ranges table
+//! \param n number of ranges
+//! \param ip ip address (host byte order)
+//! \return code index of found range or -1
+int geoip2_range_find(struct geoip2_range *ranges, int n, uint32_t ip) {
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (ip < ranges[mid].start)
+      hi = mid - 1;
+    else if (ip > ranges[mid].end)
+      lo = mid + 1;
+    else
+      return ranges[mid].code;
+  }
+  return -1;
+}
+
+
+//! add networks trie nodes to memory usage (depth is 32 at most)
+static void geoip2_mem_node(geoip2_node_t *np, struct mem_usage *mu) {
+  int b;
+  for (b = 0; b < 2; b ++) {
+    if (np->child[b]) {
+      mem_add(mu, np->child[b], sizeof(geoip2_node_t));
+      geoip2_mem_node(np->child[b], mu);
+    }
+  }
+}
+
+//! add interned notes to memory usage
+static void geoip2_mem_note(void *key, void *arg) {
+  mem_add_str(arg, key);
+}
+
+//! report networks cache memory usage
+//! \param func report function
+//! \param arg report function argument
+void geoip2_mem(mem_report_f func, void *arg) {
+
+  struct mem_usage trie = {0,}, notes = {0,}, nodes = {0,};
+
+  pthread_mutex_lock(&geoip2_mutex);
+  geoip2_mem_node(&geoip2_root, &trie);
+  tree_walk(geoip2_notes, geoip2_mem_note, &notes);
+  mem_add_nodes(&nodes, geoip2_notes, notes.objects);
+  pthread_mutex_unlock(&geoip2_mutex);
+
+  func("geoip2_cache", "networks", &trie, arg);
+  func("geoip2_cache", "notes", &notes, arg);
+  func("geoip2_cache", "nodes", &nodes, arg);
+}
+
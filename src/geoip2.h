@@ -15,8 +15,17 @@ typedef struct geoip2_data {
 // or "N/A" if lookup failed
 #define GEOIP2_NOTES_TMPL "geoip2_continent='%s' geoip2_country='%s' geoip2_city='%s'"
 
+//! IPv4 addresses range belonging to one of wanted geo codes
+struct geoip2_range {
+  uint32_t start;     //!< first address (host byte order)
+  uint32_t end;       //!< last address (host byte order)
+  int code;           //!< wanted code index
+};
+
 extern int geoip2_init(void);
-extern void geoip2_lookup(char *, geoip2_data *);
+extern int geoip2_ranges(char **, int, int, struct geoip2_range **);
+extern int geoip2_range_find(struct geoip2_range *, int, uint32_t);
+extern char *geoip2_lookup(char *);
 
 #endif //__ACLH_GEOIP2_H__
 
@@ -0,0 +1,535 @@
+/** \file */
+
+
+#include "acl-helper.h"
+
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+
+// squid protocol load generator: runs helper processes as squid does
+// (one per channel, requests on stdin with concurrency sequence ids,
+// answers on stdout), keeps a number of requests outstanding on every
+// channel and measures answers latencies; every sequence id must be
+// answered exactly once
+//
+// requests are in 'external_acl_type' format of etc/squid.conf.inc:
+// %ACL %METHOD %SRC %un %PROTO %DST %PORT %PATH %URI
+// either synthetic or taken (cyclically) from a file
+
+
+//! max request/answer line size
+#define LG_LINE_SIZE      65536
+
+//! max number of channels
+#define LG_MAX_CHANNELS   64
+
+//! how long late (duplicate) answers are waited for after the last one, msecs
+#define LG_DRAIN_MSECS    200
+
+//! helper channel
+struct channel {
+  pid_t pid;                 //!< helper pid
+  int in;                    //!< helper stdin (we write requests here)
+  int out;                   //!< helper stdout (we read answers here)
+  uint32_t outstanding;      //!< requests sent but not answered yet
+  char *buf;                 //!< answers read buffer
+  size_t len;                //!< read buffer fill
+  int eof;                   //!< helper closed its stdout
+};
+
+//! request state (indexed by global sequence id)
+struct lg_req {
+  uint64_t sent;             //!< when request was sent, nsecs
+  uint32_t latency;          //!< answer latency, usecs
+  uint8_t channel;           //!< channel request was sent to
+  uint8_t answers;           //!< number of answers got
+};
+
+//! generator options
+static int lg_channels = 1, lg_concurrency = 30, lg_timeout = 10;
+static uint32_t lg_requests = 100000;
+static double lg_rate = 0;
+static char *lg_file;
+
+//! channels
+static struct channel channels[LG_MAX_CHANNELS];
+
+//! requests
+static struct lg_req *reqs;
+
+//! requests lines from file (NULL if synthetic)
+static char **lines;
+static size_t lines_num;
+
+//! answers anomalies
+static uint32_t ans_unknown, ans_dup, ans_bad;
+
+
+//! get monotonic time
+//! \return nsecs
+static uint64_t lg_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+//! parse positive integer option
+//! \param str string to parse
+//! \param min min value
+//! \param max max value
+//! \return parsed value (exits on error)
+static long lg_num(char *str, long min, long max) {
+  char *end;
+  errno = 0;
+  long val = strtol(str, &end, 10);
+  if (errno || *end || val < min || val > max) {
+    fprintf(stderr, "invalid value '%s' (must be %ld..%ld)\n", str, min, max);
+    exit(1);
+  }
+  return val;
+}
+
+
+//! show the help
+static void show_help(char *pname) {
+  printf("Usage: %s [options] -- helper [helper args]\n"
+         "where 'options' are:\n"
+         "  -h          show this help and exit\n"
+         "  -n <num>    number of requests to send (default is 100000)\n"
+         "  -c <num>    number of helper processes (channels, default is 1)\n"
+         "  -C <num>    outstanding requests per channel, must not exceed helper\n"
+         "              'concurrency' setting (default is 30)\n"
+         "  -r <rate>   send requests at this rate, req/s (default is 0: as fast\n"
+         "              as answers come, i.e. max sustainable rate)\n"
+         "  -i <file>   take requests from 'file' ('%%ACL %%METHOD %%SRC %%un %%PROTO\n"
+         "              %%DST %%PORT %%PATH %%URI' lines) instead of synthetic ones\n"
+         "  -t <secs>   wait for missing answers this long (default is 10)\n",
+         pname);
+}
+
+
+//! load requests file
+//! \return 0 if ok
+static int lg_load(char *file) {
+
+  FILE *fp = fopen(file, "r");
+  if (! fp) {
+    fprintf(stderr, "failed to open '%s': %s\n", file, strerror(errno));
+    return 1;
+  }
+
+  size_t size = 0, len = 0;
+  char *line = NULL;
+  ssize_t n;
+  while ((n = getline(&line, &len, fp)) >= 0) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+      line[-- n] = '\0';
+    if (! n || *line == COMMENT_CHAR)
+      continue;
+    if (lines_num == size) {
+      size = size ? size * 2 : 1024;
+      lines = realloc(lines, size * sizeof(char *));
+      assert(lines);
+    }
+    lines[lines_num] = strdup(line);
+    assert(lines[lines_num]);
+    lines_num ++;
+  }
+
+  free(line);
+  fclose(fp);
+
+  if (! lines_num) {
+    fprintf(stderr, "no requests in '%s'\n", file);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+//! make request line
+//! \param id sequence id
+//! \param buf where to put the line
+//! \param size buffer size
+//! \return line length
+static int lg_request(uint32_t id, char *buf, size_t size) {
+
+  int len;
+
+  if (lines)
+    len = snprintf(buf, size, "%u %s\n", id, lines[id % lines_num]);
+  else {
+    // a few thousands of hosts and clients, every 4th request is CONNECT
+    uint32_t host = (id * 2654435761u) % 5003, client = id % 251;
+    if (id % 4)
+      len = snprintf(buf, size, "%u eacl GET 10.0.%u.%u - HTTP www%u.example.com 80 /p/%u "
+                     "http://www%u.example.com/p/%u\n",
+                     id, client / 16, client % 16 + 1, host, id % 97, host, id % 97);
+    else
+      len = snprintf(buf, size, "%u eacl CONNECT 10.0.%u.%u - HTTPS www%u.example.com 443 - "
+                     "www%u.example.com:443\n",
+                     id, client / 16, client % 16 + 1, host, host);
+  }
+
+  return len < size ? len : size - 1;
+}
+
+
+//! start helper on a channel
+//! \param ch channel
+//! \param argv helper command line
+//! \return 0 if ok
+static int lg_spawn(struct channel *ch, char **argv) {
+
+  int in[2], out[2];
+  if (pipe(in) || pipe(out)) {
+    fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+    return 1;
+  }
+
+  ch->pid = fork();
+  if (ch->pid < 0) {
+    fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (! ch->pid) {
+    dup2(in[0], 0);
+    dup2(out[1], 1);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    execvp(argv[0], argv);
+    fprintf(stderr, "failed to exec '%s': %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  // keep our pipe ends out of next helpers
+  close(in[0]);
+  close(out[1]);
+  ch->in = in[1];
+  ch->out = out[0];
+  fcntl(ch->in, F_SETFD, FD_CLOEXEC);
+  fcntl(ch->out, F_SETFD, FD_CLOEXEC);
+  fcntl(ch->out, F_SETFL, O_NONBLOCK);
+  ch->buf = malloc(LG_LINE_SIZE);
+  assert(ch->buf);
+
+  return 0;
+}
+
+
+//! wait for helper to get ready: send a probe request and wait for
+//! its answer (helper startup is not counted in latencies)
+//! \param ch channel
+//! \return 0 if ok
+static int lg_probe(struct channel *ch) {
+
+  char line[LG_LINE_SIZE];
+  int len = lg_request(UINT32_MAX, line, sizeof(line));
+  if (write(ch->in, line, len) != len)
+    return 1;
+
+  struct pollfd pfd = {ch->out, POLLIN, 0};
+  while (poll(&pfd, 1, lg_timeout * 1000) > 0) {
+    ssize_t n = read(ch->out, ch->buf + ch->len, LG_LINE_SIZE - ch->len - 1);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (n <= 0)
+      return 1;
+    ch->len += n;
+    ch->buf[ch->len] = '\0';
+    char *nl = strchr(ch->buf, '\n');
+    if (nl) {
+      ch->len -= nl + 1 - ch->buf;
+      memmove(ch->buf, nl + 1, ch->len);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+//! process answer line
+//! \param chn channel number
+//! \param line answer line
+//! \param now current time
+//! \return 1 if it is a valid answer, 0 otherwise
+static int lg_answer(int chn, char *line, uint64_t now) {
+
+  char *end;
+  errno = 0;
+  unsigned long id = strtoul(line, &end, 10);
+  if (errno || end == line || (*end && *end != ' ')) {
+    ans_bad ++;
+    return 0;
+  }
+  if (id >= lg_requests || ! reqs[id].sent || reqs[id].channel != chn) {
+    ans_unknown ++;
+    return 0;
+  }
+  if (reqs[id].answers ++) {
+    ans_dup ++;
+    return 0;
+  }
+
+  uint64_t usecs = (now - reqs[id].sent) / 1000;
+  reqs[id].latency = usecs > UINT32_MAX ? UINT32_MAX : usecs;
+  channels[chn].outstanding --;
+
+  return 1;
+}
+
+
+//! read answers from a channel
+//! \param chn channel number
+//! \return number of valid answers read
+static uint32_t lg_read(int chn) {
+
+  struct channel *ch = &channels[chn];
+  uint32_t answers = 0;
+
+  while (1) {
+    ssize_t n = read(ch->out, ch->buf + ch->len, LG_LINE_SIZE - ch->len - 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (! n)
+        ch->eof = 1;
+      break;
+    }
+    ch->len += n;
+    ch->buf[ch->len] = '\0';
+
+    uint64_t now = lg_now();
+    char *line = ch->buf, *nl;
+    while ((nl = strchr(line, '\n'))) {
+      *nl = '\0';
+      answers += lg_answer(chn, line, now);
+      line = nl + 1;
+    }
+    ch->len -= line - ch->buf;
+    memmove(ch->buf, line, ch->len);
+
+    // too long line
+    if (ch->len == LG_LINE_SIZE - 1) {
+      ans_bad ++;
+      ch->len = 0;
+    }
+  }
+
+  return answers;
+}
+
+
+//! wait for answers and read them
+//! \param pfds poll array (one per channel)
+//! \param timeout poll timeout, msecs
+//! \return number of valid answers read or -1 if there is nothing to wait for
+static int lg_poll(struct pollfd *pfds, int timeout) {
+
+  int i, open = 0;
+  for (i = 0; i < lg_channels; i ++) {
+    pfds[i].fd = channels[i].eof ? -1 : channels[i].out;
+    pfds[i].events = POLLIN;
+    open += ! channels[i].eof;
+  }
+  if (! open) {
+    fprintf(stderr, "all helpers exited\n");
+    return -1;
+  }
+  if (poll(pfds, lg_channels, timeout) < 0 && errno != EINTR) {
+    fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  int answers = 0;
+  for (i = 0; i < lg_channels; i ++) {
+    if (pfds[i].revents)
+      answers += lg_read(i);
+  }
+
+  return answers;
+}
+
+
+//! latencies sort compare
+static int lg_cmp(const void *a, const void *b) {
+  uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+
+//! the main function
+int main(int argc, char *argv[]) {
+
+  char *progname = rindex(argv[0], '/') ? rindex(argv[0], '/') + 1 : argv[0];
+
+  int opt;
+  while ((opt = getopt(argc, argv, "hn:c:C:r:i:t:")) != -1) {
+    switch (opt) {
+      case 'n':
+        lg_requests = lg_num(optarg, 1, 100000000);
+        break;
+      case 'c':
+        lg_channels = lg_num(optarg, 1, LG_MAX_CHANNELS);
+        break;
+      case 'C':
+        lg_concurrency = lg_num(optarg, 1, 65535);
+        break;
+      case 'r':
+        lg_rate = lg_num(optarg, 0, 100000000);
+        break;
+      case 'i':
+        lg_file = optarg;
+        break;
+      case 't':
+        lg_timeout = lg_num(optarg, 1, 86400);
+        break;
+      case 'h':
+        show_help(progname);
+        exit(0);
+      default:
+        show_help(progname);
+        exit(1);
+    }
+  }
+
+  if (optind >= argc) {
+    show_help(progname);
+    exit(1);
+  }
+
+  if (lg_file && lg_load(lg_file))
+    exit(1);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  reqs = calloc(lg_requests, sizeof(struct lg_req));
+  assert(reqs);
+
+  int i;
+  for (i = 0; i < lg_channels; i ++) {
+    if (lg_spawn(&channels[i], argv + optind))
+      exit(2);
+  }
+  for (i = 0; i < lg_channels; i ++) {
+    if (lg_probe(&channels[i])) {
+      fprintf(stderr, "channel %d: helper did not answer probe request\n", i);
+      exit(2);
+    }
+  }
+
+  struct pollfd *pfds = calloc(lg_channels, sizeof(struct pollfd));
+  assert(pfds);
+
+  char line[LG_LINE_SIZE];
+  uint32_t sent = 0, answered = 0;
+  uint64_t started = lg_now(), last_answer = started;
+  int next = 0;
+
+  while (answered < sent || sent < lg_requests) {
+
+    uint64_t now = lg_now();
+
+    // send requests: to channels with free slots, in turn; at fixed
+    // rate a request is timed from when it was due, so time it waited
+    // for a free slot counts too
+    int timeout = 100;
+    while (sent < lg_requests) {
+      uint64_t at = 0;
+      if (lg_rate > 0) {
+        at = started + (uint64_t)(sent * 1e9 / lg_rate);
+        if (at > now) {
+          timeout = (at - now) / 1000000;
+          break;
+        }
+      }
+      for (i = 0; i < lg_channels; i ++) {
+        struct channel *ch = &channels[(next + i) % lg_channels];
+        if (! ch->eof && ch->outstanding < lg_concurrency)
+          break;
+      }
+      if (i == lg_channels)
+        break;
+      int chn = (next + i) % lg_channels;
+      next = chn + 1;
+
+      int len = lg_request(sent, line, sizeof(line));
+      reqs[sent].sent = at ? at : lg_now();
+      reqs[sent].channel = chn;
+      if (write(channels[chn].in, line, len) != len) {
+        fprintf(stderr, "channel %d: write failed: %s\n", chn, strerror(errno));
+        channels[chn].eof = 1;
+        continue;
+      }
+      channels[chn].outstanding ++;
+      sent ++;
+    }
+
+    // wait for answers
+    int n = lg_poll(pfds, timeout);
+    if (n < 0)
+      break;
+    now = lg_now();
+    if (n)
+      last_answer = now;
+    answered += n;
+
+    // answers stalled
+    if (sent == lg_requests && now - last_answer > (uint64_t)lg_timeout * 1000000000) {
+      fprintf(stderr, "no answers for %d secs, giving up\n", lg_timeout);
+      break;
+    }
+  }
+
+  double elapsed = (lg_now() - started) / 1e9;
+
+  // all answered: duplicate answers may still come, catch them
+  uint64_t drain_end = lg_now() + LG_DRAIN_MSECS * 1000000ULL, now;
+  while (answered == sent && (now = lg_now()) < drain_end)
+    if (lg_poll(pfds, (drain_end - now) / 1000000 + 1) < 0)
+      break;
+
+  // stop helpers
+  for (i = 0; i < lg_channels; i ++) {
+    close(channels[i].in);
+    int status;
+    waitpid(channels[i].pid, &status, 0);
+  }
+
+  // collect latencies and missing answers
+  uint32_t *lat = malloc(sizeof(uint32_t) * (sent ? sent : 1));
+  assert(lat);
+  uint32_t id, num = 0, missing = 0;
+  uint64_t sum = 0;
+  for (id = 0; id < sent; id ++) {
+    if (! reqs[id].answers)
+      missing ++;
+    else {
+      lat[num ++] = reqs[id].latency;
+      sum += reqs[id].latency;
+    }
+  }
+  qsort(lat, num, sizeof(uint32_t), lg_cmp);
+
+  printf("channels: %d, concurrency: %d, rate: %s\n", lg_channels, lg_concurrency,
+         lg_rate > 0 ? "fixed" : "max");
+  printf("requests: sent %u, answered %u, missing %u, duplicate %u, unknown %u, malformed %u\n",
+         sent, num, missing, ans_dup, ans_unknown, ans_bad);
+  printf("elapsed: %.3f secs, rate: %.1f answers/s\n", elapsed, elapsed > 0 ? num / elapsed : 0.0);
+  if (num)
+    printf("latency, us: avg %.1f, p50 %u, p90 %u, p99 %u, p999 %u, max %u\n",
+           (double)sum / num, lat[num / 2], lat[(uint64_t)num * 90 / 100],
+           lat[(uint64_t)num * 99 / 100], lat[(uint64_t)num * 999 / 1000], lat[num - 1]);
+
+  // every request answered exactly once?
+  return (missing || ans_dup || ans_unknown || ans_bad) ? 3 : 0;
+}
+
@@ -1,93 +1,64 @@
-
 /** \file */
 
 #include "acl-helper.h"
 #include "conf.h"
 #include "misc.h"
 
+#include <semaphore.h>
+
 #include "log.h"
 
 static FILE *log_fp;
 
 static struct log log;
 
-// this is to avoid logs mixing
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+// messages are formatted by calling threads into a lock-free ring
+// (multiple producers, single consumer) and written out by a
+// background writer thread, so request threads never wait for each
+// other or for log i/o; before the writer is started (or if the ring
+// is full) messages are written directly
 
+//! messages ring (NULL until writer is started)
+static struct log_slot *log_ring;
 
-//! internal logging function
-//! \param prio logging priority
-//! \param format logging string format
-//! \param ... format option list
-//! \return nothing
-void wlog(int prio, const char *format, ...) {
+//! ring positions: next slot to fill and next slot to write out
+static uint64_t log_head, log_tail;
 
+//! number of debug messages dropped because the ring was full
+static unsigned long log_dropped;
 
-  va_list ap;
-  va_start(ap, format);
+//! writer wakeup semaphore
+static sem_t log_sem;
 
-  // ignore debugs if bigger then level
-  if (prio >= L_DEBUG && prio - L_DEBUG0 > config.debug) {
-    return;
-  }
-
-
-  // log NOT into syslog...
-  if (log.mode != LOGMODE_SYSLOG) {
-
-    // log to file - open if it is not already or choose stderr otherwise
-    if (! log_fp && log.file) {
-      log_fp = fopen(log.file, "a");
-      if (! log_fp) {
-        fprintf(stderr, "ERROR: failed to open log file '%s': %s\nERROR: using STDERR for logging\n",
-                log.file, strerror(errno));
-        log_fp = stderr;
-      }
-    }
+// this is to avoid logs mixing (taken by writers only)
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-    // get current time
-    time_t now = time(NULL);
-    char tsbuf[26];
-    ctime_r(&now, tsbuf);
-    tsbuf[24] = '\0';
+//! cached thread id
+static __thread unsigned long log_tid;
 
-    // compose log prio into string
-    char *sprio;
-    switch (prio) {
-      case L_ERR   : sprio = "ERROR"; break;
-      case L_WARN  : sprio = "WARNING"; break;
-      case L_NOTE  : sprio = "NOTICE"; break;
-      case L_INFO  : sprio = "INFO"; break;
-      case L_CRIT  : sprio = "CRITICAL"; break;
-      default      : sprio = "DEBUG"; break;
-    }
 
-    // log where? use local var
-    FILE *local_log_fp;
-    if (! log_fp)
-      local_log_fp = stderr;
-    else
-      local_log_fp = log_fp;
-
-    // print first part of the message
-    pthread_mutex_lock(&log_mutex);
+//! get current thread id (cached)
+static unsigned long log_thread_id(void) {
+  if (! log_tid) {
 #if (defined HAVE_SYS_SYSCALL_H && defined __NR_gettid)
-    fprintf(local_log_fp, "%s %s[%lu:%lu] %s: ", 
-            tsbuf, log.ident, (unsigned long)config.pid, (unsigned long)syscall(__NR_gettid), sprio);
+    log_tid = (unsigned long)syscall(__NR_gettid);
 #else
-    fprintf(local_log_fp, "%s %s[%lu:%lu] %s: ",
-            tsbuf, log.ident, (unsigned long)config.pid, (unsigned long)pthread_self(), sprio);
-#endif
-    // print the message itself
-    vfprintf(local_log_fp, format, ap);
-    fputc('\n', local_log_fp);
-#ifdef DEBUG
-    fflush(local_log_fp);
+    log_tid = (unsigned long)pthread_self();
 #endif
-    pthread_mutex_unlock(&log_mutex);
+  }
+  return log_tid;
+}
+
+
+//! write one message out (log_mutex must be held)
+//! \param prio logging priority
+//! \param ts message timestamp
+//! \param tid thread id
+//! \param msg message text
+static void log_write(int prio, time_t ts, unsigned long tid, const char *msg) {
 
   // log to syslog requested
-  } else {
+  if (log.mode == LOGMODE_SYSLOG) {
 
     // guess the prio
     int iprio;
@@ -100,18 +71,153 @@ void wlog(int prio, const char *format, ...) {
       default      : iprio = LOG_DEBUG; break;
     }
 
-    // send the log 
-    // (and yes, close it immediately for safety)
-    //! \todo TODO: include thread_id support into message (as in above)
-    openlog(log.ident, LOG_PID, log.facility);
-    vsyslog(iprio, format, ap);
-    closelog();
+    // syslog is opened once by log_init()
+    syslog(iprio, "[%lu] %s", tid, msg);
+    return;
+  }
+
+  // log to file - open if it is not already or choose stderr otherwise
+  if (! log_fp && log.file) {
+    log_fp = fopen(log.file, "a");
+    if (! log_fp) {
+      fprintf(stderr, "ERROR: failed to open log file '%s': %s\nERROR: using STDERR for logging\n",
+              log.file, strerror(errno));
+      log_fp = stderr;
+    }
+  }
+
+  // format timestamp once a second
+  static time_t ts_last = -1;
+  static char tsbuf[26];
+  if (ts != ts_last) {
+    ctime_r(&ts, tsbuf);
+    tsbuf[24] = '\0';
+    ts_last = ts;
+  }
+
+  // compose log prio into string
+  char *sprio;
+  switch (prio) {
+    case L_ERR   : sprio = "ERROR"; break;
+    case L_WARN  : sprio = "WARNING"; break;
+    case L_NOTE  : sprio = "NOTICE"; break;
+    case L_INFO  : sprio = "INFO"; break;
+    case L_CRIT  : sprio = "CRITICAL"; break;
+    default      : sprio = "DEBUG"; break;
+  }
+
+  fprintf(log_fp ? log_fp : stderr, "%s %s[%lu:%lu] %s: %s\n",
+          tsbuf, log.ident, (unsigned long)config.pid, tid, sprio, msg);
+}
+
+
+//! write out all queued messages
+static void log_drain(void) {
+
+  pthread_mutex_lock(&log_mutex);
+
+  while (1) {
+    struct log_slot *slot = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+      break;
+    log_write(slot->prio, slot->ts, slot->tid, slot->msg);
+    // give the slot back to producers (one lap later)
+    __atomic_store_n(&slot->seq, log_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    log_tail ++;
+  }
 
+  unsigned long dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%lu debug messages dropped (log is too slow)", dropped);
+    log_write(L_WARN, time(NULL), log_thread_id(), msg);
   }
 
-  // all done
+  if (log.mode != LOGMODE_SYSLOG)
+    fflush(log_fp ? log_fp : stderr);
+
+  pthread_mutex_unlock(&log_mutex);
+}
+
+
+//! log writer thread
+static void *log_writer(void *arg) {
+  while (1) {
+    while (sem_wait(&log_sem) && errno == EINTR);
+    log_drain();
+  }
+  return NULL;
+}
+
+
+//! write out queued messages (to be called before exit/exec)
+void log_flush(void) {
+  if (log_ring)
+    log_drain();
+}
+
+
+//! internal logging function (use wlog() macro)
+//! \param prio logging priority
+//! \param format logging string format
+//! \param ... format option list
+//! \return nothing
+void _wlog(int prio, const char *format, ...) {
+
+  // ignore debugs if bigger then level
+  if (! log_enabled(prio))
+    return;
+
+  va_list ap;
+  va_start(ap, format);
+
+  time_t now = time(NULL);
+  unsigned long tid = log_thread_id();
+  struct log_slot *ring = __atomic_load_n(&log_ring, __ATOMIC_ACQUIRE);
+
+  // claim a ring slot: it is free if its seq equals our position
+  if (ring) {
+    uint64_t pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    while (1) {
+      struct log_slot *slot = &ring[pos & (LOG_RING_SIZE - 1)];
+      int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+      if (diff == 0) {
+        if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          // got it: fill and publish
+          slot->prio = prio;
+          slot->ts = now;
+          slot->tid = tid;
+          vsnprintf(slot->msg, sizeof(slot->msg), format, ap);
+          __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+          sem_post(&log_sem);
+          va_end(ap);
+          return;
+        }
+      } else if (diff < 0) {
+        // ring is full: drop debug messages, write others directly
+        if (prio >= L_DEBUG0) {
+          __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+          va_end(ap);
+          return;
+        }
+        break;
+      } else
+        pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    }
+  }
+
+  // no writer yet (or ring is full): write the message right now
+  char msg[LOG_MSG_SIZE];
+  vsnprintf(msg, sizeof(msg), format, ap);
   va_end(ap);
 
+  pthread_mutex_lock(&log_mutex);
+  log_write(prio, now, tid, msg);
+#ifdef DEBUG
+  if (log.mode != LOGMODE_SYSLOG)
+    fflush(log_fp ? log_fp : stderr);
+#endif
+  pthread_mutex_unlock(&log_mutex);
 }
 
 
@@ -220,8 +326,36 @@ int log_config(char *str) {
 //! init logging
 //! \return 0 if ok
 int log_init(void) {
+
   if (! log.ident)
     log.ident = config.progname;
+
+  if (log.mode == LOGMODE_SYSLOG)
+    openlog(log.ident, LOG_PID | LOG_NDELAY, log.facility);
+
+  // start async writer
+  struct log_slot *ring = calloc(LOG_RING_SIZE, sizeof(struct log_slot));
+  if (! ring)
+    return 1;
+  uint64_t i;
+  for (i = 0; i < LOG_RING_SIZE; i ++)
+    ring[i].seq = i;
+
+  sem_init(&log_sem, 0, 0);
+
+  pthread_t thread_id;
+  pthread_attr_t thread_attr;
+  pthread_attr_init(&thread_attr);
+  pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+  int err = pthread_create(&thread_id, &thread_attr, log_writer, NULL);
+  pthread_attr_destroy(&thread_attr);
+  if (err) {
+    free(ring);
+    return 1;
+  }
+
+  __atomic_store_n(&log_ring, ring, __ATOMIC_RELEASE);
+
   return 0;
 }
 
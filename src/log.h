@@ -29,6 +29,21 @@
 #define L_DEBUG9     109
 
 
+//! max formatted message length
+#define LOG_MSG_SIZE     1024
+
+//! messages ring size (power of 2)
+#define LOG_RING_SIZE    1024
+
+//! queued log message
+struct log_slot {
+  uint64_t seq;               //!< slot sequence: tells if slot is free or filled
+  int prio;                   //!< logging priority
+  time_t ts;                  //!< message timestamp
+  unsigned long tid;          //!< thread id
+  char msg[LOG_MSG_SIZE];     //!< formatted message
+};
+
 //! logging config data
 struct log {
   int mode;           //!< mode: file, syslog, etc
@@ -39,7 +54,19 @@ struct log {
 
 extern int log_init(void);
 extern int log_config(char *);
-extern void wlog(int, const char *, ...);
+extern void log_flush(void);
+extern void _wlog(int, const char *, ...);
+
+//! is logging with given prio enabled? (needs conf.h)
+#define log_enabled(prio) ((prio) < L_DEBUG0 || (prio) - L_DEBUG0 <= config.debug)
+
+//! log a message: disabled debug levels cost a single compare,
+//! message args are not even evaluated
+#define wlog(prio, ...) \
+  do { \
+    if (log_enabled(prio)) \
+      _wlog((prio), __VA_ARGS__); \
+  } while (0)
 
 #endif //__ACLH_LOG_H__
 
@@ -8,6 +8,8 @@
 #include "conf.h"
 #include "checker.h"
 #include "url.h"
+#include "stats.h"
+#include "capture.h"
 
 #include "loop.h"
 
@@ -18,6 +20,13 @@
 //! a threaded function itself
 static void *process_request(void *);
 
+//! request passed to processing thread
+struct request {
+  uint64_t received;         //!< when request was read (see stats_now())
+  uint32_t capture;          //!< capture id (0 if not captured)
+  char buf[];                //!< request line
+};
+
 //! running threads counter
 static int tcounter = 0;
 
@@ -45,6 +54,8 @@ int loop_run(void) {
 
     wlog(L_DEBUG9, "busy threads: %d/%d", tcounter, config.concurrency);
 
+    uint64_t received = stats_now();
+
     // strip blanks
     char *sbuf = strip_blanks(buf);
 
@@ -63,11 +74,14 @@ int loop_run(void) {
     pthread_mutex_unlock(&tcounter_mutex);
 
     // make a copy for a thread to work with
-    void *sbuf_p = (void *)strdup(sbuf);
-    assert(sbuf_p);
+    struct request *req = malloc(sizeof(struct request) + strlen(sbuf) + 1);
+    assert(req);
+    req->received = received;
+    req->capture = capture_request(sbuf, received);
+    strcpy(req->buf, sbuf);
 
     // create a processing thread (will detach itself)
-    if (pthread_create(&thread_id , &thread_attr, process_request, sbuf_p) < 0) {
+    if (pthread_create(&thread_id , &thread_attr, process_request, req) < 0) {
       wlog(L_ERR, "thread creation failed: %s", strerror(errno));
       return 1;
     }
@@ -78,22 +92,21 @@ int loop_run(void) {
 }
 
 
-//! main request processing function
-//! \param buf a string read from stdin
-//! \return nothing, actually
-void *process_request(void *buf) {
+//! parse squid request line and run the checkers over it
+//! \param buf request line (will be modified)
+//! \return response line to send to squid (must be freed) or NULL
+char *loop_request(char *buf) {
 
-  wlog(L_DEBUG7, "got from squid [%s]", (char *)buf);
+  uint64_t started = stats_now();
 
-  char *respline = NULL;
+  wlog(L_DEBUG7, "got from squid [%s]", buf);
+
+  char *respline = NULL, *resp = NULL;
 
   // parse squid input line
   char **tokens = calloc(SQUID_MAX_TOKENS + 1, sizeof(char *));
   assert(tokens);
-  int tokens_num = parse_string((char *)buf, tokens, " +", SQUID_MAX_TOKENS + 1);
-
-  // no need in this anymore
-  free(buf);
+  int tokens_num = parse_string(buf, tokens, " +", SQUID_MAX_TOKENS + 1);
 
   // decode tokens (if they are %% encoded)
   // decoded string is always shorter then original, so no worries here
@@ -114,15 +127,15 @@ void *process_request(void *buf) {
     respline = checkers_call(tokens + 1, tokens_num - 2);
   }
 
-  // ok, send the resp to squid
+  // ok, make the resp for squid
   if (respline) {
     wlog(L_DEBUG7, "sending to squid: [%s %s]", seq_id, respline);
-    if (*seq_id) {
-      fputs(seq_id, stdout);
-      fputc(' ', stdout);
-    }
-    fputs(respline, stdout);
-    fputc('\n', stdout);
+    resp = malloc(strlen(seq_id) + strlen(respline) + 2);
+    assert(resp);
+    if (*seq_id)
+      sprintf(resp, "%s %s", seq_id, respline);
+    else
+      strcpy(resp, respline);
     free(respline);
   }
 
@@ -133,15 +146,38 @@ void *process_request(void *buf) {
   }
   free(tokens);
 
+  stats_add(STATS_REQUEST, 0, stats_now() - started);
+
+  return resp;
+}
+
+
+//! request processing thread
+//! \param arg request read from stdin
+//! \return nothing, actually
+void *process_request(void *arg) {
+
+  struct request *req = arg;
+  stats_add(STATS_QUEUE, 0, stats_now() - req->received);
+
+  char *resp = loop_request(req->buf);
+  if (resp) {
+    // answers of concurrent threads must not interleave
+    flockfile(stdout);
+    fputs(resp, stdout);
+    fputc('\n', stdout);
+    funlockfile(stdout);
+    capture_response(req->capture, resp, req->received);
+    free(resp);
+  }
+  free(req);
+
   // decrease threads counter
   pthread_mutex_lock(&tcounter_mutex);
   tcounter --;
   pthread_cond_signal(&tcounter_condvar);
   pthread_mutex_unlock(&tcounter_mutex);
 
-  
   // all done
   pthread_exit(NULL);
 }
-
-
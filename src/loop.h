@@ -13,6 +13,7 @@
 #define SQUID_MAX_TOKENS  64 
 
 extern int loop_run(void);
+extern char *loop_request(char *);
 
 #endif //__ACLH_LOOP_H__
 
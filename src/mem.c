@@ -0,0 +1,174 @@
+/** \file */
+
+
+#include "acl-helper.h"
+#include "log.h"
+#include "conf.h"
+
+#ifdef __GLIBC__
+  #include <malloc.h>
+#endif
+
+#include "mem.h"
+
+
+// memory accounting: nothing is tracked on allocation, instead every
+// module walks its long living data on request and tells how much
+// memory its objects take (by allocator chunk sizes where they are known)
+
+
+//! add allocated object to memory usage
+//! \param mu memory usage to update
+//! \param ptr allocated object (NULL is ignored)
+//! \param size requested object size (used if real one is unknown)
+void mem_add(struct mem_usage *mu, void *ptr, size_t size) {
+  if (! ptr)
+    return;
+#ifdef __GLIBC__
+  // usable size plus chunk header
+  size = malloc_usable_size(ptr) + sizeof(size_t);
+#endif
+  mu->bytes += size;
+  mu->objects ++;
+}
+
+
+//! add allocated string to memory usage
+//! \param mu memory usage to update
+//! \param str string (NULL is ignored)
+void mem_add_str(struct mem_usage *mu, char *str) {
+  if (str)
+    mem_add(mu, str, strlen(str) + 1);
+}
+
+
+//! add tree nodes to memory usage
+//! \param mu memory usage to update
+//! \param root tree root (all nodes are of its size)
+//! \param num number of nodes
+void mem_add_nodes(struct mem_usage *mu, node_t *root, size_t num) {
+  if (! root || ! num)
+    return;
+  struct mem_usage node = {0,};
+  mem_add(&node, root, sizeof(node_t));
+  mu->bytes += node.bytes * num;
+  mu->objects += num;
+}
+
+
+//! tree keys counter
+static void mem_count_key(void *key, void *arg) {
+  (*(size_t *)arg) ++;
+}
+
+//! count tree keys (nodes)
+//! \param root tree root
+//! \return number of keys
+size_t mem_tree_keys(node_t *root) {
+  size_t num = 0;
+  tree_walk(root, mem_count_key, &num);
+  return num;
+}
+
+
+//! get process resident memory size
+//! \return RSS in bytes (0 if unknown)
+size_t mem_rss(void) {
+  unsigned long size, resident = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+      resident = 0;
+    fclose(fp);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+//! collect memory usage of all owners
+//! \param func function to call for each owner and objects kind
+//! \param arg function argument
+void mem_report(mem_report_f func, void *arg) {
+  checkers_mem(func, arg);
+  options_mem(func, arg);
+  resolve_mem(func, arg);
+  geoip2_mem(func, arg);
+  ssl_mem(func, arg);
+  revoked_mem(func, arg);
+  sslcache_mem(func, arg);
+}
+
+
+//! memory usage of owner's objects kind from last report
+struct mem_line {
+  char *owner;               //!< memory owner
+  char *kind;                //!< objects kind
+  struct mem_usage usage;    //!< memory used
+};
+
+//! memory usage lines being collected
+struct mem_lines {
+  struct mem_line *lines;    //!< lines array
+  int num;                   //!< number of lines
+  struct mem_usage total;    //!< all lines sum
+};
+
+//! last report lines (the walk locks caches requests use, so periodic
+//! stats export takes these)
+static struct mem_lines mem_last;
+
+//! last report lines lock
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//! free memory usage lines
+static void mem_lines_free(struct mem_lines *ml) {
+  int i;
+  for (i = 0; i < ml->num; i ++) {
+    free(ml->lines[i].owner);
+    free(ml->lines[i].kind);
+  }
+  free(ml->lines);
+}
+
+
+//! log memory usage line and keep it
+static void mem_log_line(char *owner, char *kind, struct mem_usage *mu, void *arg) {
+  struct mem_lines *ml = arg;
+  ml->total.bytes += mu->bytes;
+  ml->total.objects += mu->objects;
+  ml->lines = realloc(ml->lines, (ml->num + 1) * sizeof(struct mem_line));
+  assert(ml->lines);
+  ml->lines[ml->num].owner = strdup(owner);
+  assert(ml->lines[ml->num].owner);
+  ml->lines[ml->num].kind = strdup(kind);
+  assert(ml->lines[ml->num].kind);
+  ml->lines[ml->num ++].usage = *mu;
+  wlog(L_INFO, "memory: %s: %s: %zu objects, %zu bytes", owner, kind, mu->objects, mu->bytes);
+}
+
+//! write memory usage report into the log (it is kept for mem_last_report())
+void mem_log(void) {
+  struct mem_lines ml = {NULL, 0, {0,}};
+  mem_report(mem_log_line, &ml);
+  wlog(L_INFO, "memory: total accounted %zu bytes in %zu objects, RSS %zu bytes",
+       ml.total.bytes, ml.total.objects, mem_rss());
+
+  pthread_mutex_lock(&mem_mutex);
+  struct mem_lines old = mem_last;
+  mem_last = ml;
+  pthread_mutex_unlock(&mem_mutex);
+  mem_lines_free(&old);
+}
+
+
+//! give out memory usage of last report (see mem_log())
+//! \param func function to call for each owner and objects kind
+//! \param arg function argument
+void mem_last_report(mem_report_f func, void *arg) {
+  pthread_mutex_lock(&mem_mutex);
+  int i;
+  for (i = 0; i < mem_last.num; i ++)
+    func(mem_last.lines[i].owner, mem_last.lines[i].kind, &mem_last.lines[i].usage, arg);
+  pthread_mutex_unlock(&mem_mutex);
+}
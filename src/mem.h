@@ -0,0 +1,41 @@
+/** \file */
+
+
+#ifndef __ACLH_MEM_H__
+#define __ACLH_MEM_H__
+
+#include "tree.h"
+
+//! memory used by objects of some kind
+struct mem_usage {
+  size_t bytes;              //!< allocated bytes (allocator chunks estimate)
+  size_t objects;            //!< number of objects
+};
+
+//! memory report callback
+//! \param owner memory owner (checker, cache, etc)
+//! \param kind objects kind
+//! \param usage memory used
+//! \param arg callback argument
+typedef void (*mem_report_f)(char *owner, char *kind, struct mem_usage *usage, void *arg);
+
+extern void mem_add(struct mem_usage *, void *, size_t);
+extern void mem_add_str(struct mem_usage *, char *);
+extern void mem_add_nodes(struct mem_usage *, node_t *, size_t);
+extern size_t mem_tree_keys(node_t *);
+extern void mem_report(mem_report_f, void *);
+extern void mem_log(void);
+extern void mem_last_report(mem_report_f, void *);
+extern size_t mem_rss(void);
+
+// owners reports (implemented by owning modules)
+extern void checkers_mem(mem_report_f, void *);
+extern void options_mem(mem_report_f, void *);
+extern void resolve_mem(mem_report_f, void *);
+extern void geoip2_mem(mem_report_f, void *);
+extern void ssl_mem(mem_report_f, void *);
+extern void revoked_mem(mem_report_f, void *);
+extern void sslcache_mem(mem_report_f, void *);
+
+#endif //__ACLH_MEM_H__
+
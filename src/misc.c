@@ -163,3 +163,54 @@ int str2int(char *str, int min, int max) {
 }
 
 
+
+
+//! parallel jobs state
+struct jobs {
+  void (*func)(void *);      //!< job function
+  void **args;               //!< jobs args
+  int n;                     //!< number of jobs
+  int next;                  //!< next job to take
+};
+
+//! jobs worker: take jobs until they are over
+static void *jobs_worker(void *arg) {
+  struct jobs *jp = arg;
+  int i;
+  while ((i = __atomic_fetch_add(&jp->next, 1, __ATOMIC_RELAXED)) < jp->n)
+    jp->func(jp->args[i]);
+  return NULL;
+}
+
+
+//! run jobs on a bounded number of threads and wait for them all
+//! (the caller takes jobs too, so they are done even if no thread starts)
+//! \param func job function
+//! \param args jobs args array
+//! \param n number of jobs
+//! \param threads max number of threads (<1 - number of cpus)
+void run_jobs(void (*func)(void *), void **args, int n, int threads) {
+
+  struct jobs jobs = {func, args, n, 0};
+
+  if (threads < 1)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > n)
+    threads = n;
+
+  pthread_t *ids = calloc(threads + 1, sizeof(pthread_t));
+  assert(ids);
+
+  int i, started = 0;
+  for (i = 1; i < threads; i ++) {
+    if (! pthread_create(&ids[started], NULL, jobs_worker, &jobs))
+      started ++;
+  }
+
+  jobs_worker(&jobs);
+
+  for (i = 0; i < started; i ++)
+    pthread_join(ids[i], NULL);
+
+  free(ids);
+}
@@ -8,6 +8,7 @@ extern int parse_string(char *, char **, char *, int);
 extern char *strip_blanks(char *);
 extern int str_reject(char *, char *, int);
 extern int str2int(char *, int, int);
+extern void run_jobs(void (*)(void *), void **, int, int);
 
 
 #endif //__ACLH_MISC_H__
@@ -3,21 +3,67 @@
 
 #include "acl-helper.h"
 #include "log.h"
+#include "conf.h"
 #include "tree.h"
 #include "misc.h"
 #include "source.h"
 
+#include "mem.h"
 #include "options.h"
 
 //! private runtime options list
 static struct opt_scope *opt_scopes;
 
+//! configured runtime options list (to be loaded by options_init())
+static struct opt_scope *opt_scopes_conf;
+
+//! previous runtime options list (put back if reload fails), freed
+//! on next init
+static struct opt_scope *opt_scopes_retired;
+
+//! options were put in use at least once
+static int opt_inited;
+
+//! mutex for options list replacement (vs memory report)
+static pthread_mutex_t opt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//! free option
+static void options_free_option(void *key) {
+  struct option *op = key;
+  free(op->line);
+  free(op);
+}
+
+
+//! free options scopes list
+//! \param os list head
+static void options_free(struct opt_scope *os) {
+  while (os) {
+    struct opt_scope *next = os->next;
+    tree_free(os->options, options_free_option);
+    free(os->name);
+    free(os->source);
+    free(os->source_filter);
+    free(os);
+    os = next;
+  }
+}
+
+
+//! drop configured options (config reload failed)
+void options_config_free(void) {
+  options_free(opt_scopes_conf);
+  opt_scopes_conf = NULL;
+}
+
 
 //! find options scope by name
+//! \param list options scopes list
 //! \param scope_name options scope name
 //! \return pointer to found options scope or NULL
-static struct opt_scope *options_scope_find(char *scope_name) {
-  struct opt_scope *os = opt_scopes;
+static struct opt_scope *options_scope_find(struct opt_scope *list, char *scope_name) {
+  struct opt_scope *os = list;
   while (os) {
     if (! strcmp(os->name, scope_name))
       break;
@@ -49,7 +95,7 @@ int option_config(char *str) {
   }
 
   // no duplicate options allowed
-  if (options_scope_find(array[0])) {
+  if (options_scope_find(opt_scopes_conf, array[0])) {
     wlog(L_ERR, "options '%s' already defined", array[0]);
     return 1;
   }
@@ -59,10 +105,10 @@ int option_config(char *str) {
   assert(new_os);
 
   // add new options to the list
-  struct opt_scope *os = opt_scopes;
+  struct opt_scope *os = opt_scopes_conf;
   if (! os) {
-    opt_scopes = new_os;
-    os = opt_scopes;
+    opt_scopes_conf = new_os;
+    os = opt_scopes_conf;
   } else {
     // go to last scope in list
     while (os->next)
@@ -148,6 +194,7 @@ static int options_store_options(struct opt_scope *os, char *data) {
         // create new option
         struct option *op = calloc(1, sizeof(struct option));
         assert(op);
+        op->line = opline;
         op->name = param;
         op->value = value;
         tree_search(op, &os->options, op_cmp_s);
@@ -169,34 +216,80 @@ static int options_store_options(struct opt_scope *os, char *data) {
 }
 
 
-//! read runtime options from various sources
-//! \return 0 if ok, !0 otherwise
-int options_init(void) {
+//! load options scope from its source
+//! \param arg options scope
+static void options_load(void *arg) {
 
-  struct opt_scope *os = opt_scopes;
+  struct opt_scope *os = arg;
 
-  // load options for all configured
-  while (os) {
+  // load from defined source
+  char *data = source_data(os->source, os->source_filter);
+  if (! data) {
+    wlog(L_WARN, "source '%s' failed for options '%s', skipped", os->source, os->name);
+    os->failed = 1;
+  } else {
+    // parse loaded options and store them in a tree
+    options_store_options(os, data);
+    free(data);
+  }
+}
 
-    // load from defined source
-    char *data = source_data(os->source, os->source_filter);
-    if (! data) {
-      wlog(L_WARN, "source '%s' failed for options '%s', skipped", os->source, os->name);
-    } else {
-      // parse loaded options and store them in a tree
-      options_store_options(os, data);
-      free(data);
-    }
- 
-    // load next options scope
-    os = os->next;
+
+//! read configured runtime options from various sources and put them in use
+//! (options are used by checkers init only, so previous ones are kept
+//! until next init just to be put back by options_restore()); scopes
+//! which failed to load are skipped on first init, on reload they keep
+//! options in use
+//! \return 0 if ok, !0 if some scope failed and options in use are kept
+int options_init(void) {
+
+  struct opt_scope *os;
+  int n = 0;
+  for (os = opt_scopes_conf; os; os = os->next)
+    n ++;
+
+  // load options for all configured scopes at once
+  void **args = calloc(n + 1, sizeof(void *));
+  assert(args);
+  n = 0;
+  for (os = opt_scopes_conf; os; os = os->next)
+    args[n ++] = os;
+  run_jobs(options_load, args, n, config.init_threads);
+  free(args);
+
+  int failed = 0;
+  for (os = opt_scopes_conf; os; os = os->next)
+    failed += os->failed;
+
+  if (failed && opt_inited) {
+    options_config_free();
+    return failed;
   }
 
+  pthread_mutex_lock(&opt_mutex);
+  options_free(opt_scopes_retired);
+  opt_scopes_retired = opt_scopes;
+  opt_scopes = opt_scopes_conf;
+  opt_scopes_conf = NULL;
+  opt_inited = 1;
+  pthread_mutex_unlock(&opt_mutex);
+
   // all done
   return 0;
 }
 
 
+//! put previous runtime options back in use (reload failed)
+void options_restore(void) {
+  pthread_mutex_lock(&opt_mutex);
+  struct opt_scope *os = opt_scopes;
+  opt_scopes = opt_scopes_retired;
+  opt_scopes_retired = NULL;
+  pthread_mutex_unlock(&opt_mutex);
+  options_free(os);
+}
+
+
 //! find option value by name
 //! \param scope options scope
 //! \param opname option name
@@ -211,7 +304,7 @@ char *option_value(char *scope, char *opname) {
 
   // a scope defined, search for the option within it
   if (scope && *scope) {
-    os = options_scope_find(scope);
+    os = options_scope_find(opt_scopes, scope);
     if (os)
       found = tree_find((void*)&opt, &os->options, op_cmp_s);
   } else {
@@ -352,4 +445,32 @@ char *options_subst(char *in_str) {
 }
 
 
+//! add option to memory usage
+static void options_mem_entry(void *key, void *arg) {
+  struct option *op = key;
+  struct mem_usage *mu = arg;
+  mem_add(mu, op, sizeof(struct option));
+  // name and value are parts of one source line (not separate chunks)
+  mu->bytes += strlen(op->name) + strlen(op->value) + 2;
+}
+
+//! report runtime options memory usage
+//! \param func report function
+//! \param arg report function argument
+void options_mem(mem_report_f func, void *arg) {
+
+  struct mem_usage entries = {0,}, nodes = {0,};
+  struct opt_scope *os;
+
+  pthread_mutex_lock(&opt_mutex);
+  for (os = opt_scopes; os; os = os->next) {
+    mem_add(&entries, os, sizeof(struct opt_scope));
+    tree_walk(os->options, options_mem_entry, &entries);
+    mem_add_nodes(&nodes, os->options, mem_tree_keys(os->options));
+  }
+  pthread_mutex_unlock(&opt_mutex);
+
+  func("options", "entries", &entries, arg);
+  func("options", "nodes", &nodes, arg);
+}
 
@@ -11,12 +11,14 @@ struct opt_scope {
   char *source;              //!< scope source
   char *source_filter;       //!< scope source filter
   node_t *options;           //!< scope options data (key=value pairs tree)
+  int failed;                //!< scope source failed
   struct opt_scope *next;    //!< next scope in list
 };
 
 
 //! runtime options names and values
 struct option {
+  char *line;               //!< option line (name and value point into it)
   char *name;               //!< option name
   char *value;              //!< option value
 };
@@ -26,6 +28,8 @@ struct option {
 
 extern int option_config(char *);
 extern int options_init(void);
+extern void options_restore(void);
+extern void options_config_free(void);
 extern char *options_subst(char *);
 
 #endif //__ACLH_OPTIONS_H__
@@ -0,0 +1,265 @@
+/** \file */
+
+
+#include "acl-helper.h"
+#include "log.h"
+#include "conf.h"
+
+#include "query.h"
+
+
+#ifdef USE_SQLITE3
+
+// on-demand db queries: a prepared query is run per request with request
+// token bound as its only parameter; read-only connections (each with its
+// own prepared statement) are pooled, so a request takes an idle one or
+// opens a new one if all are busy; results (including 'no rows' ones) are
+// cached in fixed number of slots for 'query_ttl' seconds, a key evicts
+// whatever was cached in its slot before
+
+
+//! FNV-1a hash of a string
+static uint32_t query_hash(char *str) {
+  uint32_t hash = 2166136261u;
+  while (*str) {
+    hash ^= (uint8_t)*str ++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+//! open db connection and prepare the query
+//! \param q query pointer
+//! \return connection or NULL on error
+static struct query_conn *query_conn_open(struct query *q) {
+
+  struct query_conn *conn = calloc(1, sizeof(struct query_conn));
+  assert(conn);
+
+  // read-only, used by one request at a time
+  if (sqlite3_open_v2(q->db, &conn->dbh, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+    wlog(L_ERR, "failed to open db '%s': %s", q->db, sqlite3_errmsg(conn->dbh));
+    sqlite3_close(conn->dbh);
+    free(conn);
+    return NULL;
+  }
+
+  // db may be updated by others meanwhile
+  sqlite3_busy_timeout(conn->dbh, 1000);
+
+  if (sqlite3_prepare_v2(conn->dbh, q->sql, -1, &conn->sth, NULL) != SQLITE_OK) {
+    wlog(L_ERR, "failed to prepare sql query '%s': %s", q->sql, sqlite3_errmsg(conn->dbh));
+    sqlite3_close(conn->dbh);
+    free(conn);
+    return NULL;
+  }
+
+  if (sqlite3_bind_parameter_count(conn->sth) != 1) {
+    wlog(L_ERR, "sql query '%s' must have exactly one parameter", q->sql);
+    sqlite3_finalize(conn->sth);
+    sqlite3_close(conn->dbh);
+    free(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+
+//! close db connection
+//! \param conn connection
+static void query_conn_close(struct query_conn *conn) {
+  sqlite3_finalize(conn->sth);
+  sqlite3_close(conn->dbh);
+  free(conn);
+}
+
+
+//! create on-demand query: check that the db opens and the query
+//! prepares (this connection is the first pooled one)
+//! \param db db connection string
+//! \param sql query with one parameter
+//! \return query pointer or NULL on error
+struct query *query_open(char *db, char *sql) {
+
+  if (! db || ! sql)
+    return NULL;
+
+  struct query *q = calloc(1, sizeof(struct query));
+  assert(q);
+  q->db = strdup(db);
+  assert(q->db);
+  q->sql = strdup(sql);
+  assert(q->sql);
+  pthread_mutex_init(&q->mutex, NULL);
+
+  q->idle = query_conn_open(q);
+  if (! q->idle) {
+    query_close(q);
+    return NULL;
+  }
+  q->n_idle = 1;
+
+  // results cache
+  if (config.query_cache_slots && config.query_ttl) {
+    q->slots = calloc(config.query_cache_slots, sizeof(struct query_slot));
+    assert(q->slots);
+    q->slots_mask = config.query_cache_slots - 1;
+  }
+
+  return q;
+}
+
+
+//! free query: all its connections must be idle
+//! \param q query pointer
+void query_close(struct query *q) {
+
+  if (! q)
+    return;
+
+  while (q->idle) {
+    struct query_conn *next = q->idle->next;
+    query_conn_close(q->idle);
+    q->idle = next;
+  }
+
+  uint32_t i;
+  for (i = 0; q->slots && i <= q->slots_mask; i ++) {
+    free(q->slots[i].key);
+    free(q->slots[i].result);
+  }
+  free(q->slots);
+
+  pthread_mutex_destroy(&q->mutex);
+  free(q->db);
+  free(q->sql);
+  free(q);
+}
+
+
+//! copy query result into caller buffer
+static void query_copy(char *result, size_t size, const char *data) {
+  snprintf(result, size, "%s", data ? data : "");
+}
+
+
+//! run query for a key (cached result is taken if any)
+//! \param q query pointer
+//! \param key key to bind
+//! \param result buffer for first column of first returned row
+//! \param size result buffer size
+//! \return 1 if query returned rows, 0 if none, -1 on error
+int query_lookup(struct query *q, char *key, char *result, size_t size) {
+
+  time_t now = time(NULL);
+  struct query_slot *slot = q->slots ? &q->slots[query_hash(key) & q->slots_mask] : NULL;
+  int found;
+
+  // cached?
+  if (slot) {
+    pthread_mutex_lock(&q->mutex);
+    if (slot->key && slot->expire > now && ! strcmp(slot->key, key)) {
+      found = slot->result != NULL;
+      if (found)
+        query_copy(result, size, slot->result);
+      pthread_mutex_unlock(&q->mutex);
+      return found;
+    }
+    pthread_mutex_unlock(&q->mutex);
+  }
+
+  // take idle connection or open a new one
+  pthread_mutex_lock(&q->mutex);
+  struct query_conn *conn = q->idle;
+  if (conn) {
+    q->idle = conn->next;
+    q->n_idle --;
+  }
+  pthread_mutex_unlock(&q->mutex);
+
+  if (! conn)
+    conn = query_conn_open(q);
+  if (! conn)
+    return -1;
+
+  // the key is ours until reset
+  sqlite3_bind_text(conn->sth, 1, key, -1, SQLITE_STATIC);
+
+  int rc = sqlite3_step(conn->sth);
+  if (rc == SQLITE_ROW) {
+    query_copy(result, size, (const char *)sqlite3_column_text(conn->sth, 0));
+    found = 1;
+  } else if (rc == SQLITE_DONE)
+    found = 0;
+  else {
+    wlog(L_ERR, "failed to fetch sql query '%s' results: %s", q->sql, sqlite3_errmsg(conn->dbh));
+    found = -1;
+  }
+
+  sqlite3_reset(conn->sth);
+  sqlite3_clear_bindings(conn->sth);
+
+  // put connection back to the pool (there is no point to keep
+  // more of them than requests run at once, non-concurrent helper
+  // runs one)
+  int max_idle = config.concurrency > 1 ? config.concurrency : 1;
+  pthread_mutex_lock(&q->mutex);
+  if (found >= 0 && q->n_idle < max_idle) {
+    conn->next = q->idle;
+    q->idle = conn;
+    q->n_idle ++;
+    conn = NULL;
+  }
+  pthread_mutex_unlock(&q->mutex);
+
+  if (conn)
+    query_conn_close(conn);
+
+  // errors are not cached
+  if (! slot || found < 0)
+    return found;
+
+  char *new_key = strdup(key);
+  assert(new_key);
+  char *new_result = NULL;
+  if (found) {
+    new_result = strdup(result);
+    assert(new_result);
+  }
+
+  pthread_mutex_lock(&q->mutex);
+  char *old_key = slot->key, *old_result = slot->result;
+  slot->key = new_key;
+  slot->result = new_result;
+  slot->expire = now + config.query_ttl;
+  pthread_mutex_unlock(&q->mutex);
+
+  free(old_key);
+  free(old_result);
+
+  return found;
+}
+
+
+//! add query memory usage (results cache)
+//! \param q query pointer
+//! \param mu memory usage to update
+void query_mem(struct query *q, struct mem_usage *mu) {
+
+  if (! q->slots)
+    return;
+
+  pthread_mutex_lock(&q->mutex);
+  mem_add(mu, q->slots, (q->slots_mask + 1) * sizeof(struct query_slot));
+  uint32_t i;
+  for (i = 0; i <= q->slots_mask; i ++) {
+    mem_add_str(mu, q->slots[i].key);
+    mem_add_str(mu, q->slots[i].result);
+  }
+  pthread_mutex_unlock(&q->mutex);
+}
+
+#endif //USE_SQLITE3
+
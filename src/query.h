@@ -0,0 +1,54 @@
+/** \file */
+
+
+#ifndef __ACLH_QUERY_H__
+#define __ACLH_QUERY_H__
+
+//! default query results cache ttl, secs
+#define DEFAULT_QUERY_TTL          60
+
+//! default number of query results cache slots
+#define DEFAULT_QUERY_CACHE_SLOTS  4096
+
+#ifdef USE_SQLITE3
+
+#include <sqlite3.h>
+
+#include "mem.h"
+
+//! max query result length to return (longer ones are truncated)
+#define QUERY_MAX_RESULT    1024
+
+//! cached query result
+struct query_slot {
+  char *key;                 //!< bound key (NULL if slot is empty)
+  char *result;              //!< first column of first row (NULL if there were no rows)
+  time_t expire;             //!< slot expiration time
+};
+
+//! pooled db connection with prepared query
+struct query_conn {
+  sqlite3 *dbh;              //!< read-only db handler
+  sqlite3_stmt *sth;         //!< prepared query
+  struct query_conn *next;   //!< next idle connection
+};
+
+//! on-demand db query
+struct query {
+  char *db;                  //!< db connection string
+  char *sql;                 //!< query with one parameter
+  pthread_mutex_t mutex;     //!< guards connections pool and results cache
+  struct query_conn *idle;   //!< idle connections
+  int n_idle;                //!< number of idle connections
+  struct query_slot *slots;  //!< results cache (NULL if disabled)
+  uint32_t slots_mask;       //!< cache slot index mask
+};
+
+extern struct query *query_open(char *, char *);
+extern int query_lookup(struct query *, char *, char *, size_t);
+extern void query_close(struct query *);
+extern void query_mem(struct query *, struct mem_usage *);
+
+#endif //USE_SQLITE3
+
+#endif //__ACLH_QUERY_H__
@@ -10,6 +10,7 @@
   #include <netdb.h>
 #endif
 
+#include "mem.h"
 #include "resolve.h"
 
 //! cached host ips entry
@@ -36,25 +37,19 @@ static int hostname_cmp(const void *h1, const void *h2) {
 //! \return found cached entry or NULL
 static struct ip_entry *ip_cache_find(char *host) {
 
-  // inits and preparations
-  struct ip_entry *ip_to_find, *ip_found;
-  ip_to_find = calloc(1, sizeof(struct ip_entry));
-  assert(ip_to_find);
-  ip_to_find->hostname = strdup(host);
-  assert(ip_to_find->hostname);
-
   // lock the cache
   pthread_mutex_lock(&mutex);
 
-  // search the cache for non-expired host entry
-  // OR
-  // add new one
-  ip_found = tree_search(ip_to_find, &ip_cache, hostname_cmp);
+  // search the cache for host entry (no allocations for known hosts)
+  struct ip_entry key = {host,}, *ip_found = tree_find(&key, &ip_cache, hostname_cmp);
 
-  // already existing entry?
-  if (errno != ENOENT) {
-    free(ip_to_find->hostname);
-    free(ip_to_find);
+  // not found: add new one
+  if (! ip_found) {
+    struct ip_entry *ip_to_add = calloc(1, sizeof(struct ip_entry));
+    assert(ip_to_add);
+    ip_to_add->hostname = strdup(host);
+    assert(ip_to_add->hostname);
+    ip_found = tree_search(ip_to_add, &ip_cache, hostname_cmp);
   }
 
   // unlock the cache
@@ -66,18 +61,18 @@ static struct ip_entry *ip_cache_find(char *host) {
 }
 
 
-//! resolve hostname
+//! resolve hostname using ip cache
 //! \param host hostname to resolve
 //! \param aip address of array to place resolved ips
 //! \param max_ips max number of ips to return
 //! \return num of resolved ips or -1 on error
-int resolve_host(char *host, in_addr_t *aip, int max_ips) {
+static int resolve_cached(char *host, in_addr_t *aip, int max_ips) {
 
   // search the cache first (or add new entry)
   struct ip_entry *ip = ip_cache_find(host);
 
   // check found entry expiration date (if not new)
-  if (ip && ip->expire > time(NULL)) {
+  if (ip && __atomic_load_n(&ip->expire, __ATOMIC_ACQUIRE) > time(NULL)) {
     wlog(L_DEBUG8, "using cached ip data for '%s'", host);
     max_ips = max_ips > 0 && max_ips < MAX_RESOLVED_IPS ? max_ips : MAX_RESOLVED_IPS;
     int i = 0;
@@ -102,7 +97,7 @@ int resolve_host(char *host, in_addr_t *aip, int max_ips) {
   int err = getaddrinfo(host, NULL, &hints, &res);
   if (err) {
     wlog(L_DEBUG5, "failed to resolve '%s': %s", host, gai_strerror(err));
-    ip->expire = time(NULL) + config.resolve_neg_ttl; // cache negative answers too
+    __atomic_store_n(&ip->expire, time(NULL) + config.resolve_neg_ttl, __ATOMIC_RELEASE); // cache negative answers too
     return -1;
   }
 
@@ -124,10 +119,11 @@ int resolve_host(char *host, in_addr_t *aip, int max_ips) {
 
   // fill/update ip cache entry
   wlog(L_DEBUG8, "caching resolved ip(s) for '%s'", host);
-  ip->expire = time(NULL) + config.resolve_ttl;
   // we may have no IPv4 addressed resolved, so nothing to return :(
   if (i)
     memcpy(ip->ips, aip, sizeof(in_addr_t) * i);
+  // entry is checked without cache lock (by prefetch too)
+  __atomic_store_n(&ip->expire, time(NULL) + config.resolve_ttl, __ATOMIC_RELEASE);
 
   // done
   return i;
@@ -135,6 +131,244 @@ int resolve_host(char *host, in_addr_t *aip, int max_ips) {
 
 
 
+// per-request resolve context: every distinct token of a request is
+// resolved once and shared by all checkers (resolve, ssl, geoip2...)
+// which need its ips; the context is attached to request thread when
+// the first host is resolved and may be shared with prefetch workers,
+// which resolve uncached tokens in advance while cheap checkers are
+// running; workers are started on first use and take hosts from a
+// bounded queue (hosts which don't fit are just not prefetched)
+
+//! current thread is running a request
+static __thread int resolve_ctx_on;
+
+//! current thread request context (NULL if none yet)
+static __thread struct resolve_ctx *resolve_ctx;
+
+//! prefetch job: host to resolve into request context
+struct resolve_job {
+  struct resolve_ctx *ctx;             //!< request context to fill
+  char *host;                          //!< host to resolve
+};
+
+//! prefetch queue
+static struct {
+  pthread_mutex_t mutex;               //!< queue lock
+  pthread_cond_t cond;                 //!< signalled when a job is queued
+  int workers;                         //!< number of started workers
+  int idle;                            //!< number of waiting workers
+  int head;                            //!< first queued job
+  int num;                             //!< number of queued jobs
+  struct resolve_job jobs[RESOLVE_PREFETCH_QUEUE]; //!< queued jobs
+} prefetch = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,};
+
+
+//! free request context if nobody uses it anymore
+//! \param ctx request context
+static void resolve_ctx_put(struct resolve_ctx *ctx) {
+
+  pthread_mutex_lock(&ctx->mutex);
+  int refs = -- ctx->refs;
+  pthread_mutex_unlock(&ctx->mutex);
+
+  if (refs)
+    return;
+
+  int i;
+  for (i = 0; i < ctx->num; i ++)
+    free(ctx->e[i].host);
+  pthread_mutex_destroy(&ctx->mutex);
+  pthread_cond_destroy(&ctx->cond);
+  free(ctx);
+}
+
+
+//! get current thread request context (created on first use)
+//! \return request context or NULL if the thread runs no request
+static struct resolve_ctx *resolve_ctx_get(void) {
+
+  if (! resolve_ctx && resolve_ctx_on) {
+    struct resolve_ctx *ctx = calloc(1, sizeof(struct resolve_ctx));
+    assert(ctx);
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    ctx->refs = 1;
+    resolve_ctx = ctx;
+  }
+
+  return resolve_ctx;
+}
+
+
+//! start request on current thread (its context is created when needed)
+void resolve_ctx_begin(void) {
+  resolve_ctx_on = 1;
+}
+
+
+//! end request on current thread and detach its context
+void resolve_ctx_end(void) {
+  if (resolve_ctx) {
+    resolve_ctx_put(resolve_ctx);
+    resolve_ctx = NULL;
+  }
+  resolve_ctx_on = 0;
+}
+
+
+//! check if host has unexpired resolve cache entry
+//! \param host hostname
+//! \return !0 if cached
+static int resolve_is_cached(char *host) {
+  pthread_mutex_lock(&mutex);
+  struct ip_entry key = {host,}, *ip = tree_find(&key, &ip_cache, hostname_cmp);
+  int cached = ip && __atomic_load_n(&ip->expire, __ATOMIC_ACQUIRE) > time(NULL);
+  pthread_mutex_unlock(&mutex);
+  return cached;
+}
+
+
+//! prefetch worker: resolve queued hosts into their request contexts
+static void *resolve_prefetch_run(void *arg) {
+
+  in_addr_t ips[MAX_RESOLVED_IPS + 1];
+
+  while (1) {
+    pthread_mutex_lock(&prefetch.mutex);
+    prefetch.idle ++;
+    while (! prefetch.num)
+      pthread_cond_wait(&prefetch.cond, &prefetch.mutex);
+    prefetch.idle --;
+    struct resolve_job job = prefetch.jobs[prefetch.head];
+    prefetch.head = (prefetch.head + 1) % RESOLVE_PREFETCH_QUEUE;
+    prefetch.num --;
+    pthread_mutex_unlock(&prefetch.mutex);
+
+    // the request may have resolved it meanwhile, then it is just taken
+    resolve_ctx = job.ctx;
+    resolve_host(job.host, ips, MAX_RESOLVED_IPS);
+    resolve_ctx = NULL;
+
+    resolve_ctx_put(job.ctx);
+    free(job.host);
+  }
+
+  return NULL;
+}
+
+
+//! start resolving uncached hosts in background for current request
+//! \param hosts hosts to resolve
+//! \param num number of hosts
+void resolve_ctx_prefetch(char **hosts, int num) {
+
+  if (! resolve_ctx_on)
+    return;
+
+  int i;
+  for (i = 0; i < num && i < RESOLVE_CTX_SIZE; i ++) {
+
+    // cached ones are cheap to get when checkers need them
+    if (resolve_is_cached(hosts[i]))
+      continue;
+
+    struct resolve_ctx *ctx = resolve_ctx_get();
+    char *host = strdup(hosts[i]);
+    assert(host);
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->refs ++;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    pthread_mutex_lock(&prefetch.mutex);
+
+    // all workers are busy: start one more if allowed
+    if (prefetch.idle <= prefetch.num && prefetch.workers < RESOLVE_PREFETCH_WORKERS) {
+      pthread_t thread_id;
+      pthread_attr_t thread_attr;
+      pthread_attr_init(&thread_attr);
+      pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+      if (pthread_create(&thread_id, &thread_attr, resolve_prefetch_run, NULL))
+        wlog(L_ERR, "failed to start resolve prefetch thread");
+      else
+        prefetch.workers ++;
+      pthread_attr_destroy(&thread_attr);
+    }
+
+    int queued = prefetch.workers && prefetch.num < RESOLVE_PREFETCH_QUEUE;
+    if (queued) {
+      struct resolve_job *job = &prefetch.jobs[(prefetch.head + prefetch.num) % RESOLVE_PREFETCH_QUEUE];
+      job->ctx = ctx;
+      job->host = host;
+      prefetch.num ++;
+      pthread_cond_signal(&prefetch.cond);
+    }
+    pthread_mutex_unlock(&prefetch.mutex);
+
+    if (! queued) {
+      free(host);
+      resolve_ctx_put(ctx);
+    }
+  }
+}
+
+
+//! resolve hostname: once per request if request context is set
+//! \param host hostname to resolve
+//! \param aip address of array to place resolved ips
+//! \param max_ips max number of ips to return
+//! \return num of resolved ips or -1 on error
+int resolve_host(char *host, in_addr_t *aip, int max_ips) {
+
+  struct resolve_ctx *ctx = resolve_ctx_get();
+  if (! ctx)
+    return resolve_cached(host, aip, max_ips);
+
+  max_ips = max_ips > 0 && max_ips < MAX_RESOLVED_IPS ? max_ips : MAX_RESOLVED_IPS;
+
+  // find the host in request context: it may be resolved already,
+  // being resolved by another thread or yet unknown
+  pthread_mutex_lock(&ctx->mutex);
+  struct resolve_ctx_entry *e = NULL;
+  int i;
+  for (i = 0; i < ctx->num; i ++) {
+    if (! strcasecmp(ctx->e[i].host, host)) {
+      e = &ctx->e[i];
+      break;
+    }
+  }
+
+  // unknown one: claim it (or go without context if it is full)
+  if (! e) {
+    if (ctx->num == RESOLVE_CTX_SIZE) {
+      pthread_mutex_unlock(&ctx->mutex);
+      return resolve_cached(host, aip, max_ips);
+    }
+    e = &ctx->e[ctx->num ++];
+    e->host = strdup(host);
+    assert(e->host);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    e->n_ips = resolve_cached(host, e->ips, MAX_RESOLVED_IPS);
+
+    pthread_mutex_lock(&ctx->mutex);
+    e->done = 1;
+    pthread_cond_broadcast(&ctx->cond);
+  }
+
+  while (! e->done)
+    pthread_cond_wait(&ctx->cond, &ctx->mutex);
+  pthread_mutex_unlock(&ctx->mutex);
+
+  int n_ips = e->n_ips < max_ips ? e->n_ips : max_ips;
+  if (n_ips > 0)
+    memcpy(aip, e->ips, sizeof(in_addr_t) * n_ips);
+
+  return n_ips;
+}
+
+
+
 //! Convert IP[/NETLEN|MASK] string into ip and net
 //! in host byte order. The func expects network part in
 //! full format only, i.e. 1.2.3.4/24, 1.2.3.4/255.255.224.0
@@ -195,7 +429,36 @@ int str2ipaddr(char *ipstr, in_addr_t *ipa, in_addr_t *neta) {
       *neta = 0;
   }
 
+  // networks masks must be contiguous
+  if (~*neta & (~*neta + 1))
+    *neta = 0;
+
   // all OK or invalid network
   return ! *neta;
 }
 
+
+//! add ip cache entry to memory usage
+static void resolve_mem_entry(void *key, void *arg) {
+  struct ip_entry *ip = key;
+  struct mem_usage *mu = arg;
+  mem_add(mu, ip, sizeof(struct ip_entry));
+  mem_add_str(mu, ip->hostname);
+}
+
+//! report ip cache memory usage
+//! \param func report function
+//! \param arg report function argument
+void resolve_mem(mem_report_f func, void *arg) {
+
+  struct mem_usage entries = {0,}, nodes = {0,};
+
+  pthread_mutex_lock(&mutex);
+  tree_walk(ip_cache, resolve_mem_entry, &entries);
+  mem_add_nodes(&nodes, ip_cache, mem_tree_keys(ip_cache));
+  pthread_mutex_unlock(&mutex);
+
+  func("resolve_cache", "entries", &entries, arg);
+  func("resolve_cache", "nodes", &nodes, arg);
+}
+
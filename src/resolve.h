@@ -8,7 +8,36 @@
 //! max resolved ips for one host to cache
 #define MAX_RESOLVED_IPS 16
 
+//! max distinct hosts resolved per request context
+#define RESOLVE_CTX_SIZE 8
+
+//! max resolve prefetch worker threads
+#define RESOLVE_PREFETCH_WORKERS 8
+
+//! max hosts waiting for prefetch workers
+#define RESOLVE_PREFETCH_QUEUE 256
+
+//! request context entry: resolved host
+struct resolve_ctx_entry {
+  char *host;                          //!< hostname
+  int done;                            //!< resolving is finished
+  int n_ips;                           //!< num of resolved ips or -1 on error
+  in_addr_t ips[MAX_RESOLVED_IPS + 1]; //!< resolved ips
+};
+
+//! per-request resolve context
+struct resolve_ctx {
+  pthread_mutex_t mutex;               //!< context lock
+  pthread_cond_t cond;                 //!< signalled when a host is resolved
+  int refs;                            //!< request and prefetch threads using it
+  int num;                             //!< number of entries used
+  struct resolve_ctx_entry e[RESOLVE_CTX_SIZE]; //!< resolved hosts
+};
+
 extern int resolve_host(char *, in_addr_t *, int);
+extern void resolve_ctx_begin(void);
+extern void resolve_ctx_end(void);
+extern void resolve_ctx_prefetch(char **, int);
 extern int str2ipaddr(char *, in_addr_t *, in_addr_t *);
 
 #endif //__ACLH_RESOLVE_H__
@@ -0,0 +1,249 @@
+/** \file */
+
+
+#include "acl-helper.h"
+#include "log.h"
+#include "conf.h"
+#include "misc.h"
+#include "source.h"
+
+#include "mem.h"
+#include "revoked.h"
+
+
+// local revoked certs set: 'issuer_hash:serial' lines from a source
+// (e.g. 'crl' one) are compiled into a table of 64 bit fingerprints,
+// so a lookup is a couple of memory reads and a revoked serial costs
+// 8-16 bytes; new set is built aside and published with
+// a single atomic pointer store
+
+//! current set (NULL if none loaded)
+static struct revoked_set *revoked;
+
+//! previous set: it may still be in use by a lookup, freed on next load
+static struct revoked_set *retired;
+
+//! mutex for set loads
+static pthread_mutex_t revoked_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//! calculate 'issuer_hash:serial' pair fingerprint;
+//! serial is hex string, case, leading zeros and ':' separators don't matter
+//! \param issuer cert issuer name hash
+//! \param serial cert serial number (hex)
+//! \return fingerprint (never 0)
+static uint64_t revoked_fp(unsigned long issuer, const char *serial) {
+
+  // FNV-1a over issuer and normalized serial
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  int i;
+  for (i = 0; i < 4; i ++) {
+    hash ^= (issuer >> (i * 8)) & 0xFF;
+    hash *= 0x100000001b3ULL;
+  }
+
+  int leading = 1;
+  for (; *serial; serial ++) {
+    if (! isxdigit(*serial) || (leading && *serial == '0'))
+      continue;
+    leading = 0;
+    hash ^= toupper(*serial);
+    hash *= 0x100000001b3ULL;
+  }
+
+  // mix it up: low bits are used as table index
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+
+  return hash ? hash : 1;
+}
+
+
+//! free revoked set
+static void revoked_free(struct revoked_set *set) {
+  if (set) {
+    free(set->slots);
+    free(set);
+  }
+}
+
+
+//! load revoked certs set from a source and make it current
+//! \param sname source name
+//! \param filter source filter
+//! \return 0 if ok, !0 otherwise
+static int revoked_load(char *sname, char *filter) {
+
+  char *data = source_data(sname, filter);
+  if (! data) {
+    wlog(L_ERR, "revoked: failed to get data from source '%s'", sname);
+    return 1;
+  }
+
+  // size the table by lines number
+  uint32_t lines = 1, size = 16;
+  char *p;
+  for (p = data; (p = strchr(p, '\n')) != NULL; p ++, lines ++);
+  while ((uint64_t)size * REVOKED_MAX_LOAD / 100 < lines)
+    size <<= 1;
+
+  struct revoked_set *set = calloc(1, sizeof(struct revoked_set));
+  assert(set);
+  set->slots = calloc(size, sizeof(uint64_t));
+  assert(set->slots);
+  set->mask = size - 1;
+
+  // parse 'issuer_hash:serial' lines
+  int bad = 0;
+  char *line, *next;
+  for (line = data; line; line = next) {
+
+    next = strchr(line, '\n');
+    if (next)
+      *next ++ = '\0';
+
+    line = strip_blanks(line);
+    if (! *line || *line == '#')
+      continue;
+
+    char *end;
+    errno = 0;
+    unsigned long issuer = strtoul(line, &end, 16);
+    if (errno || end == line || *end != ':' || ! end[1]) {
+      wlog(L_DEBUG5, "revoked: ignoring invalid line '%s'", line);
+      bad ++;
+      continue;
+    }
+
+    // install the fingerprint (duplicates are skipped)
+    uint64_t fp = revoked_fp(issuer, end + 1);
+    uint32_t idx = fp & set->mask;
+    while (set->slots[idx] && set->slots[idx] != fp)
+      idx = (idx + 1) & set->mask;
+    if (! set->slots[idx]) {
+      set->slots[idx] = fp;
+      set->num ++;
+    }
+  }
+
+  free(data);
+
+  if (bad)
+    wlog(L_WARN, "revoked: %d invalid lines in source '%s'", bad, sname);
+
+  // publish new set
+  pthread_mutex_lock(&revoked_mutex);
+  struct revoked_set *old = __atomic_exchange_n(&revoked, set, __ATOMIC_ACQ_REL);
+  revoked_free(retired);
+  retired = old;
+  pthread_mutex_unlock(&revoked_mutex);
+
+  wlog(L_INFO, "revoked: loaded %u revoked certs from source '%s' (%u slots)", set->num, sname, size);
+
+  return 0;
+}
+
+
+//! split 'source[:filter]' config value
+//! \param sname where to store source name (to be freed)
+//! \param filter where to store filter (points into sname, may be NULL)
+static void revoked_source(char **sname, char **filter) {
+  *sname = strdup(config.ssl_revoked);
+  assert(*sname);
+  *filter = strchr(*sname, ':');
+  if (*filter)
+    *(*filter) ++ = '\0';
+}
+
+
+//! revoked set refresh thread
+static void *revoked_refresh(void *arg) {
+
+  char *sname, *filter;
+  revoked_source(&sname, &filter);
+
+  while (1) {
+    sleep(config.ssl_revoked_refresh);
+    // keep current set if the source has failed
+    revoked_load(sname, filter);
+  }
+
+  return NULL;
+}
+
+
+//! load revoked certs set (if configured) and start its refresher
+//! \return 0 if ok, !0 otherwise
+int revoked_init(void) {
+
+  if (! config.ssl_revoked)
+    return 0;
+
+  char *sname, *filter;
+  revoked_source(&sname, &filter);
+  int ret = revoked_load(sname, filter);
+  free(sname);
+  if (ret)
+    return ret;
+
+  if (config.ssl_revoked_refresh > 0) {
+    pthread_t thread_id;
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread_id, &thread_attr, revoked_refresh, NULL))
+      wlog(L_ERR, "revoked: failed to start refresh thread");
+    pthread_attr_destroy(&thread_attr);
+  }
+
+  return 0;
+}
+
+
+//! check if cert is in revoked set
+//! \param issuer cert issuer name hash
+//! \param serial cert serial number (hex)
+//! \return 1 if revoked, 0 otherwise
+int revoked_find(unsigned long issuer, const char *serial) {
+
+  struct revoked_set *set = __atomic_load_n(&revoked, __ATOMIC_ACQUIRE);
+  if (! set)
+    return 0;
+
+  // table is never full, so an empty slot ends the search
+  uint64_t fp = revoked_fp(issuer, serial);
+  uint32_t idx = fp & set->mask;
+  while (set->slots[idx]) {
+    if (set->slots[idx] == fp)
+      return 1;
+    idx = (idx + 1) & set->mask;
+  }
+
+  return 0;
+}
+
+
+//! report revoked certs set memory usage
+//! (the previous set may be kept too until next load)
+//! \param func report function
+//! \param arg report function argument
+void revoked_mem(mem_report_f func, void *arg) {
+
+  struct mem_usage sets = {0,};
+
+  pthread_mutex_lock(&revoked_mutex);
+  struct revoked_set *set[2] = {revoked, retired};
+  int i;
+  for (i = 0; i < 2; i ++) {
+    if (set[i]) {
+      mem_add(&sets, set[i], sizeof(struct revoked_set));
+      mem_add(&sets, set[i]->slots, (set[i]->mask + 1) * sizeof(uint64_t));
+    }
+  }
+  pthread_mutex_unlock(&revoked_mutex);
+
+  if (sets.objects)
+    func("revoked_set", "tables", &sets, arg);
+}
+
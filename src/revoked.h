@@ -0,0 +1,21 @@
+/** \file */
+
+
+#ifndef __ACLH_REVOKED_H__
+#define __ACLH_REVOKED_H__
+
+//! max revoked set load factor (percents)
+#define REVOKED_MAX_LOAD  75
+
+//! compact revoked certs set: open addressing table of 64 bit
+//! fingerprints of 'issuer hash:serial' pairs (0 marks empty slot)
+struct revoked_set {
+  uint64_t *slots;           //!< fingerprints table
+  uint32_t mask;             //!< slot index mask (table size - 1)
+  uint32_t num;              //!< number of fingerprints in the set
+};
+
+extern int revoked_init(void);
+extern int revoked_find(unsigned long, const char *);
+
+#endif //__ACLH_REVOKED_H__
@@ -0,0 +1,485 @@
+/** \file */
+
+
+#include "acl-helper.h"
+#include "log.h"
+#include "conf.h"
+#include "tree.h"
+#include "resolve.h"
+#include "checker.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+
+// precompiled checkers datasets: 'acl-helper --compile' writes loaded
+// records into a snapshot file (strings sorted for binary search, ip
+// networks grouped by mask), helpers map it read-only and search it in
+// place, so all helper processes share one copy of it in page cache
+
+
+//! FNV-1a hash
+//! \param data data to hash
+//! \param len data length
+//! \return hash value
+static uint64_t snapshot_hash(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+  for (i = 0; i < len; i ++) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+
+//! append data to snapshot image
+//! \param w snapshot writer
+//! \param data data to append (NULL to append zeroes)
+//! \param len data length
+//! \return data offset in image
+static uint64_t snapshot_put(struct snap_writer *w, const void *data, size_t len) {
+
+  // everything is 8 bytes aligned
+  size_t off = (w->len + 7) & ~(size_t)7;
+  if (off + len > w->size) {
+    while (off + len > w->size)
+      w->size *= 2;
+    w->buf = realloc(w->buf, w->size);
+    assert(w->buf);
+  }
+
+  memset(w->buf + w->len, 0, off - w->len);
+  if (data)
+    memcpy(w->buf + off, data, len);
+  else
+    memset(w->buf + off, 0, len);
+  w->len = off + len;
+
+  return off;
+}
+
+
+//! append string to snapshot image
+static uint64_t snapshot_put_str(struct snap_writer *w, char *str) {
+  uint64_t off = w->len;
+  size_t len = strlen(str ? str : "") + 1;
+  if (off + len > w->size) {
+    while (off + len > w->size)
+      w->size *= 2;
+    w->buf = realloc(w->buf, w->size);
+    assert(w->buf);
+  }
+  memcpy(w->buf + off, str ? str : "", len);
+  w->len += len;
+  return off;
+}
+
+
+//! start new snapshot
+//! \return snapshot writer
+struct snap_writer *snapshot_create(void) {
+
+  struct snap_writer *w = calloc(1, sizeof(struct snap_writer));
+  assert(w);
+
+  w->size = 1024 * 1024;
+  w->buf = malloc(w->size);
+  assert(w->buf);
+
+  // header is filled on save
+  snapshot_put(w, NULL, sizeof(struct snap_header));
+
+  return w;
+}
+
+
+//! records sort: case sensitive strings
+static int snapshot_cmp_s(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+//! records sort: case insensitive strings
+static int snapshot_cmp_si(const void *a, const void *b) {
+  return strcasecmp(*(char **)a, *(char **)b);
+}
+
+//! ip record being compiled
+struct snap_ip {
+  char *data;                //!< record data
+  uint32_t ipnet;            //!< ip & net
+  uint32_t net;              //!< network mask
+};
+
+//! records sort: ips, longest masks first, then by network
+static int snapshot_cmp_ip(const void *a, const void *b) {
+  const struct snap_ip *x = a, *y = b;
+  if (x->net != y->net)
+    return x->net > y->net ? -1 : 1;
+  if (x->ipnet != y->ipnet)
+    return x->ipnet < y->ipnet ? -1 : 1;
+  return 0;
+}
+
+
+//! add checker records set to snapshot
+//! \param w snapshot writer
+//! \param name checker name
+//! \param driver checker driver name
+//! \param source source name
+//! \param filter source filter
+//! \param params source params
+//! \param stamp source data version (NULL if unknown)
+//! \param type checker match type
+//! \param icase case insensitive checker
+//! \param recs records data (will be reordered)
+//! \param n_recs number of records
+//! \return 0 if ok, !0 otherwise
+int snapshot_add(struct snap_writer *w, char *name, char *driver, char *source, char *filter,
+                 char *params, char *stamp, int type, int icase, char **recs, uint32_t n_recs) {
+
+  struct snap_set set;
+  memset(&set, 0, sizeof(set));
+  set.type = type;
+  set.icase = icase;
+
+  uint32_t i, n = 0;
+  struct snap_rec *sr = calloc(n_recs + 1, sizeof(struct snap_rec));
+  assert(sr);
+
+  switch (type) {
+
+    // sorted for binary search, no duplicates
+    case TYPE_STRING :
+      {
+        int (*cmp)(const void *, const void *) = icase ? snapshot_cmp_si : snapshot_cmp_s;
+        qsort(recs, n_recs, sizeof(char *), cmp);
+        for (i = 0; i < n_recs; i ++) {
+          if (n && ! cmp(&recs[i], &recs[i - 1]))
+            continue;
+          sr[n ++].data_off = snapshot_put_str(w, recs[i]);
+        }
+      }
+      break;
+
+    // grouped by mask, sorted by network inside groups
+    case TYPE_IP :
+      {
+        struct snap_ip *ips = calloc(n_recs + 1, sizeof(struct snap_ip));
+        assert(ips);
+        uint32_t n_ips = 0;
+        for (i = 0; i < n_recs; i ++) {
+          in_addr_t ip, net;
+          if (str2ipaddr(recs[i], &ip, &net)) {
+            wlog(L_WARN, "snapshot: skipping invalid IP [%s]", recs[i]);
+            continue;
+          }
+          ips[n_ips].data = recs[i];
+          ips[n_ips].ipnet = ip & net;
+          ips[n_ips].net = net;
+          n_ips ++;
+        }
+        qsort(ips, n_ips, sizeof(struct snap_ip), snapshot_cmp_ip);
+
+        struct snap_group *groups = calloc(33, sizeof(struct snap_group));
+        assert(groups);
+        for (i = 0; i < n_ips; i ++) {
+          if (n && ! snapshot_cmp_ip(&ips[i], &ips[i - 1]))
+            continue;
+          if (! set.n_groups || groups[set.n_groups - 1].net != ips[i].net) {
+            groups[set.n_groups].net = ips[i].net;
+            groups[set.n_groups].first = n;
+            set.n_groups ++;
+          }
+          groups[set.n_groups - 1].count ++;
+          sr[n].data_off = snapshot_put_str(w, ips[i].data);
+          sr[n].ipnet = ips[i].ipnet;
+          sr[n].net = ips[i].net;
+          n ++;
+        }
+        set.groups_off = snapshot_put(w, groups, set.n_groups * sizeof(struct snap_group));
+        free(groups);
+        free(ips);
+      }
+      break;
+
+    // scanned in order: patterns and lists
+    case TYPE_SHELL :
+    case TYPE_REGEX :
+    case TYPE_PCRE :
+    case TYPE_LIST :
+      for (i = 0; i < n_recs; i ++)
+        sr[n ++].data_off = snapshot_put_str(w, recs[i]);
+      break;
+
+    default:
+      free(sr);
+      return 1;
+  }
+
+  set.n_recs = n;
+  set.recs_off = snapshot_put(w, sr, n * sizeof(struct snap_rec));
+  free(sr);
+
+  set.name_off = snapshot_put_str(w, name);
+  set.driver_off = snapshot_put_str(w, driver);
+  set.source_off = snapshot_put_str(w, source);
+  set.filter_off = snapshot_put_str(w, filter);
+  set.params_off = snapshot_put_str(w, params);
+  set.stamp_off = stamp ? snapshot_put_str(w, stamp) : 0;
+
+  w->sets = realloc(w->sets, (w->n_sets + 1) * sizeof(struct snap_set));
+  assert(w->sets);
+  w->sets[w->n_sets ++] = set;
+
+  return 0;
+}
+
+
+//! write snapshot file (via temporary file) and free the writer
+//! \param w snapshot writer
+//! \param file snapshot file path
+//! \return 0 if ok, !0 otherwise
+int snapshot_save(struct snap_writer *w, char *file) {
+
+  uint64_t sets_off = snapshot_put(w, w->sets, w->n_sets * sizeof(struct snap_set));
+
+  struct snap_header *hdr = (struct snap_header *)w->buf;
+  memcpy(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic));
+  hdr->version = SNAP_VERSION;
+  hdr->n_sets = w->n_sets;
+  hdr->size = w->len;
+  hdr->created = time(NULL);
+  hdr->sets_off = sets_off;
+  hdr->checksum = snapshot_hash(w->buf + sets_off, w->n_sets * sizeof(struct snap_set));
+
+  char *tmp = malloc(strlen(file) + 8);
+  assert(tmp);
+  sprintf(tmp, "%s.tmp", file);
+
+  int err = 0;
+  FILE *fp = fopen(tmp, "w");
+  if (! fp || fwrite(w->buf, w->len, 1, fp) != 1 || fflush(fp) || fsync(fileno(fp))) {
+    wlog(L_ERR, "snapshot: failed to write '%s': %s", tmp, strerror(errno));
+    err = 1;
+  }
+  if (fp && fclose(fp))
+    err = 1;
+  if (! err && rename(tmp, file)) {
+    wlog(L_ERR, "snapshot: failed to rename '%s': %s", tmp, strerror(errno));
+    err = 1;
+  }
+  if (err)
+    unlink(tmp);
+  else
+    wlog(L_INFO, "snapshot: %u sets written into '%s' (%zu bytes)", w->n_sets, file, w->len);
+
+  free(tmp);
+  free(w->sets);
+  free(w->buf);
+  free(w);
+
+  return err;
+}
+
+
+//! check that sets headers point inside the file (their data is not
+//! read here: that would touch every page of the mapping)
+//! \param map mapped file
+//! \param hdr file header
+//! \return 0 if ok, !0 otherwise
+static int snapshot_check_sets(char *map, struct snap_header *hdr) {
+
+  struct snap_set *sets = (struct snap_set *)(map + hdr->sets_off);
+  uint32_t i;
+  for (i = 0; i < hdr->n_sets; i ++) {
+    struct snap_set *set = &sets[i];
+    if (set->name_off >= hdr->sets_off || set->driver_off >= hdr->sets_off ||
+        set->source_off >= hdr->sets_off || set->filter_off >= hdr->sets_off ||
+        set->params_off >= hdr->sets_off || set->stamp_off >= hdr->sets_off ||
+        set->recs_off + (uint64_t)set->n_recs * sizeof(struct snap_rec) > hdr->sets_off ||
+        set->groups_off + (uint64_t)set->n_groups * sizeof(struct snap_group) > hdr->sets_off)
+      return 1;
+  }
+
+  return 0;
+}
+
+
+//! map snapshot file and check it
+//! \param file snapshot file path
+//! \return mapped snapshot or NULL on error
+struct snapshot *snapshot_open(char *file) {
+
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    wlog(L_WARN, "snapshot: failed to open '%s': %s", file, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < sizeof(struct snap_header)) {
+    wlog(L_WARN, "snapshot: '%s' is too short", file);
+    close(fd);
+    return NULL;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    wlog(L_WARN, "snapshot: failed to map '%s': %s", file, strerror(errno));
+    return NULL;
+  }
+
+  struct snap_header *hdr = (struct snap_header *)map;
+  char *err = NULL;
+  if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)))
+    err = "not a snapshot";
+  else if (hdr->version != SNAP_VERSION)
+    err = "unsupported version";
+  else if (hdr->size != st.st_size)
+    err = "truncated";
+  else if (hdr->sets_off + (uint64_t)hdr->n_sets * sizeof(struct snap_set) > hdr->size)
+    err = "corrupted";
+  else if (hdr->checksum != snapshot_hash(map + hdr->sets_off, hdr->n_sets * sizeof(struct snap_set)))
+    err = "checksum mismatch";
+  else if (snapshot_check_sets(map, hdr))
+    err = "corrupted";
+
+  if (err) {
+    wlog(L_WARN, "snapshot: '%s': %s, ignoring it", file, err);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  struct snapshot *sp = calloc(1, sizeof(struct snapshot));
+  assert(sp);
+  sp->map = map;
+  sp->hdr = hdr;
+
+  wlog(L_INFO, "snapshot: mapped '%s' with %u sets (%llu bytes)", file, hdr->n_sets,
+       (unsigned long long)hdr->size);
+
+  return sp;
+}
+
+
+//! unmap snapshot
+//! \param sp mapped snapshot (may be NULL)
+void snapshot_close(struct snapshot *sp) {
+  if (sp) {
+    munmap(sp->map, sp->hdr->size);
+    free(sp);
+  }
+}
+
+
+//! find checker set in mapped snapshot
+//! \param sp mapped snapshot
+//! \param name checker name
+//! \param driver checker driver name
+//! \param source source name
+//! \param filter source filter
+//! \param params source params
+//! \param stamp source data version (NULL if unknown)
+//! \return set or NULL if not found (or compiled from another config
+//! or source data)
+struct snap_set *snapshot_set(struct snapshot *sp, char *name, char *driver, char *source, char *filter,
+                              char *params, char *stamp) {
+
+  if (! sp)
+    return NULL;
+
+  struct snap_set *sets = (struct snap_set *)(sp->map + sp->hdr->sets_off);
+  uint32_t i;
+  for (i = 0; i < sp->hdr->n_sets; i ++) {
+    if (strcmp(sp->map + sets[i].name_off, name))
+      continue;
+    if (strcmp(sp->map + sets[i].driver_off, driver) ||
+        strcmp(sp->map + sets[i].source_off, source) ||
+        strcmp(sp->map + sets[i].filter_off, filter ? filter : "") ||
+        strcmp(sp->map + sets[i].params_off, params ? params : "")) {
+      wlog(L_WARN, "snapshot: checker '%s' has changed since the snapshot was compiled", name);
+      return NULL;
+    }
+    // sets of sources with unknown data version are taken as they are,
+    // the others only if the data is the same it was compiled from
+    if (sets[i].stamp_off && (! stamp || strcmp(sp->map + sets[i].stamp_off, stamp))) {
+      wlog(L_WARN, "snapshot: source '%s' data has changed since the snapshot was compiled", source);
+      return NULL;
+    }
+    return &sets[i];
+  }
+
+  return NULL;
+}
+
+
+//! get set record data
+//! \param sp mapped snapshot
+//! \param set snapshot set
+//! \param idx record index
+//! \return record data string
+char *snapshot_data(struct snapshot *sp, struct snap_set *set, uint32_t idx) {
+  return sp->map + ((struct snap_rec *)(sp->map + set->recs_off))[idx].data_off;
+}
+
+
+//! find string in a set (binary search)
+//! \param sp mapped snapshot
+//! \param set snapshot set
+//! \param str string to find
+//! \return record index or -1 if not found
+int64_t snapshot_find_string(struct snapshot *sp, struct snap_set *set, char *str) {
+
+  struct snap_rec *recs = (struct snap_rec *)(sp->map + set->recs_off);
+  int64_t lo = 0, hi = (int64_t)set->n_recs - 1;
+
+  while (lo <= hi) {
+    int64_t mid = (lo + hi) / 2;
+    char *data = sp->map + recs[mid].data_off;
+    int cmp = set->icase ? strcasecmp(str, data) : strcmp(str, data);
+    if (! cmp)
+      return mid;
+    if (cmp < 0)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+  }
+
+  return -1;
+}
+
+
+//! find network holding ip in a set (most specific one)
+//! \param sp mapped snapshot
+//! \param set snapshot set
+//! \param ip ip address
+//! \return record index or -1 if not found
+int64_t snapshot_find_ip(struct snapshot *sp, struct snap_set *set, in_addr_t ip) {
+
+  struct snap_rec *recs = (struct snap_rec *)(sp->map + set->recs_off);
+  struct snap_group *groups = (struct snap_group *)(sp->map + set->groups_off);
+  uint32_t g;
+
+  // one binary search per distinct mask
+  for (g = 0; g < set->n_groups; g ++) {
+    uint32_t key = ip & groups[g].net;
+    int64_t lo = groups[g].first, hi = (int64_t)groups[g].first + groups[g].count - 1;
+    while (lo <= hi) {
+      int64_t mid = (lo + hi) / 2;
+      if (recs[mid].ipnet == key)
+        return mid;
+      if (recs[mid].ipnet > key)
+        hi = mid - 1;
+      else
+        lo = mid + 1;
+    }
+  }
+
+  return -1;
+}
+
@@ -0,0 +1,86 @@
+/** \file */
+
+
+#ifndef __ACLH_SNAPSHOT_H__
+#define __ACLH_SNAPSHOT_H__
+
+//! snapshot file magic
+#define SNAP_MAGIC          "ACLHSNAP"
+
+//! snapshot format version (bump on any layout change)
+#define SNAP_VERSION        3
+
+// snapshot file layout: header, then sets data (strings, records arrays,
+// ip groups), then sets headers; everything is addressed by offsets from
+// the file start, so the file is used as mapped at any address
+
+//! snapshot file header
+struct snap_header {
+  char magic[8];             //!< SNAP_MAGIC
+  uint32_t version;          //!< SNAP_VERSION
+  uint32_t n_sets;           //!< number of sets
+  uint64_t size;             //!< file size
+  uint64_t checksum;         //!< FNV-1a of sets headers (data pages are not read on open)
+  uint64_t created;          //!< creation time
+  uint64_t sets_off;         //!< sets headers array offset
+};
+
+//! snapshot set: records of one checker
+struct snap_set {
+  uint64_t name_off;         //!< checker name
+  uint64_t driver_off;       //!< checker driver name
+  uint64_t source_off;       //!< source name
+  uint64_t filter_off;       //!< source filter
+  uint64_t params_off;       //!< source params
+  uint64_t stamp_off;        //!< source data version at compile time (0 if unknown)
+  uint64_t recs_off;         //!< records array offset
+  uint64_t groups_off;       //!< ip groups array offset (ip sets only)
+  uint32_t n_recs;           //!< number of records
+  uint32_t n_groups;         //!< number of ip groups
+  int32_t type;              //!< checker match type
+  int32_t icase;             //!< records are sorted case insensitive
+};
+
+//! snapshot record: sorted by data (strings), by group and ipnet (ips)
+//! or in load order (patterns and lists)
+struct snap_rec {
+  uint64_t data_off;         //!< record data string
+  uint32_t ipnet;            //!< ip & net (ip sets only)
+  uint32_t net;              //!< network mask (ip sets only)
+};
+
+//! snapshot ip group: records of one network mask
+struct snap_group {
+  uint32_t net;              //!< network mask
+  uint32_t first;            //!< first group record
+  uint32_t count;            //!< number of group records
+  uint32_t reserved;         //!< zero
+};
+
+//! snapshot being written
+struct snap_writer {
+  char *buf;                 //!< file image
+  size_t len;                //!< image length
+  size_t size;               //!< image buffer size
+  struct snap_set *sets;     //!< sets headers
+  uint32_t n_sets;           //!< number of sets
+};
+
+//! mapped snapshot
+struct snapshot {
+  char *map;                 //!< mapped file
+  struct snap_header *hdr;   //!< file header (at mapping start)
+};
+
+extern struct snap_writer *snapshot_create(void);
+extern int snapshot_add(struct snap_writer *, char *, char *, char *, char *, char *, char *, int, int, char **, uint32_t);
+extern int snapshot_save(struct snap_writer *, char *);
+extern struct snapshot *snapshot_open(char *);
+extern void snapshot_close(struct snapshot *);
+extern struct snap_set *snapshot_set(struct snapshot *, char *, char *, char *, char *, char *, char *);
+extern char *snapshot_data(struct snapshot *, struct snap_set *, uint32_t);
+extern int64_t snapshot_find_string(struct snapshot *, struct snap_set *, char *);
+extern int64_t snapshot_find_ip(struct snapshot *, struct snap_set *, in_addr_t);
+
+#endif //__ACLH_SNAPSHOT_H__
+
@@ -4,12 +4,14 @@
 #include "acl-helper.h"
 #include "tree.h"
 #include "log.h"
+#include "conf.h"
 #include "misc.h"
 
 #include "source.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <regex.h>
 
 
@@ -25,20 +27,40 @@
   #include <libmemcached/memcached.h>
 #endif
 
+#ifdef USE_SSL
+  #include <openssl/pem.h>
+  #include <openssl/x509.h>
+  #include <openssl/err.h>
+#endif
 
-// A STUB
-int sources_init(void) {
-  return 0;
-}
 
-// sources list
+static char *source_from_file(char *, char *);
+static int source_scan_file(char *, char *, source_line_f, void *);
+static char *source_from_sqlite3(char *, char *);
+static int source_scan_sqlite3(char *, char *, source_line_f, void *);
+static char *source_from_pgsql(char *, char *);
+static char *source_from_crl(char *, char *);
+static char *source_from_raw(char *, char *);
+static char *source_from_dummy(char *, char *);
+static char *source_stamp(struct source *);
+
+// sources list (in use)
 static struct source *sources;
 
+// configured sources list (to be put in use by sources_init())
+static struct source *sources_conf;
+
+// previous sources list: it may still be in use by a source load,
+// freed on next init
+static struct source *sources_retired;
+
+
 //! find source by name
+//! \param list sources list
 //! \param name source name
 //! \return pointer at found source entry or NULL 
-struct source *source_find(char *name) {
-  struct source *sp = sources;
+static struct source *source_find(struct source *list, char *name) {
+  struct source *sp = list;
   while (sp) {
     if (! strcmp(sp->name, name))
       break;
@@ -50,6 +72,84 @@ struct source *source_find(char *name) {
 }
 
 
+//! free sources list
+//! \param sp list head
+static void sources_free(struct source *sp) {
+  while (sp) {
+    struct source *next = sp->next;
+    free(sp->name);
+    free(sp->params);
+    free(sp->check);
+    free(sp->stamp);
+    free(sp);
+    sp = next;
+  }
+}
+
+
+//! put configured sources in use
+//! \return 0 if ok
+int sources_init(void) {
+
+  // data versions are taken before the data is loaded, so a change
+  // made meanwhile is seen by next check
+  struct source *sp;
+  for (sp = sources_conf; sp; sp = sp->next)
+    sp->stamp = source_stamp(sp);
+
+  sources_free(sources_retired);
+  sources_retired = __atomic_exchange_n(&sources, sources_conf, __ATOMIC_ACQ_REL);
+  sources_conf = NULL;
+  return 0;
+}
+
+
+//! put previous sources back in use (reload failed); rejected ones
+//! are freed on next init
+void sources_restore(void) {
+  sources_retired = __atomic_exchange_n(&sources, sources_retired, __ATOMIC_ACQ_REL);
+}
+
+
+//! check if source data has changed since previous sources init
+//! (sources with unknown data version are always changed)
+//! \param name source name
+//! \return !0 if changed
+int source_changed(char *name) {
+  struct source *sp = source_find(sources, name);
+  struct source *prev = source_find(sources_retired, name);
+  return ! sp || ! prev || ! sp->stamp || ! prev->stamp ||
+         sp->driver != prev->driver || strcmp(sp->params, prev->params) ||
+         ! sp->check != ! prev->check || (sp->check && strcmp(sp->check, prev->check)) ||
+         strcmp(sp->stamp, prev->stamp);
+}
+
+
+//! check sources in use for data changes
+//! \return number of changed sources
+int sources_check(void) {
+  struct source *sp;
+  int changed = 0;
+  for (sp = sources; sp; sp = sp->next) {
+    if (! sp->stamp)
+      continue;
+    char *stamp = source_stamp(sp);
+    if (! stamp || strcmp(stamp, sp->stamp)) {
+      wlog(L_INFO, "source '%s' has changed", sp->name);
+      changed ++;
+    }
+    free(stamp);
+  }
+  return changed;
+}
+
+
+//! drop configured sources (config reload failed)
+void sources_config_free(void) {
+  sources_free(sources_conf);
+  sources_conf = NULL;
+}
+
 
 //! return data from various sources;
 //! returned data then must be freed by a caller
@@ -58,7 +158,7 @@ struct source *source_find(char *name) {
 //! \return char* to data string if success, NULL otherwise
 char *source_data(char *sname, char *filter) {
   // find a source for given name
-  struct source *sp = source_find(sname);
+  struct source *sp = source_find(__atomic_load_n(&sources, __ATOMIC_ACQUIRE), sname);
   if (sp && sp->driver)
     return sp->driver(sp->params, filter);
   return NULL;
@@ -66,6 +166,62 @@ char *source_data(char *sname, char *filter) {
 
 
 
+//! get source in use (its params and data version at last init)
+//! \param sname source name
+//! \return source or NULL if there is no such source
+struct source *source_get(char *sname) {
+  return source_find(__atomic_load_n(&sources, __ATOMIC_ACQUIRE), sname);
+}
+
+
+//! get db connection string of sqlite3 source
+//! \param sname source name
+//! \return connection string or NULL if there is no such sqlite3 source
+char *source_sqlite3_db(char *sname) {
+  struct source *sp = source_find(__atomic_load_n(&sources, __ATOMIC_ACQUIRE), sname);
+  if (sp && sp->driver == source_from_sqlite3)
+    return sp->params;
+  return NULL;
+}
+
+
+//! stream data lines from various sources: file sources are scanned
+//! in place, sqlite3 rows are stepped through, others' data is loaded
+//! and split into lines
+//! \param sname source name
+//! \param filter source filter (from checker, option, etc)
+//! \param func function to call for each line
+//! \param arg function argument
+//! \return 0 if ok, !0 otherwise
+int source_scan(char *sname, char *filter, source_line_f func, void *arg) {
+
+  struct source *sp = source_find(__atomic_load_n(&sources, __ATOMIC_ACQUIRE), sname);
+  if (! sp || ! sp->driver)
+    return 1;
+
+  if (sp->driver == source_from_file)
+    return source_scan_file(sp->params, filter, func, arg);
+  if (sp->driver == source_from_sqlite3)
+    return source_scan_sqlite3(sp->params, filter, func, arg);
+
+  char *data = sp->driver(sp->params, filter);
+  if (! data)
+    return 1;
+
+  char *line, *next;
+  for (line = data; line; line = next) {
+    next = strchr(line, '\n');
+    if (next)
+      *next ++ = '\0';
+    func(line, strlen(line), arg);
+  }
+
+  free(data);
+  return 0;
+}
+
+
+
 //! raw source driver: provide embedded data from config file
 //! raw data has line delimiter ',' so replace them with '\n'
 //! \param params driver params
@@ -96,17 +252,36 @@ static char *source_from_raw(char *params, char *filter) {
 
 
 
-//! file driver: file content will be returned to caller
-//! all '\\r' chars will be stripped
+//! apply filter to a file line and give it to the callback
+//! \param line line (terminated)
+//! \param len line length
+//! \param freg compiled filter (NULL if none)
+//! \param filter filter regex
+//! \param func function to call
+//! \param arg function argument
+static void source_file_line(char *line, size_t len, regex_t *freg, char *filter, source_line_f func, void *arg) {
+  while (len && line[len - 1] == '\r')
+    line[-- len] = '\0';
+  if (freg && regexec(freg, line, 0, NULL, 0) == REG_NOMATCH)
+    wlog(L_DEBUG5, "filtering out '%s' matching '%s'", line, filter);
+  else
+    func(line, len, arg);
+}
+
+
+//! file lines scanner: the file is read sequentially in chunks into
+//! a reused buffer (it is not mapped: list files are often rewritten
+//! in place by others), lines passing the filter are given to the
+//! callback one by one
 //! \param params driver params
 //! \param filter driver filter
-//! \return char* source data or NULL
-static char *source_from_file(char *params, char *filter) {
-
-  char *data = NULL;
+//! \param func function to call for each line
+//! \param arg function argument
+//! \return 0 if ok, !0 otherwise
+static int source_scan_file(char *params, char *filter, source_line_f func, void *arg) {
 
   if (! params)
-    return NULL;
+    return 1;
 
   // got filter - regcomp it
   regex_t *freg = NULL;
@@ -123,55 +298,68 @@ static char *source_from_file(char *params, char *filter) {
     }
   }
 
-
-  // get file size
+  // open the file and check its size
   struct stat st;
-  if (stat(params, &st) || st.st_size < 1) {
-    wlog(L_ERR, "empty file or stat(%s) failed: %s", params, strerror(errno));
-    return NULL;
-  }
-
-  // open the file
-  FILE *fp = fopen(params, "r");
-  if (! fp) {
-    wlog(L_ERR, "failed to open source file '%s': %s", params, strerror(errno));
-    return NULL;
+  int fd = open(params, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) || st.st_size < 1) {
+    wlog(L_ERR, "empty file or open(%s) failed: %s", params, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    if (freg) {
+      regfree(freg);
+      free(freg);
+    }
+    return 1;
   }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // lines are terminated in place in the buffer, a partial line
+  // is moved to its start before the next read (the buffer grows
+  // only if a line doesn't fit it)
+  size_t size = SOURCE_SCAN_CHUNK, have = 0;
+  char *buf = malloc(size);
+  assert(buf);
+  int err = 0;
+
+  while (1) {
+
+    if (have == size) {
+      size *= 2;
+      buf = realloc(buf, size);
+      assert(buf);
+    }
 
-  // allocate space for data read from file
-  data = calloc(1, st.st_size + 1);
-  assert(data);
+    ssize_t n = read(fd, buf + have, size - have);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      wlog(L_ERR, "failed to read source file '%s': %s", params, strerror(errno));
+      err = 1;
+      break;
+    }
 
-  // read file content and apply filter
-  char *data_p = data;
-  ssize_t num = 0;
-  char *line = NULL;
-  size_t n;
-
-  // get next line from file
-  while ((num = getline(&line, &n, fp)) >= 0) {
-
-    // got something?
-    if (line) {
-      // apply filter
-      if (freg && regexec(freg, line, 0, NULL, 0) == REG_NOMATCH) {
-        // ignore the line
-        wlog(L_DEBUG5, "filtering out '%s' matching '%s'", line, filter);
-      } else {
-        // save line in buf
-        strcpy(data_p, line);
-        data_p += num;
+    // last line may have no '\n' (there is room for terminator)
+    if (! n) {
+      if (have) {
+        buf[have] = '\0';
+        source_file_line(buf, have, freg, filter, func, arg);
       }
+      break;
     }
 
-  }
+    char *p = buf, *end = buf + have + n, *eol;
+    while ((eol = memchr(p, '\n', end - p))) {
+      *eol = '\0';
+      source_file_line(p, eol - p, freg, filter, func, arg);
+      p = eol + 1;
+    }
 
-  // done with the file
-  fclose(fp);
+    have = end - p;
+    memmove(buf, p, have);
+  }
 
-  // free buffer allocated by getline()
-  if (line)
-    free(line);
+  close(fd);
+  free(buf);
 
   // free regex pattern
   if (freg) {
@@ -180,97 +368,163 @@ static char *source_from_file(char *params, char *filter) {
   }
 
   // done
-  return data;
+  return err;
 }
 
 
-//! sqlite3 driver: read data from sqlite3 db;
-//! records will be merged by '\n' char into a single string
-//! only FIRST column will be fetched and stored
-//! \param params driver params (db connection string)
-//! \param filter driver filter (db query)
+//! append line to data string being collected
+static void source_collect_line(char *line, size_t len, void *arg) {
+  FILE *out = arg;
+  fwrite(line, 1, len, out);
+  fputc('\n', out);
+}
+
+
+//! file driver: file content will be returned to caller
+//! all '\\r' chars will be stripped
+//! \param params driver params
+//! \param filter driver filter
 //! \return char* source data or NULL
-static char *source_from_sqlite3(char *params, char *filter) {
+static char *source_from_file(char *params, char *filter) {
 
   char *data = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&data, &size);
+  assert(out);
+
+  int err = source_scan_file(params, filter, source_collect_line, out);
+  fclose(out);
+
+  if (err) {
+    free(data);
+    return NULL;
+  }
+
+  // done
+  return data;
+}
+
+
+//! sqlite3 rows scanner: rows are stepped through one by one and
+//! their first column is given to the callback (empty ones are skipped)
+//! \param params driver params (db connection string)
+//! \param filter driver filter (db query)
+//! \param func function to call for each row
+//! \param arg function argument
+//! \return 0 if ok, !0 otherwise
+static int source_scan_sqlite3(char *params, char *filter, source_line_f func, void *arg) {
 
 #ifdef USE_SQLITE3
 
   if (! params || ! filter)
-    return NULL;
+    return 1;
 
-  // sqlite3 bd handler
+  // sqlite3 bd handler: read-only, used by this thread only
   sqlite3 *dbh;
 
-  // enable URI support for file openings
-  sqlite3_config(SQLITE_CONFIG_URI, 1);
-
-  // open the db
-  if (sqlite3_open(params, &dbh) != SQLITE_OK) {
+  // open the db (URI file names are allowed)
+  if (sqlite3_open_v2(params, &dbh, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
     wlog(L_ERR, "failed to open db '%s': %s", params, sqlite3_errmsg(dbh));
-    return NULL;
+    sqlite3_close(dbh);
+    return 1;
   }
 
+  // big tables are read once: let the pages be cached and mapped
+  sqlite3_exec(dbh, "PRAGMA cache_size = -" SOURCE_SQLITE3_CACHE_KB "; "
+                    "PRAGMA mmap_size = " SOURCE_SQLITE3_MMAP_SIZE, NULL, NULL, NULL);
+
   // prepare the query
   sqlite3_stmt *sth;
-  if (sqlite3_prepare(dbh, filter, -1, &sth, NULL) != SQLITE_OK) {
+  if (sqlite3_prepare_v2(dbh, filter, -1, &sth, NULL) != SQLITE_OK) {
     wlog(L_ERR, "failed to prepare sql query '%s': %s", filter, sqlite3_errmsg(dbh));
     sqlite3_close(dbh);
-    return NULL;
+    return 1;
   }
 
+  // rows are copied into a buffer ('\r' dropped) to be given to the callback
+  char *line = NULL;
+  size_t size = 0;
+
   // do the query and fetch records
-  while (sqlite3_step(sth) == SQLITE_ROW) {
+  int rc;
+  while ((rc = sqlite3_step(sth)) == SQLITE_ROW) {
 
     // we take only FIRST column
+    const char *row = (const char *)sqlite3_column_text(sth, 0);
     int colsize = sqlite3_column_bytes(sth, 0);
-    if (colsize <= 0)
+    if (! row || colsize <= 0)
       continue;
 
-    // fetch a row (first and the only one)
-    // it must be in form "key=value", one row
-    char *row = (char *)sqlite3_column_text(sth, 0);
-
-    // count '\n' in the row (why? see comments below)
-    int lf_n;
-    char *lf_p;
-    for (lf_n = 0, lf_p = row; (lf_p = strchr(lf_p, '\n')) != NULL; lf_p ++, lf_n ++);
- 
-    // alloc space for new row and merge it with returning data
-    // don't forget about trailing '\n'
-    if (! data)
-      data = calloc(1, colsize + lf_n + 2);
-    else
-      data = realloc(data, strlen(data) + colsize + lf_n + 2);
-    assert(data);
-
-    // sometimes resulting row contains one or more '\n' (without leading '\')
-    // so we have to append them ourselves
-    char *rp = row, *dp = data + strlen(data);
-    while (*rp) {
-      // ignore '\r's
-      if (*rp == '\r') {
-        rp ++;
-        continue;
-      }
-      // found '\n' and no '\' before it - store additional '\' in data
-      if (*rp == '\n' && (rp == row || *(rp - 1) != '\\'))
-        *dp ++ = '\\';
-      // store row char
-      *dp ++ = *rp ++;
+    if ((size_t)colsize + 1 > size) {
+      size = colsize + 1 > 256 ? colsize + 1 : 256;
+      line = realloc(line, size);
+      assert(line);
     }
 
-    // add trailing \n and finalize the string
-    *dp ++ = '\n';
-    *dp = '\0';
+    size_t len = 0;
+    int i;
+    for (i = 0; i < colsize; i ++) {
+      if (row[i] != '\r')
+        line[len ++] = row[i];
+    }
+    line[len] = '\0';
 
+    func(line, len, arg);
   }
 
+  if (rc != SQLITE_DONE)
+    wlog(L_ERR, "failed to fetch sql query '%s' results: %s", filter, sqlite3_errmsg(dbh));
+
   // done, destroy sqlite3 related structs
+  free(line);
   sqlite3_finalize(sth);
   sqlite3_close(dbh);
 
+  return rc != SQLITE_DONE;
+
+#else
+
+  return 1;
+
 #endif //USE_SQLITE3
+}
+
+
+//! append db row to data string being collected: rows are delimited
+//! with '\n', '\n's inside a row are escaped with '\'
+static void source_collect_row(char *row, size_t len, void *arg) {
+  FILE *out = arg;
+  size_t i;
+  for (i = 0; i < len; i ++) {
+    if (row[i] == '\n' && (i == 0 || row[i - 1] != '\\'))
+      fputc('\\', out);
+    fputc(row[i], out);
+  }
+  fputc('\n', out);
+}
+
+
+//! sqlite3 driver: read data from sqlite3 db;
+//! records will be merged by '\n' char into a single string
+//! only FIRST column will be fetched and stored
+//! \param params driver params (db connection string)
+//! \param filter driver filter (db query)
+//! \return char* source data or NULL
+static char *source_from_sqlite3(char *params, char *filter) {
+
+  char *data = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&data, &size);
+  assert(out);
+
+  int err = source_scan_sqlite3(params, filter, source_collect_row, out);
+  fclose(out);
+
+  // no rows is no data (as it always was)
+  if (err || ! size) {
+    free(data);
+    return NULL;
+  }
 
   // done
   return data;
@@ -377,6 +631,90 @@ static char *source_from_pgsql(char *params, char *filter) {
 }
 
 
+#ifdef USE_SSL
+//! dump CRL revoked certs as 'issuer_hash:serial' lines
+//! \param crl CRL to dump
+//! \param out where to write
+static void crl_dump(X509_CRL *crl, FILE *out) {
+  unsigned long issuer = X509_NAME_hash(X509_CRL_get_issuer(crl));
+  STACK_OF(X509_REVOKED) *revs = X509_CRL_get_REVOKED(crl);
+  int i;
+  for (i = 0; i < sk_X509_REVOKED_num(revs); i ++) {
+    BIGNUM *bn = ASN1_INTEGER_to_BN(X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(revs, i)), NULL);
+    char *hex = bn ? BN_bn2hex(bn) : NULL;
+    if (hex)
+      fprintf(out, "%08lx:%s\n", issuer, hex);
+    OPENSSL_free(hex);
+    BN_free(bn);
+  }
+}
+#endif
+
+
+//! CRL driver: revoked certs from CRL files (PEM or DER) as
+//! 'issuer_hash:serial' lines (issuer hash as of 'openssl x509 -issuer_hash');
+//! CRL files are local trusted data, their signatures are not checked
+//! \param params CRL files list (',' separated)
+//! \param filter ignored
+//! \return char* source data or NULL
+static char *source_from_crl(char *params, char *filter) {
+
+  char *data = NULL;
+
+#ifdef USE_SSL
+
+  if (! params)
+    return NULL;
+
+  size_t size = 0;
+  FILE *out = open_memstream(&data, &size);
+  if (! out) {
+    wlog(L_ERR, "open_memstream() failed: %s", strerror(errno));
+    return NULL;
+  }
+
+  char *files = strdup(params), *file, *saveptr = NULL;
+  assert(files);
+
+  for (file = strtok_r(files, ",", &saveptr); file; file = strtok_r(NULL, ",", &saveptr)) {
+
+    BIO *bio = BIO_new_file(file, "r");
+    if (! bio) {
+      wlog(L_ERR, "failed to open CRL file '%s'", file);
+      continue;
+    }
+
+    // PEM file may hold several CRLs, DER one holds just one
+    X509_CRL *crl;
+    int n = 0;
+    while ((crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL)) != NULL) {
+      crl_dump(crl, out);
+      X509_CRL_free(crl);
+      n ++;
+    }
+    if (! n && ! BIO_reset(bio) && (crl = d2i_X509_CRL_bio(bio, NULL)) != NULL) {
+      crl_dump(crl, out);
+      X509_CRL_free(crl);
+      n ++;
+    }
+    ERR_clear_error();
+
+    if (! n)
+      wlog(L_WARN, "no CRLs found in '%s'", file);
+
+    BIO_free(bio);
+  }
+
+  free(files);
+  fclose(out);
+
+#endif // USE_SSL
+
+  // done
+  return data;
+}
+
+
 //! memcached driver
 //! A STUB
 static char *source_from_memcached(char *param, char *filter) {
@@ -409,13 +747,13 @@ int source_config(char *str) {
   }
 
   // no duplicate sources allowed
-  if (source_find(array[0])) {
+  if (source_find(sources_conf, array[0])) {
     wlog(L_ERR, "source '%s' already defined", array[0]);
     return 1;
   }
  
   // go to last source in list
-  struct source *sp = sources;
+  struct source *sp = sources_conf;
   while (sp && sp->next)
     sp = sp->next;
 
@@ -425,7 +763,7 @@ int source_config(char *str) {
 
   // add new source to the list
   if (! sp)
-    sp = sources = new_sp;
+    sp = sources_conf = new_sp;
   else
     sp = sp->next = new_sp;
 
@@ -445,6 +783,8 @@ int source_config(char *str) {
     sp->driver = source_from_memcached;
   else if (! strcmp("dummy", array[1]))
     sp->driver = source_from_dummy;
+  else if (! strcmp("crl", array[1]))
+    sp->driver = source_from_crl;
   else {
     wlog(L_ERR, "unsupported 'source' driver");
     return 1;
@@ -458,3 +798,88 @@ int source_config(char *str) {
 }
 
 
+//! get files data version: their inodes, sizes and mtimes
+//! \param files files list
+//! \param delim files list delimiters (NULL if just one file)
+//! \return version string (to be freed) or NULL if unknown
+static char *source_files_stamp(char *files, char *delim) {
+
+  char *list = strdup(files), *file, *saveptr = NULL;
+  assert(list);
+
+  size_t size = 0;
+  char *stamp = NULL;
+  FILE *out = open_memstream(&stamp, &size);
+  assert(out);
+
+  int err = 0;
+  for (file = delim ? strtok_r(list, delim, &saveptr) : list; file && ! err;
+       file = delim ? strtok_r(NULL, delim, &saveptr) : NULL) {
+    struct stat st;
+    if (stat(file, &st))
+      err ++;
+    else
+      fprintf(out, "%lu:%lld:%lld.%09ld;", (unsigned long)st.st_ino, (long long)st.st_size,
+              (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+  }
+
+  fclose(out);
+  free(list);
+
+  if (err) {
+    free(stamp);
+    return NULL;
+  }
+  return stamp;
+}
+
+
+//! get source data version: local files are stat()ed, databases are
+//! asked with change tracking query, embedded data never changes
+//! \param sp source
+//! \return version string (to be freed) or NULL if unknown
+static char *source_stamp(struct source *sp) {
+
+  char *stamp = NULL;
+
+  if (sp->driver == source_from_file)
+    stamp = source_files_stamp(sp->params, NULL);
+  else if (sp->driver == source_from_crl)
+    stamp = source_files_stamp(sp->params, ",");
+  else if (sp->driver == source_from_raw || sp->driver == source_from_dummy)
+    stamp = strdup("");
+  else if (sp->check)
+    stamp = sp->driver(sp->params, sp->check);
+
+  return stamp;
+}
+
+
+//! parse source change tracking config line ('source:query')
+//! \param str config line
+//! \return 0 if ok, !0 otherwise
+int source_check_config(char *str) {
+
+  char *array[2] = {0, };
+  int n = parse_string(str, array, ":", 2);
+  if (n < 2 || ! array[0] || ! array[1]) {
+    wlog(L_ERR, "not enough args for 'source_check'");
+    free(array[0]);
+    free(array[1]);
+    return 1;
+  }
+
+  struct source *sp = source_find(sources_conf, array[0]);
+  if (! sp || (sp->driver != source_from_sqlite3 && sp->driver != source_from_pgsql)) {
+    wlog(L_ERR, "no sqlite3 or pgsql source '%s' defined", array[0]);
+    free(array[0]);
+    free(array[1]);
+    return 1;
+  }
+
+  free(array[0]);
+  free(sp->check);
+  sp->check = array[1];
+
+  return 0;
+}
@@ -10,13 +10,35 @@ struct source {
   char *name;          //!< name of source
   char *params;        //!< driver params
   char *(*driver)(char *, char *);  //! function to call to load data
+  char *check;         //!< change tracking query (sqlite3, pgsql; NULL if none)
+  char *stamp;         //!< data version at last init (NULL if unknown)
   struct source *next; //!< next in list
 };
 
+//! file sources are read in chunks of this size into a reused buffer
+#define SOURCE_SCAN_CHUNK (1024 * 1024)
+
+//! sqlite3 sources page cache size, KBytes (string: it goes to PRAGMA)
+#define SOURCE_SQLITE3_CACHE_KB "65536"
+
+//! sqlite3 sources db mapping size limit, bytes (string: it goes to PRAGMA)
+#define SOURCE_SQLITE3_MMAP_SIZE "268435456"
+
+//! source data line callback
+typedef void (*source_line_f)(char *line, size_t len, void *arg);
+
 
 extern int sources_init(void);
+extern void sources_restore(void);
 extern int source_config(char *);
+extern void sources_config_free(void);
+extern int source_check_config(char *);
+extern int source_changed(char *);
+extern int sources_check(void);
 extern char *source_data(char *, char *);
+extern int source_scan(char *, char *, source_line_f, void *);
+extern struct source *source_get(char *);
+extern char *source_sqlite3_db(char *);
 
 #endif // __ACLH_SOURCE_H__
 
@@ -5,173 +5,1036 @@
 #include "log.h"
 #include "conf.h"
 #include "resolve.h"
+#include "tree.h"
 
-#include <sys/select.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #ifdef USE_SSL
   #include <openssl/ssl.h>
+  #include <openssl/evp.h>
+  #include <openssl/x509.h>
+  #include <openssl/ocsp.h>
+  #include <openssl/err.h>
 #endif
 
+#include "sslcache.h"
+#include "revoked.h"
+#include "mem.h"
 #include "ssl.h"
 
 
 #ifdef USE_SSL
-static const SSL_METHOD *method;
-#endif
 
-//! init SSL engine
-//! \return 0 if ok
-int ssl_init(void) {
+//! connection attempt states
+enum ssl_conn_states {
+  SSL_CONN_CONNECTING,   //!< waiting for tcp connect() to complete
+  SSL_CONN_HANDSHAKE,    //!< tcp connected, doing SSL handshake
+  SSL_CONN_DEAD,         //!< closed, waiting to be freed
+};
 
-#ifdef USE_SSL
-  // prepare SSL engine
-  OpenSSL_add_all_algorithms();
-  SSL_load_error_strings();
+struct ssl_job;
 
-  // init SSL engine
-  SSL_library_init();
+//! one connection attempt to one of resolved host ips
+struct ssl_conn {
+  int fd;                    //!< connection socket
+  int state;                 //!< connection state
+  in_addr_t ip;              //!< remote ip (network byte order)
+  SSL *ssl;                  //!< SSL connection object (handshake state only)
+  int verified;              //!< peer chain was verified during handshake
+  long verify_res;           //!< peer chain verification result
+  int ocsp;                  //!< peer cert OCSP status
+  struct ssl_job *job;       //!< job this attempt belongs to
+  struct ssl_conn *next;     //!< next attempt of the same job
+};
 
-  // load methods
-  method = SSLv23_client_method();
-#endif
+//! host verification job handed over to SSL engine
+struct ssl_job {
+  char *hostname;            //!< host to verify
+  unsigned port;             //!< host port
+  long long deadline;        //!< job deadline (monotonic msecs)
+  long long next_try;        //!< time to start next connection attempt (monotonic msecs)
+  in_addr_t ips[MAX_RESOLVED_IPS + 1]; //!< resolved host ips (network byte order)
+  int n_ips;                 //!< number of resolved ips
+  int next_ip;               //!< index of next ip to try
+  struct ssl_conn *conns;    //!< active connection attempts
+  long result;               //!< verification result
+  int ocsp;                  //!< host cert OCSP status
+  int done;                  //!< job is finished flag
+  pthread_cond_t cond;       //!< signalled when job is done
+  struct ssl_job *next;      //!< next job in queue or active list
+};
 
-  // done
-  return 0;
+//! shared client SSL context
+static SSL_CTX *ssl_ctx;
+
+//! engine epoll descriptor
+static int ssl_epfd = -1;
+
+//! engine wakeup descriptor (new jobs are submitted)
+static int ssl_evfd = -1;
+
+//! mutex for jobs queue and jobs completion
+static pthread_mutex_t ssl_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! submitted but not yet started jobs (FIFO)
+static struct ssl_job *ssl_queue_head, *ssl_queue_tail;
+
+//! jobs being processed by engine (engine thread private)
+static struct ssl_job *ssl_active;
+
+//! number of jobs being processed by engine (engine thread private)
+static int ssl_active_num;
+
+//! closed connections to be freed after current events batch (engine thread private)
+static struct ssl_conn *ssl_dead;
+
+//! cached OCSP status entry
+struct ocsp_entry {
+  unsigned long issuer;      //!< cert issuer name hash
+  char *serial;              //!< cert serial number (hex)
+  int status;                //!< cert OCSP status
+  time_t expire;             //!< status expiration time (response nextUpdate)
+};
+
+//! mutex for OCSP cache operations
+static pthread_mutex_t ocsp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! OCSP statuses cache itself
+static node_t *ocsp_cache;
+
+//! number of cached OCSP statuses
+static int ocsp_cache_num;
+
+
+//! get monotonic time in msecs
+static long long ssl_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 
+//! close one connection attempt
+//! it is not freed immediately: current epoll events batch may still refer to it
+//! \param conn connection to close
+static void ssl_conn_free(struct ssl_conn *conn) {
+  // closing the socket also removes it from epoll set
+  if (conn->ssl)
+    SSL_free(conn->ssl);
+  if (conn->fd >= 0)
+    close(conn->fd);
+  conn->ssl = NULL;
+  conn->fd = -1;
+  conn->job = NULL;
+  conn->state = SSL_CONN_DEAD;
+  conn->next = ssl_dead;
+  ssl_dead = conn;
+}
 
-//! connect to remote host, get its SSL cert, examine it
-//! and return cert verification code (see /usr/include/openssl/x509_vfy.h)
-//! \param hostname remote host to connect
-//! \param port remote host port
-//! \param timeout connection timeout
-//! \return ssl verification code or -1 on error
-int ssl_verify_host(char *hostname, unsigned port, int timeout) {
 
-#ifdef USE_SSL
+//! finish the job: drop all its connections and wake up its waiter
+//! \param job job to finish
+//! \param result job result
+static void ssl_job_finish(struct ssl_job *job, long result) {
 
-  long ssl_verify_res = -1; 
-  SSL_CTX *ssl_ctx = NULL;
-  SSL *ssl = NULL;
- 
-  // resolve the hostname (get 1-st resolved ip only)
-  in_addr_t host_ip;
-  if (resolve_host(hostname, &host_ip, 1) < 1) {
-    wlog(L_WARN, "ssl: failed to resolve host '%s'", hostname);
-    return -1;
-  } else
-    host_ip = htonl(host_ip);
+  // drop all connection attempts
+  while (job->conns) {
+    struct ssl_conn *conn = job->conns;
+    job->conns = conn->next;
+    ssl_conn_free(conn);
+  }
 
-  // check port validness
-  port = (port <= 0 || port >= 0xFFFF) ? 443 : port;
+  // remove the job from active list
+  struct ssl_job **jp = &ssl_active;
+  while (*jp && *jp != job)
+    jp = &(*jp)->next;
+  if (*jp) {
+    *jp = job->next;
+    ssl_active_num --;
+  }
+
+  // hand the result to the waiter (job is owned by the waiter from now on)
+  pthread_mutex_lock(&ssl_jobs_mutex);
+  job->result = result;
+  job->done = 1;
+  pthread_cond_signal(&job->cond);
+  pthread_mutex_unlock(&ssl_jobs_mutex);
+}
+
+
+//! remove one connection attempt from its job
+//! \param conn connection to remove
+static void ssl_conn_drop(struct ssl_conn *conn) {
+  struct ssl_conn **cp = &conn->job->conns;
+  while (*cp && *cp != conn)
+    cp = &(*cp)->next;
+  if (*cp)
+    *cp = conn->next;
+  ssl_conn_free(conn);
+}
+
+
+//! start new async connection attempt to next job ip
+//! \param job the job
+//! \return 0 if attempt started, !0 otherwise
+static int ssl_conn_start(struct ssl_job *job) {
+
+  while (job->next_ip < job->n_ips) {
+
+    in_addr_t ip = job->ips[job->next_ip ++];
+
+    wlog(L_DEBUG5, "ssl: connecting to '%s:%u' (%s)", job->hostname, job->port, inet_ntoa(*(struct in_addr *)&ip));
+
+    // create non-blocking socket
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      wlog(L_ERR, "ssl: failed to create socket: %s", strerror(errno));
+      return 1;
+    }
+
+    // connect to remote host (ASYNC!)
+    struct sockaddr_in haddr = {0,};
+    haddr.sin_family = AF_INET;
+    haddr.sin_port = htons(job->port);
+    haddr.sin_addr.s_addr = ip;
+    if (connect(fd, (struct sockaddr *)&haddr, sizeof(haddr)) < 0 && errno != EINPROGRESS) {
+      wlog(L_DEBUG3, "ssl: connection to '%s:%u' failed: %s", job->hostname, job->port, strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    // create new attempt
+    struct ssl_conn *conn = calloc(1, sizeof(struct ssl_conn));
+    assert(conn);
+    conn->fd = fd;
+    conn->ip = ip;
+    conn->state = SSL_CONN_CONNECTING;
+    conn->job = job;
+
+    // wait for the socket to become writable
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = conn };
+    if (epoll_ctl(ssl_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      wlog(L_ERR, "ssl: epoll_ctl() failed: %s", strerror(errno));
+      ssl_conn_free(conn);
+      return 1;
+    }
+
+    // link it to the job
+    conn->next = job->conns;
+    job->conns = conn;
+
+    // schedule next (racing) attempt
+    job->next_try = ssl_now_ms() + config.ssl_race_delay;
+
+    return 0;
+  }
+
+  // no more ips to try
+  return 1;
+}
+
+
+//! connection attempt failed: try next ip or finish the job
+//! \param conn failed connection
+static void ssl_conn_failed(struct ssl_conn *conn) {
+  struct ssl_job *job = conn->job;
+  ssl_conn_drop(conn);
+  // other attempts are still racing
+  if (job->conns)
+    return;
+  // no one left - start next attempt immediately or give up
+  if (ssl_conn_start(job)) {
+    wlog(L_WARN, "ssl: connection to '%s:%u' failed", job->hostname, job->port);
+    ssl_job_finish(job, -1);
+  }
+}
+
+
+//! advance SSL handshake on connected socket
+//! \param conn connection in handshake state
+static void ssl_conn_handshake(struct ssl_conn *conn) {
+
+  struct ssl_job *job = conn->job;
+
+  // connect to remote host via SSL
+  int ret = SSL_connect(conn->ssl);
+
+  // done: get cert verification result
+  if (ret == 1) {
+    long ssl_verify_res = conn->verified ? conn->verify_res : SSL_get_verify_result(conn->ssl);
+    wlog(L_DEBUG3, "ssl: cert verification for '%s:%u' = %ld", job->hostname, job->port, ssl_verify_res);
+    job->ocsp = conn->ocsp;
+    ssl_job_finish(job, ssl_verify_res);
+    return;
+  }
+
+  // handshake was aborted by us right after peer chain verification
+  if (conn->verified) {
+    wlog(L_DEBUG3, "ssl: cert verification for '%s:%u' = %ld (cert only)", job->hostname, job->port, conn->verify_res);
+    job->ocsp = conn->ocsp;
+    ssl_job_finish(job, conn->verify_res);
+    return;
+  }
+
+  // handshake needs more i/o
+  struct epoll_event ev = { .data.ptr = conn };
+  switch (SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+      ev.events = EPOLLIN;
+      break;
+    case SSL_ERROR_WANT_WRITE:
+      ev.events = EPOLLOUT;
+      break;
+    default:
+      wlog(L_WARN, "ssl: SSL connection to '%s:%u' failed", job->hostname, job->port);
+      ssl_job_finish(job, -1);
+      return;
+  }
+
+  if (epoll_ctl(ssl_epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+    wlog(L_ERR, "ssl: epoll_ctl() failed: %s", strerror(errno));
+    ssl_job_finish(job, -1);
+  }
+}
+
+
+//! handle i/o event on connection attempt
+//! \param conn connection with pending event
+static void ssl_conn_event(struct ssl_conn *conn) {
+
+  struct ssl_job *job = conn->job;
+
+  // closed while processing current events batch
+  if (conn->state == SSL_CONN_DEAD)
+    return;
+
+  // handshake is in progress
+  if (conn->state == SSL_CONN_HANDSHAKE) {
+    ssl_conn_handshake(conn);
+    return;
+  }
+
+  // tcp connect finished: check its result
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    err = errno;
+  if (err) {
+    wlog(L_DEBUG3, "ssl: connection to '%s:%u' (%s) failed: %s",
+         job->hostname, job->port, inet_ntoa(*(struct in_addr *)&conn->ip), strerror(err));
+    ssl_conn_failed(conn);
+    return;
+  }
+
+  wlog(L_DEBUG1, "ssl: connected to '%s:%u' (%s)", job->hostname, job->port, inet_ntoa(*(struct in_addr *)&conn->ip));
+
+  // we have a winner: drop all other racing attempts
+  job->next_ip = job->n_ips;
+  struct ssl_conn *cp = job->conns;
+  while (cp) {
+    struct ssl_conn *next = cp->next;
+    if (cp != conn)
+      ssl_conn_drop(cp);
+    cp = next;
+  }
+
+  // create new SSL connection state obj
+  conn->ssl = SSL_new(ssl_ctx);
+  if (! conn->ssl) {
+    wlog(L_ERR, "ssl: SSL_new() failed");
+    ssl_job_finish(job, -1);
+    return;
+  }
+
+  // set hostname (tlsext mode)
+  SSL_set_tlsext_host_name(conn->ssl, job->hostname);
+
+  // ask for stapled OCSP response
+  if (config.ssl_ocsp)
+    SSL_set_tlsext_status_type(conn->ssl, TLSEXT_STATUSTYPE_ocsp);
+
+  // verify callback will store its result here
+  SSL_set_app_data(conn->ssl, conn);
+
+  // bind connected socket to SSL conn object
+  SSL_set_fd(conn->ssl, conn->fd);
+  conn->state = SSL_CONN_HANDSHAKE;
+
+  // start the handshake
+  ssl_conn_handshake(conn);
+}
+
+
+//! get cert serial number as hex string
+//! \param cert the cert
+//! \return serial (to be freed)
+static char *ssl_cert_serial(X509 *cert) {
+  BIGNUM *bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(cert), NULL);
+  char *hex = bn ? BN_bn2hex(bn) : NULL;
+  char *serial = strdup(hex ? hex : "");
+  assert(serial);
+  OPENSSL_free(hex);
+  BN_free(bn);
+  return serial;
+}
+
+
+//! check peer chain certs against local revoked set
+//! \param chain peer chain
+//! \return 1 if any of them is revoked, 0 otherwise
+static int ssl_chain_revoked(STACK_OF(X509) *chain) {
+  int i, found = 0;
+  for (i = 0; ! found && i < sk_X509_num(chain); i ++) {
+    X509 *cert = sk_X509_value(chain, i);
+    char *serial = ssl_cert_serial(cert);
+    found = revoked_find(X509_issuer_name_hash(cert), serial);
+    free(serial);
+  }
+  return found;
+}
+
+
+//! calculate peer chain fingerprint: sha256 over sha256 digests of chain certs
+//! \param chain peer chain (leaf first)
+//! \param fp where to store the fingerprint
+static void ssl_chain_fp(STACK_OF(X509) *chain, uint8_t *fp) {
+  EVP_MD_CTX *md = EVP_MD_CTX_new();
+  assert(md);
+  EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+  int i;
+  for (i = 0; i < sk_X509_num(chain); i ++) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    X509_digest(sk_X509_value(chain, i), EVP_sha256(), digest, &len);
+    EVP_DigestUpdate(md, digest, len);
+  }
+  EVP_DigestFinal_ex(md, fp, NULL);
+  EVP_MD_CTX_free(md);
+}
+
+
+//! verify peer chain or take its result from persistent cache
+//! \param ctx X509 store context with peer chain
+//! \param job job the chain is verified for
+//! \return verification result
+static long ssl_chain_verify(X509_STORE_CTX *ctx, struct ssl_job *job) {
+
+  // no persistent cache - just verify it
+  if (! config.ssl_cache_file) {
+    X509_verify_cert(ctx);
+    return X509_STORE_CTX_get_error(ctx);
+  }
+
+  time_t now = time(NULL);
+  uint8_t fp[SSLCACHE_FP_SIZE];
+  long res;
+
+  // the same chain was already verified (maybe for another host)
+  ssl_chain_fp(X509_STORE_CTX_get0_untrusted(ctx), fp);
+  if (sslcache_chain_get(fp, &res)) {
+    wlog(L_DEBUG5, "ssl: using cached chain verification result for '%s:%u'", job->hostname, job->port);
+    X509_STORE_CTX_set_error(ctx, res);
+  } else {
+    X509_verify_cert(ctx);
+    res = X509_STORE_CTX_get_error(ctx);
+    // good chain result must not outlive its leaf cert
+    time_t expire = now + config.ssl_verify_ttl;
+    struct tm tm;
+    if (res == X509_V_OK && ASN1_TIME_to_tm(X509_get0_notAfter(X509_STORE_CTX_get0_cert(ctx)), &tm) && timegm(&tm) < expire)
+      expire = timegm(&tm);
+    sslcache_chain_put(fp, res, expire);
+  }
+
+  // remember which chain this host presents
+  sslcache_host_put(job->hostname, job->port, fp, now + config.ssl_verify_ttl);
+
+  return res;
+}
+
+
+//! peer chain verification callback, called as soon as server Certificate
+//! message is processed; the result is stored in connection attempt
+//! and in 'cert only' mode the handshake is aborted right here: we've got
+//! all we need, no reason to spend cycles on key exchange and Finished
+//! (unless OCSP status is wanted: it comes later, see ssl_ocsp_verify())
+//! \param ctx X509 store context with peer chain
+//! \param arg unused
+//! \return 1 to go on with the handshake, 0 to abort it
+static int ssl_cert_verify(X509_STORE_CTX *ctx, void *arg) {
+
+  SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+  struct ssl_conn *conn = SSL_get_app_data(ssl);
+
+  // verify the chain (errors are recorded in ctx, not returned)
+  conn->verify_res = ssl_chain_verify(ctx, conn->job);
+  conn->verified = 1;
+
+  // locally known revoked cert overrides any result
+  if (config.ssl_revoked && ssl_chain_revoked(X509_STORE_CTX_get0_untrusted(ctx))) {
+    wlog(L_DEBUG3, "ssl: '%s:%u' chain has locally revoked cert", conn->job->hostname, conn->job->port);
+    conn->verify_res = X509_V_ERR_CERT_REVOKED;
+    X509_STORE_CTX_set_error(ctx, conn->verify_res);
+  }
+
+  return ! config.ssl_cert_only || config.ssl_ocsp;
+}
+
+
+//! compare func to find cert in OCSP cache tree
+static int ocsp_cmp(const void *e1, const void *e2) {
+  const struct ocsp_entry *o1 = e1, *o2 = e2;
+  if (o1->issuer != o2->issuer)
+    return o1->issuer < o2->issuer ? -1 : 1;
+  return strcmp(o1->serial, o2->serial);
+}
+
+
+//! OCSP cache prune state
+struct ocsp_prune {
+  struct ocsp_entry **live;  //!< entries kept (in cache order)
+  int n;                     //!< number of entries kept
+  time_t now;                //!< current time
+};
+
+//! free OCSP cache entry
+static void ocsp_entry_free(struct ocsp_entry *entry) {
+  free(entry->serial);
+  free(entry);
+}
+
+//! collect unexpired OCSP cache entries, free others
+static void ocsp_prune_collect(void *key, void *arg) {
+  struct ocsp_entry *entry = key;
+  struct ocsp_prune *pr = arg;
+  if (entry->expire > pr->now)
+    pr->live[pr->n ++] = entry;
+  else
+    ocsp_entry_free(entry);
+}
+
+//! compare OCSP cache entries pointers by expiration time
+static int ocsp_cmp_expire(const void *e1, const void *e2) {
+  const struct ocsp_entry *o1 = *(struct ocsp_entry **)e1, *o2 = *(struct ocsp_entry **)e2;
+  return o1->expire < o2->expire ? -1 : o1->expire > o2->expire;
+}
+
+//! compare OCSP cache entries pointers by cert
+static int ocsp_cmp_ptr(const void *e1, const void *e2) {
+  return ocsp_cmp(*(struct ocsp_entry **)e1, *(struct ocsp_entry **)e2);
+}
+
+//! insert ordered entries into OCSP cache tree, medians first
+//! (so the tree stays balanced)
+static void ocsp_cache_insert(struct ocsp_entry **entries, int n) {
+  if (n <= 0)
+    return;
+  tree_search(entries[n / 2], &ocsp_cache, ocsp_cmp);
+  ocsp_cache_insert(entries, n / 2);
+  ocsp_cache_insert(entries + n / 2 + 1, n - n / 2 - 1);
+}
 
-  wlog(L_DEBUG5, "ssl: connecting to '%s:%d' (%s)", hostname, port, inet_ntoa(*((struct in_addr*)&host_ip)));
+//! drop expired entries from OCSP cache, and if it is still full
+//! the half of them which expire sooner
+//! (caller holds ocsp_mutex)
+//! \param now current time
+static void ocsp_cache_prune(time_t now) {
 
-  // create a socket
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0) {
-    wlog(L_ERR, "ssl: failed to create socket: %s", strerror(errno));
-    goto OUCH;
+  struct ocsp_prune pr = {calloc(ocsp_cache_num + 1, sizeof(struct ocsp_entry *)), 0, now};
+  assert(pr.live);
+
+  tree_walk(ocsp_cache, ocsp_prune_collect, &pr);
+  tree_free(ocsp_cache, NULL);
+  ocsp_cache = NULL;
+
+  if (pr.n >= SSL_OCSP_CACHE_SIZE / 2) {
+    qsort(pr.live, pr.n, sizeof(struct ocsp_entry *), ocsp_cmp_expire);
+    int i, drop = pr.n / 2;
+    for (i = 0; i < drop; i ++)
+      ocsp_entry_free(pr.live[i]);
+    memmove(pr.live, pr.live + drop, (pr.n - drop) * sizeof(struct ocsp_entry *));
+    pr.n -= drop;
+    qsort(pr.live, pr.n, sizeof(struct ocsp_entry *), ocsp_cmp_ptr);
+  }
+
+  wlog(L_DEBUG3, "ssl: OCSP cache pruned: %d of %d statuses kept", pr.n, ocsp_cache_num);
+
+  ocsp_cache_insert(pr.live, pr.n);
+  ocsp_cache_num = pr.n;
+  free(pr.live);
+}
+
+
+//! store parsed OCSP status in the cache (existing entry is updated)
+//! (caller holds ocsp_mutex)
+//! \param key cert issuer, serial and its status
+//! \param now current time
+static void ocsp_cache_put(struct ocsp_entry *key, time_t now) {
+
+  struct ocsp_entry *found = tree_find(key, &ocsp_cache, ocsp_cmp);
+  if (found) {
+    found->status = key->status;
+    found->expire = key->expire;
+    return;
+  }
+
+  if (ocsp_cache_num >= SSL_OCSP_CACHE_SIZE)
+    ocsp_cache_prune(now);
+
+  struct ocsp_entry *entry = malloc(sizeof(struct ocsp_entry));
+  assert(entry);
+  *entry = *key;
+  entry->serial = strdup(key->serial);
+  assert(entry->serial);
+
+  tree_search(entry, &ocsp_cache, ocsp_cmp);
+  ocsp_cache_num ++;
+}
+
+
+//! find cert issuer: in peer chain or among trusted certs
+//! \param ssl SSL connection
+//! \param cert cert to find issuer for
+//! \return issuer cert (to be X509_free()d) or NULL
+static X509 *ssl_cert_issuer(SSL *ssl, X509 *cert) {
+
+  STACK_OF(X509) *chain = SSL_get_peer_cert_chain(ssl);
+  int i;
+  for (i = 0; i < sk_X509_num(chain); i ++) {
+    X509 *c = sk_X509_value(chain, i);
+    if (c != cert && X509_check_issued(c, cert) == X509_V_OK) {
+      X509_up_ref(c);
+      return c;
+    }
+  }
+
+  // issuer is trusted root not sent by peer
+  X509 *issuer = NULL;
+  X509_STORE_CTX *sctx = X509_STORE_CTX_new();
+  if (sctx && X509_STORE_CTX_init(sctx, SSL_CTX_get_cert_store(ssl_ctx), cert, NULL))
+    X509_STORE_CTX_get1_issuer(&issuer, sctx, cert);
+  X509_STORE_CTX_free(sctx);
+
+  return issuer;
+}
+
+
+//! parse and verify stapled OCSP response
+//! \param ssl SSL connection
+//! \param cert peer cert
+//! \param expire where to store response expiration time
+//! \return cert OCSP status
+static int ssl_ocsp_parse(SSL *ssl, X509 *cert, time_t *expire) {
+
+  const unsigned char *p = NULL;
+  long len = SSL_get_tlsext_status_ocsp_resp(ssl, &p);
+  if (len <= 0 || ! p)
+    return SSL_OCSP_NONE;
+
+  int status = SSL_OCSP_NONE;
+  OCSP_RESPONSE *resp = d2i_OCSP_RESPONSE(NULL, &p, len);
+  OCSP_BASICRESP *bs = NULL;
+  OCSP_CERTID *id = NULL;
+  X509 *issuer = NULL;
+
+  // response must be signed by trusted responder and be about this very cert
+  if (resp &&
+      OCSP_response_status(resp) == OCSP_RESPONSE_STATUS_SUCCESSFUL &&
+      (bs = OCSP_response_get1_basic(resp)) &&
+      OCSP_basic_verify(bs, SSL_get_peer_cert_chain(ssl), SSL_CTX_get_cert_store(ssl_ctx), 0) > 0 &&
+      (issuer = ssl_cert_issuer(ssl, cert)) &&
+      (id = OCSP_cert_to_id(NULL, cert, issuer))) {
+
+    int st, reason;
+    ASN1_GENERALIZEDTIME *rev, *thisupd, *nextupd;
+    if (OCSP_resp_find_status(bs, id, &st, &reason, &rev, &thisupd, &nextupd) &&
+        OCSP_check_validity(thisupd, nextupd, SSL_OCSP_MAX_SKEW, -1)) {
+
+      status = st == V_OCSP_CERTSTATUS_GOOD ? SSL_OCSP_GOOD :
+               st == V_OCSP_CERTSTATUS_REVOKED ? SSL_OCSP_REVOKED : SSL_OCSP_UNKNOWN;
+
+      // response is valid until its nextUpdate (if any)
+      struct tm tm;
+      *expire = time(NULL) + config.ssl_verify_ttl;
+      if (nextupd && ASN1_TIME_to_tm(nextupd, &tm))
+        *expire = timegm(&tm);
+    }
+  }
+
+  OCSP_CERTID_free(id);
+  X509_free(issuer);
+  OCSP_BASICRESP_free(bs);
+  OCSP_RESPONSE_free(resp);
+
+  return status;
+}
+
+
+//! OCSP status callback, called after peer chain verification when server
+//! has sent (or not) its stapled OCSP response; known cert statuses are taken
+//! from the cache, so a response is parsed once per its lifetime;
+//! in 'cert only' mode the handshake is aborted here
+//! \param ssl SSL connection
+//! \param arg unused
+//! \return 1 to go on with the handshake, 0 to abort it
+static int ssl_ocsp_verify(SSL *ssl, void *arg) {
+
+  struct ssl_conn *conn = SSL_get_app_data(ssl);
+  X509 *cert = SSL_get_peer_certificate(ssl);
+  if (! cert)
+    return 1;
+
+  time_t now = time(NULL);
+
+  // cert is identified by its issuer and serial
+  struct ocsp_entry key = {X509_issuer_name_hash(cert), ssl_cert_serial(cert), SSL_OCSP_NONE, 0};
+
+  // cert status is known already?
+  pthread_mutex_lock(&ocsp_mutex);
+  struct ocsp_entry *entry = tree_find(&key, &ocsp_cache, ocsp_cmp);
+  int cached = entry && entry->expire > now;
+  if (cached)
+    conn->ocsp = entry->status;
+  pthread_mutex_unlock(&ocsp_mutex);
+
+  // no: check stapled response (only parsed ones are cached)
+  if (! cached) {
+    conn->ocsp = ssl_ocsp_parse(ssl, cert, &key.expire);
+    if (conn->ocsp != SSL_OCSP_NONE) {
+      key.status = conn->ocsp;
+      pthread_mutex_lock(&ocsp_mutex);
+      ocsp_cache_put(&key, now);
+      pthread_mutex_unlock(&ocsp_mutex);
+    }
+    // failed verifications must not confuse handshake error reporting
+    ERR_clear_error();
+  }
+
+  wlog(L_DEBUG3, "ssl: OCSP status for '%s:%u' = %s%s",
+       conn->job->hostname, conn->job->port, ssl_ocsp_str(conn->ocsp), cached ? " (cached)" : "");
+
+  free(key.serial);
+  X509_free(cert);
+
+  return ! (config.ssl_cert_only && conn->verified);
+}
+
+
+//! move submitted jobs into active list (as long as limits allow)
+static void ssl_jobs_admit(void) {
+
+  while (ssl_active_num < config.ssl_max_handshakes) {
+
+    // get next submitted job
+    pthread_mutex_lock(&ssl_jobs_mutex);
+    struct ssl_job *job = ssl_queue_head;
+    if (job) {
+      ssl_queue_head = job->next;
+      if (! ssl_queue_head)
+        ssl_queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&ssl_jobs_mutex);
+
+    if (! job)
+      break;
+
+    // it might have expired just now
+    if (ssl_now_ms() >= job->deadline) {
+      wlog(L_WARN, "ssl: connection to '%s:%u' timed out waiting for a handshake slot", job->hostname, job->port);
+      ssl_job_finish(job, -1);
+      continue;
+    }
+
+    // make it active
+    job->next = ssl_active;
+    ssl_active = job;
+    ssl_active_num ++;
+
+    // and start first connection attempt
+    if (ssl_conn_start(job)) {
+      wlog(L_WARN, "ssl: connection to '%s:%u' failed", job->hostname, job->port);
+      ssl_job_finish(job, -1);
+    }
+  }
+}
+
+
+//! check jobs timers: expire timed out jobs (queued ones too) and start
+//! racing attempts
+//! \param now current monotonic time
+//! \return msecs until next timer event or -1 if no timers
+static int ssl_jobs_timers(long long now) {
+
+  long long next = -1;
+
+  // queued jobs wait for a free handshake slot, but not past their
+  // deadline; all jobs have the same timeout, so the queue is in
+  // deadline order and only its head is to be checked
+  struct ssl_job *job, *expired = NULL;
+  pthread_mutex_lock(&ssl_jobs_mutex);
+  while ((job = ssl_queue_head) && now >= job->deadline) {
+    ssl_queue_head = job->next;
+    if (! ssl_queue_head)
+      ssl_queue_tail = NULL;
+    job->next = expired;
+    expired = job;
   }
+  if (ssl_queue_head)
+    next = ssl_queue_head->deadline;
+  pthread_mutex_unlock(&ssl_jobs_mutex);
 
-  // put the socket in non-blocking mode
-  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+  while (expired) {
+    job = expired;
+    expired = job->next;
+    wlog(L_WARN, "ssl: connection to '%s:%u' timed out waiting for a handshake slot", job->hostname, job->port);
+    ssl_job_finish(job, -1);
+  }
 
-  // prepare to connect
-  struct sockaddr_in *haddr = calloc(1, sizeof(struct sockaddr_in));
-  assert(haddr);
-  haddr->sin_family=AF_INET;
-  haddr->sin_port=htons(port);
-  haddr->sin_addr.s_addr = host_ip;
+  job = ssl_active;
+  while (job) {
 
-  // connect to remote host (ASYNC!)
-  int conn_err = connect(sockfd, (struct sockaddr *)haddr, (socklen_t)sizeof(struct sockaddr));
-  if (conn_err < 0) {
+    struct ssl_job *next_job = job->next;
 
-    // prepare select() params
-    fd_set fdset;
-    FD_ZERO(&fdset);
-    FD_SET(sockfd, &fdset);
-    struct timeval ts = {.tv_sec = config.ssl_timeout, .tv_usec = 0};
+    // timed out
+    if (now >= job->deadline) {
+      wlog(L_WARN, "ssl: connection to '%s:%u' timed out", job->hostname, job->port);
+      ssl_job_finish(job, -1);
+      job = next_job;
+      continue;
+    }
 
-     // wait for the socket to become writable
-    int sel_err = select(sockfd + 1, NULL, &fdset, NULL, &ts);
+    // time to start next racing attempt
+    if (job->next_ip < job->n_ips && now >= job->next_try)
+      ssl_conn_start(job);
 
-    // failure
-    if (sel_err < 0)
-      wlog(L_ERR, "ssl: pselect() failed: %s", strerror(errno));
-    // timeout
-    else if (sel_err == 0)
-      wlog(L_WARN, "ssl: connection to '%s:%d' timed out", hostname, port);
-    
-    // to be sure!
-    conn_err = connect(sockfd, (struct sockaddr *)haddr, (socklen_t)sizeof(struct sockaddr));
-    
-    wlog(L_DEBUG9, "ssl: conn vars selerr=%d conerr=%d errno=%d", sel_err, conn_err, errno);
+    // find nearest timer
+    if (next < 0 || job->deadline < next)
+      next = job->deadline;
+    if (job->next_ip < job->n_ips && job->next_try < next)
+      next = job->next_try;
 
+    job = next_job;
   }
 
-  if (conn_err < 0) {
-    wlog(L_WARN, "ssl: connection to '%s:%d' failed: %s", hostname, port, strerror(errno));
-    goto OUCH;
-  } else
-    wlog(L_DEBUG1, "ssl: connected!");
+  return next < 0 ? -1 : (int)(next - now);
+}
+
+
+//! SSL engine thread: drives all verifications from single epoll loop
+static void *ssl_engine(void *arg) {
 
-  // restore socket blocking state
-  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & ~O_NONBLOCK);
+  struct epoll_event events[SSL_ENGINE_MAX_EVENTS];
+
+  while (1) {
+
+    // take new jobs and process timers
+    ssl_jobs_admit();
+    int timeout = ssl_jobs_timers(ssl_now_ms());
+
+    // wait for i/o
+    int n = epoll_wait(ssl_epfd, events, SSL_ENGINE_MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno != EINTR)
+        wlog(L_ERR, "ssl: epoll_wait() failed: %s", strerror(errno));
+      continue;
+    }
+
+    int i;
+    for (i = 0; i < n; i ++) {
+
+      // new jobs were submitted
+      if (! events[i].data.ptr) {
+        uint64_t cnt;
+        ssize_t len;
+        while ((len = read(ssl_evfd, &cnt, sizeof(cnt))) < 0 && errno == EINTR);
+        if (len < 0 && errno != EAGAIN)
+          wlog(L_ERR, "ssl: failed to read engine wakeup descriptor: %s", strerror(errno));
+        continue;
+      }
+
+      ssl_conn_event(events[i].data.ptr);
+    }
+
+    // now it is safe to free closed connections
+    while (ssl_dead) {
+      struct ssl_conn *conn = ssl_dead;
+      ssl_dead = conn->next;
+      free(conn);
+    }
+
+  }
 
-  // create new SSL context
-  ssl_ctx = SSL_CTX_new(method);
+  return NULL;
+}
+
+#endif // USE_SSL
+
+
+//! init SSL engine
+//! \return 0 if ok
+int ssl_init(void) {
+
+#ifdef USE_SSL
+  // prepare SSL engine
+  OpenSSL_add_all_algorithms();
+  SSL_load_error_strings();
+
+  // init SSL engine
+  SSL_library_init();
+
+  // create shared SSL context
+  ssl_ctx = SSL_CTX_new(SSLv23_client_method());
   if (! ssl_ctx) {
     wlog(L_ERR, "ssl: SSL_CTX_new() failed");
-    goto OUCH;
+    return 1;
   }
 
   // init SSL context, load CA bundle, etc
   SSL_CTX_set_default_verify_paths(ssl_ctx);
-  //! \todo move CA bundle loading into ssl_init()
-  SSL_CTX_load_verify_locations(ssl_ctx, config.ssl_ca_file, NULL);
-  SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+  if (! SSL_CTX_load_verify_locations(ssl_ctx, config.ssl_ca_file, NULL))
+    wlog(L_WARN, "ssl: failed to load CA bundle '%s'", config.ssl_ca_file);
   SSL_CTX_set_verify_depth(ssl_ctx, 10);
 
+  // peer chain is verified by our callback; in 'cert only' mode it aborts
+  // the handshake, which is honoured in SSL_VERIFY_PEER mode only
+  SSL_CTX_set_cert_verify_callback(ssl_ctx, ssl_cert_verify, NULL);
+  SSL_CTX_set_verify(ssl_ctx, config.ssl_cert_only ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+
+  // stapled OCSP responses are checked by our callback too
+  if (config.ssl_ocsp)
+    SSL_CTX_set_tlsext_status_cb(ssl_ctx, ssl_ocsp_verify);
+
   SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2);
 
   SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
-  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
 
-  // create new SSL connection state obj
-  ssl = SSL_new(ssl_ctx);
+  // create engine descriptors
+  ssl_epfd = epoll_create1(EPOLL_CLOEXEC);
+  ssl_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ssl_epfd < 0 || ssl_evfd < 0) {
+    wlog(L_ERR, "ssl: failed to create engine descriptors: %s", strerror(errno));
+    return 1;
+  }
 
-  // set hostname (tlsext mode)
-  SSL_set_tlsext_host_name(ssl, hostname);
- 
-  // bind connected socket to SSL conn object
-  SSL_set_fd(ssl, sockfd);
+  // wakeup descriptor is marked with NULL data pointer
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(ssl_epfd, EPOLL_CTL_ADD, ssl_evfd, &ev) < 0) {
+    wlog(L_ERR, "ssl: epoll_ctl() failed: %s", strerror(errno));
+    return 1;
+  }
 
-  // connect to remote host via SSL
-  if (SSL_connect(ssl) != 1) {
-    wlog(L_WARN, "ssl: SSL connection to '%s:%d' failed", hostname, port);
-    goto OUCH;
+  // open persistent results cache
+  if (sslcache_init())
+    wlog(L_WARN, "ssl: persistent cache is disabled");
+
+  // load local revoked certs set
+  if (revoked_init()) {
+    wlog(L_ERR, "ssl: failed to load revoked certs set");
+    return 1;
   }
 
-  // get cert verification result
-  ssl_verify_res = SSL_get_verify_result(ssl);
-  wlog(L_DEBUG3, "ssl: cert verification for '%s:%d' = %d", hostname, port, ssl_verify_res); 
+  // start the engine
+  pthread_t thread_id;
+  pthread_attr_t thread_attr;
+  pthread_attr_init(&thread_attr);
+  pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread_id, &thread_attr, ssl_engine, NULL)) {
+    wlog(L_ERR, "ssl: failed to start engine thread");
+    return 1;
+  }
+  pthread_attr_destroy(&thread_attr);
+#endif
 
+  // done
+  return 0;
+}
 
-OUCH:
-  // cleanups
-  if (ssl)
-    SSL_free(ssl);
-  if (ssl_ctx)
-    SSL_CTX_free(ssl_ctx);
-  free(haddr);
-  if (sockfd >= 0)
-    close(sockfd);
 
 
+//! connect to remote host, get its SSL cert, examine it
+//! and return cert verification code (see /usr/include/openssl/x509_vfy.h)
+//! the work is done by SSL engine thread, caller just waits for the result;
+//! all resolved host ips are raced, first connected one wins
+//! \param hostname remote host to connect
+//! \param port remote host port
+//! \param timeout whole verification timeout (connect + handshake)
+//! \param ocsp where to store host cert OCSP status (may be NULL)
+//! \return ssl verification code or -1 on error
+int ssl_verify_host(char *hostname, unsigned port, int timeout, int *ocsp) {
+
+  if (ocsp)
+    *ocsp = SSL_OCSP_NONE;
+
+#ifdef USE_SSL
+
+  // check port validness
+  port = (port <= 0 || port >= 0xFFFF) ? 443 : port;
+
+  // the host was verified before (maybe by previous helper run):
+  // take the result for the chain it presented then
+  // (not if revocation status is wanted: it can't be told without the handshake)
+  uint8_t fp[SSLCACHE_FP_SIZE];
+  long cached_res;
+  if (! config.ssl_ocsp && ! config.ssl_revoked && sslcache_host_get(hostname, port, fp) && sslcache_chain_get(fp, &cached_res)) {
+    wlog(L_DEBUG5, "ssl: using persistently cached result for '%s:%u'", hostname, port);
+    return cached_res;
+  }
+
+  // prepare new job
+  struct ssl_job *job = calloc(1, sizeof(struct ssl_job));
+  assert(job);
+
+  // resolve the hostname (all its ips will be tried)
+  job->n_ips = resolve_host(hostname, job->ips, MAX_RESOLVED_IPS);
+  if (job->n_ips < 1) {
+    wlog(L_WARN, "ssl: failed to resolve host '%s'", hostname);
+    free(job);
+    return -1;
+  }
+
+  // engine wants ips in network byte order
+  int i;
+  for (i = 0; i < job->n_ips; i ++)
+    job->ips[i] = htonl(job->ips[i]);
+
+  job->port = port;
+  job->hostname = hostname;
+  job->deadline = ssl_now_ms() + (long long)timeout * 1000;
+  job->result = -1;
+  pthread_cond_init(&job->cond, NULL);
+
+  // submit the job
+  pthread_mutex_lock(&ssl_jobs_mutex);
+  if (ssl_queue_tail)
+    ssl_queue_tail->next = job;
+  else
+    ssl_queue_head = job;
+  ssl_queue_tail = job;
+  pthread_mutex_unlock(&ssl_jobs_mutex);
+
+  // wake up the engine (EAGAIN: the counter is full, so it is being woken up)
+  uint64_t one = 1;
+  ssize_t len;
+  while ((len = write(ssl_evfd, &one, sizeof(one))) < 0 && errno == EINTR);
+  if (len < 0 && errno != EAGAIN)
+    wlog(L_ERR, "ssl: failed to wake up engine: %s", strerror(errno));
+
+  // wait for the result (engine finishes every job, queued or active, by
+  // its deadline; it wakes up for queued ones' deadlines too)
+  pthread_mutex_lock(&ssl_jobs_mutex);
+  while (! job->done)
+    pthread_cond_wait(&job->cond, &ssl_jobs_mutex);
+  pthread_mutex_unlock(&ssl_jobs_mutex);
+
+  long ssl_verify_res = job->result;
+  if (ocsp)
+    *ocsp = job->ocsp;
+
+  // cleanups
+  pthread_cond_destroy(&job->cond);
+  free(job);
+
   // all done, return the result
   return ssl_verify_res;
 #else
@@ -180,4 +1043,46 @@ OUCH:
 }
 
 
+//! get OCSP status name (to be used in notes)
+//! \param status OCSP status
+//! \return status name
+const char *ssl_ocsp_str(int status) {
+  switch (status) {
+    case SSL_OCSP_GOOD:
+      return "good";
+    case SSL_OCSP_REVOKED:
+      return "revoked";
+    case SSL_OCSP_UNKNOWN:
+      return "unknown";
+    default:
+      return "none";
+  }
+}
+
+
+#ifdef USE_SSL
+//! add OCSP cache entry to memory usage
+static void ssl_mem_ocsp(void *key, void *arg) {
+  struct ocsp_entry *entry = key;
+  mem_add(arg, entry, sizeof(struct ocsp_entry));
+  mem_add_str(arg, entry->serial);
+}
+#endif
+
+//! report OCSP cache memory usage
+//! \param func report function
+//! \param arg report function argument
+void ssl_mem(mem_report_f func, void *arg) {
+#ifdef USE_SSL
+  struct mem_usage entries = {0,}, nodes = {0,};
+
+  pthread_mutex_lock(&ocsp_mutex);
+  tree_walk(ocsp_cache, ssl_mem_ocsp, &entries);
+  mem_add_nodes(&nodes, ocsp_cache, mem_tree_keys(ocsp_cache));
+  pthread_mutex_unlock(&ocsp_mutex);
+
+  func("ocsp_cache", "entries", &entries, arg);
+  func("ocsp_cache", "nodes", &nodes, arg);
+#endif
+}
 
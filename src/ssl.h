@@ -5,9 +5,29 @@
 #define __ACLH_SSL_H__
 
 #define SSL_ERROR_NOTE_TMPL  "ssl_error=%d"
+#define SSL_OCSP_NOTE_TMPL   " ssl_ocsp=%s"
+
+//! host cert OCSP (revocation) status
+enum ssl_ocsp_states {
+  SSL_OCSP_NONE,         //!< no valid stapled response and nothing cached
+  SSL_OCSP_GOOD,         //!< cert is not revoked
+  SSL_OCSP_REVOKED,      //!< cert is revoked
+  SSL_OCSP_UNKNOWN,      //!< responder doesn't know the cert
+};
+
+//! max allowed clock skew for OCSP response validity check (secs)
+#define SSL_OCSP_MAX_SKEW  300
+
+//! max OCSP statuses to cache (expired ones and then the half expiring
+//! sooner are dropped when it is reached)
+#define SSL_OCSP_CACHE_SIZE  16384
+
+//! max epoll events SSL engine handles at once
+#define SSL_ENGINE_MAX_EVENTS  64
 
 extern int ssl_init(void);
-extern int ssl_verify_host(char *, unsigned, int);
+extern int ssl_verify_host(char *, unsigned, int, int *);
+extern const char *ssl_ocsp_str(int);
 
 #endif //__ACLH_SSL_H__
 
@@ -0,0 +1,285 @@
+/** \file */
+
+
+#include "acl-helper.h"
+#include "log.h"
+#include "conf.h"
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mem.h"
+#include "sslcache.h"
+
+
+// persistent SSL verification results cache: two open addressing tables
+// in one mmap()ed file, so they survive restarts and may be shared by
+// several helper processes:
+//  - chain fingerprint -> verification result
+//  - host:port hash -> fingerprint of chain the host presented
+
+//! mapped cache file (NULL if cache is disabled)
+static struct sslcache_hdr *cache;
+
+//! tables inside mapped file
+static struct sslcache_chain *chains;
+static struct sslcache_host *hosts;
+
+//! slot index mask
+static uint32_t slots_mask;
+
+//! mutex for cache updates within this process
+static pthread_mutex_t sslcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//! FNV-1a hash of a memory block
+//! \param hash initial hash value
+//! \param data data to hash
+//! \param len data length
+//! \return hash value
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+  const uint8_t *p = data;
+  while (len --) {
+    hash ^= *p ++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+
+//! checksum of chain entry (everything but 'sum' field)
+static uint32_t chain_sum(struct sslcache_chain *e) {
+  return (uint32_t)fnv1a(FNV1A_INIT, e, offsetof(struct sslcache_chain, sum));
+}
+
+//! checksum of host entry (everything but 'sum' field)
+static uint32_t host_sum(struct sslcache_host *e) {
+  return (uint32_t)fnv1a(FNV1A_INIT, e, offsetof(struct sslcache_host, sum));
+}
+
+
+//! hash 'host:port' into host table key
+static uint64_t host_key(char *hostname, unsigned port) {
+  uint64_t hash = FNV1A_INIT;
+  for (; *hostname; hostname ++) {
+    uint8_t c = tolower(*hostname);
+    hash = fnv1a(hash, &c, 1);
+  }
+  return fnv1a(hash, &port, sizeof(port));
+}
+
+
+//! open (or create) and map cache file
+//! \return 0 if ok (or cache is disabled), !0 on error
+int sslcache_init(void) {
+
+  // cache is disabled
+  if (! config.ssl_cache_file)
+    return 0;
+
+  uint32_t slots = config.ssl_cache_slots;
+  size_t size = sizeof(struct sslcache_hdr) +
+                slots * (sizeof(struct sslcache_chain) + sizeof(struct sslcache_host));
+
+  int fd = open(config.ssl_cache_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    wlog(L_ERR, "sslcache: failed to open '%s': %s", config.ssl_cache_file, strerror(errno));
+    return 1;
+  }
+
+  // check existing file: it must be of our version and size, recreate it otherwise
+  struct sslcache_hdr hdr = {{0,},};
+  struct stat st;
+  if (fstat(fd, &st) ||
+      st.st_size != size ||
+      pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      memcmp(hdr.magic, SSLCACHE_MAGIC, sizeof(hdr.magic)) ||
+      hdr.version != SSLCACHE_VERSION ||
+      hdr.slots != slots) {
+
+    wlog(L_INFO, "sslcache: (re)creating cache file '%s' with %u slots", config.ssl_cache_file, slots);
+
+    memcpy(hdr.magic, SSLCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SSLCACHE_VERSION;
+    hdr.slots = slots;
+
+    if (ftruncate(fd, 0) || ftruncate(fd, size) || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+      wlog(L_ERR, "sslcache: failed to init '%s': %s", config.ssl_cache_file, strerror(errno));
+      close(fd);
+      return 1;
+    }
+  }
+
+  // map it
+  cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (cache == MAP_FAILED) {
+    wlog(L_ERR, "sslcache: mmap(%s) failed: %s", config.ssl_cache_file, strerror(errno));
+    cache = NULL;
+    return 1;
+  }
+
+  chains = (struct sslcache_chain *)(cache + 1);
+  hosts = (struct sslcache_host *)(chains + slots);
+  slots_mask = slots - 1;
+
+  wlog(L_INFO, "sslcache: using cache file '%s'", config.ssl_cache_file);
+
+  return 0;
+}
+
+
+//! find cached chain verification result
+//! \param fp chain fingerprint
+//! \param result where to store found result
+//! \return 1 if found, 0 otherwise
+int sslcache_chain_get(uint8_t *fp, long *result) {
+
+  if (! cache)
+    return 0;
+
+  time_t now = time(NULL);
+  uint32_t idx;
+  memcpy(&idx, fp, sizeof(idx));
+  int i, found = 0;
+
+  pthread_mutex_lock(&sslcache_mutex);
+  for (i = 0; i < SSLCACHE_MAX_PROBES; i ++) {
+    struct sslcache_chain e = chains[(idx + i) & slots_mask];
+    if (e.expire > now && ! memcmp(e.fp, fp, SSLCACHE_FP_SIZE) && e.sum == chain_sum(&e)) {
+      *result = e.result;
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sslcache_mutex);
+
+  return found;
+}
+
+
+//! store chain verification result
+//! \param fp chain fingerprint
+//! \param result verification result
+//! \param expire entry expiration time
+void sslcache_chain_put(uint8_t *fp, long result, time_t expire) {
+
+  if (! cache)
+    return;
+
+  time_t now = time(NULL);
+  uint32_t idx;
+  memcpy(&idx, fp, sizeof(idx));
+  int i;
+
+  pthread_mutex_lock(&sslcache_mutex);
+
+  // reuse entry with the same key, free/expired slot, or the one expiring first
+  struct sslcache_chain *victim = NULL;
+  for (i = 0; i < SSLCACHE_MAX_PROBES; i ++) {
+    struct sslcache_chain *e = &chains[(idx + i) & slots_mask];
+    if (! memcmp(e->fp, fp, SSLCACHE_FP_SIZE) || e->expire <= now) {
+      victim = e;
+      break;
+    }
+    if (! victim || e->expire < victim->expire)
+      victim = e;
+  }
+
+  memcpy(victim->fp, fp, SSLCACHE_FP_SIZE);
+  victim->expire = expire;
+  victim->result = result;
+  victim->sum = chain_sum(victim);
+
+  pthread_mutex_unlock(&sslcache_mutex);
+}
+
+
+//! find fingerprint of chain host presented last time
+//! \param hostname host name
+//! \param port host port
+//! \param fp where to store found fingerprint
+//! \return 1 if found, 0 otherwise
+int sslcache_host_get(char *hostname, unsigned port, uint8_t *fp) {
+
+  if (! cache)
+    return 0;
+
+  time_t now = time(NULL);
+  uint64_t key = host_key(hostname, port);
+  int i, found = 0;
+
+  pthread_mutex_lock(&sslcache_mutex);
+  for (i = 0; i < SSLCACHE_MAX_PROBES; i ++) {
+    struct sslcache_host e = hosts[(key + i) & slots_mask];
+    if (e.expire > now && e.key == key && e.sum == host_sum(&e)) {
+      memcpy(fp, e.fp, SSLCACHE_FP_SIZE);
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sslcache_mutex);
+
+  return found;
+}
+
+
+//! remember fingerprint of chain host presented
+//! \param hostname host name
+//! \param port host port
+//! \param fp chain fingerprint
+//! \param expire entry expiration time
+void sslcache_host_put(char *hostname, unsigned port, uint8_t *fp, time_t expire) {
+
+  if (! cache)
+    return;
+
+  time_t now = time(NULL);
+  uint64_t key = host_key(hostname, port);
+  int i;
+
+  pthread_mutex_lock(&sslcache_mutex);
+
+  // reuse entry with the same key, free/expired slot, or the one expiring first
+  struct sslcache_host *victim = NULL;
+  for (i = 0; i < SSLCACHE_MAX_PROBES; i ++) {
+    struct sslcache_host *e = &hosts[(key + i) & slots_mask];
+    if (e->key == key || e->expire <= now) {
+      victim = e;
+      break;
+    }
+    if (! victim || e->expire < victim->expire)
+      victim = e;
+  }
+
+  victim->key = key;
+  victim->expire = expire;
+  memcpy(victim->fp, fp, SSLCACHE_FP_SIZE);
+  victim->pad = 0;
+  victim->sum = host_sum(victim);
+
+  pthread_mutex_unlock(&sslcache_mutex);
+}
+
+
+//! report persistent cache memory usage
+//! (it is a shared file mapping, so it is not all resident)
+//! \param func report function
+//! \param arg report function argument
+void sslcache_mem(mem_report_f func, void *arg) {
+
+  if (! cache)
+    return;
+
+  struct mem_usage map = {0,};
+  map.bytes = sizeof(struct sslcache_hdr) +
+              (size_t)cache->slots * (sizeof(struct sslcache_chain) + sizeof(struct sslcache_host));
+  map.objects = (size_t)cache->slots * 2;
+
+  func("ssl_persistent_cache", "mapped", &map, arg);
+}
+
@@ -0,0 +1,50 @@
+/** \file */
+
+
+#ifndef __ACLH_SSLCACHE_H__
+#define __ACLH_SSLCACHE_H__
+
+//! cache file magic and layout version
+#define SSLCACHE_MAGIC      "ACLHSSLC"
+#define SSLCACHE_VERSION    1
+
+//! chain fingerprint size (sha256)
+#define SSLCACHE_FP_SIZE    32
+
+//! max slots to probe on lookup/insert
+#define SSLCACHE_MAX_PROBES 8
+
+//! cache file header
+struct sslcache_hdr {
+  char magic[8];             //!< SSLCACHE_MAGIC
+  uint32_t version;          //!< SSLCACHE_VERSION
+  uint32_t slots;            //!< number of slots in each table (power of 2)
+};
+
+//! chain fingerprint -> verification result entry
+struct sslcache_chain {
+  uint8_t fp[SSLCACHE_FP_SIZE];  //!< chain fingerprint
+  int64_t expire;            //!< entry expiration time (0 if slot is empty)
+  int32_t result;            //!< chain verification result
+  uint32_t sum;              //!< entry checksum (detects torn writes by other processes)
+};
+
+//! host:port -> chain fingerprint entry
+struct sslcache_host {
+  uint64_t key;              //!< host:port hash
+  int64_t expire;            //!< entry expiration time (0 if slot is empty)
+  uint8_t fp[SSLCACHE_FP_SIZE];  //!< chain fingerprint host presented
+  uint32_t sum;              //!< entry checksum
+  uint32_t pad;              //!< unused
+};
+
+//! default number of slots in each cache table
+#define DEFAULT_SSLCACHE_SLOTS  65536
+
+extern int sslcache_init(void);
+extern int sslcache_chain_get(uint8_t *, long *);
+extern void sslcache_chain_put(uint8_t *, long, time_t);
+extern int sslcache_host_get(char *, unsigned, uint8_t *);
+extern void sslcache_host_put(char *, unsigned, uint8_t *, time_t);
+
+#endif //__ACLH_SSLCACHE_H__
@@ -0,0 +1,424 @@
+/** \file */
+
+
+#include "acl-helper.h"
+#include "log.h"
+#include "conf.h"
+#include "tree.h"
+#include "checker.h"
+#include "mem.h"
+
+#include <semaphore.h>
+
+#include "stats.h"
+
+
+// requests and checkers latency stats: every thread adds its samples
+// into one of STATS_SHARDS copies of counters (relaxed atomic adds,
+// threads rarely share a shard), the copies are merged only when stats
+// are exported: periodically into Prometheus text format file and into
+// the log on SIGUSR1 (records hit counters are dumped then too)
+
+//! series names: checker name and driver (NULL for fixed series)
+struct stats_name {
+  char *name;                //!< series name
+  char *driver;              //!< checker driver name
+};
+
+//! registered series names
+static struct stats_name *series_names;
+
+//! number of registered series
+static int series_num = STATS_FIXED;
+
+//! counters shards (NULL until stats_init())
+static struct stats_series *shards[STATS_SHARDS];
+
+//! shard of current thread
+static __thread int shard_idx = -1;
+
+//! next shard to give to a thread
+static int shard_next;
+
+//! stats dump request semaphore (posted from signal handler)
+static sem_t stats_sem;
+
+//! stats collection start time
+static time_t stats_start;
+
+
+//! register checker series (new ones before stats_init() only, reloaded
+//! checkers get series of their namesakes)
+//! \param name checker name
+//! \param driver checker driver name
+//! \return series index or -1 if it can't be registered
+int stats_series_add(char *name, char *driver) {
+  int i;
+  for (i = STATS_FIXED; i < series_num; i ++) {
+    if (! strcmp(series_names[i].name, name) && ! strcmp(series_names[i].driver, driver))
+      return i;
+  }
+  if (shards[0]) {
+    wlog(L_WARN, "no latency stats for new checker '%s' until restart", name);
+    return -1;
+  }
+  series_names = realloc(series_names, (series_num + 1) * sizeof(struct stats_name));
+  assert(series_names);
+  series_names[series_num].name = strdup(name);
+  assert(series_names[series_num].name);
+  series_names[series_num].driver = driver;
+  return series_num ++;
+}
+
+
+//! get monotonic time
+//! \return current time in nsecs
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+//! get histogram bucket for a latency: values below 2^STATS_SUB_BITS
+//! have own buckets, others are split into 2^STATS_SUB_BITS buckets
+//! per power of 2 (so bucket width is within 25% of its value)
+//! \param nsec latency
+//! \return bucket index
+static int stats_bucket(uint64_t nsec) {
+  if (nsec < (1 << STATS_SUB_BITS))
+    return nsec;
+  int msb = 63 - __builtin_clzll(nsec);
+  if (msb > STATS_MAX_BITS)
+    return STATS_BUCKETS - 1;
+  int sub = (nsec >> (msb - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1);
+  return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+
+//! get histogram bucket upper bound
+//! \param bucket bucket index
+//! \return first latency not in the bucket, nsecs
+static uint64_t stats_bucket_end(int bucket) {
+  if (bucket < (1 << STATS_SUB_BITS))
+    return bucket + 1;
+  int msb = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+  int sub = bucket & ((1 << STATS_SUB_BITS) - 1);
+  return (uint64_t)((1 << STATS_SUB_BITS) + sub + 1) << (msb - STATS_SUB_BITS);
+}
+
+
+//! add a sample
+//! \param idx series index
+//! \param hit 1 if checker matched
+//! \param nsec latency
+void stats_add(int idx, int hit, uint64_t nsec) {
+
+  if (idx < 0 || ! shards[0])
+    return;
+
+  if (shard_idx < 0)
+    shard_idx = __atomic_fetch_add(&shard_next, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+
+  struct stats_series *s = &shards[shard_idx][idx];
+  __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+  if (hit)
+    __atomic_add_fetch(&s->hits, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->sum, nsec, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->buckets[stats_bucket(nsec)], 1, __ATOMIC_RELAXED);
+}
+
+
+//! merge all shards
+//! \return merged series array (to be freed)
+static struct stats_series *stats_merge(void) {
+
+  struct stats_series *all = calloc(series_num, sizeof(struct stats_series));
+  assert(all);
+
+  int sh, i, b;
+  for (sh = 0; sh < STATS_SHARDS; sh ++) {
+    for (i = 0; i < series_num; i ++) {
+      struct stats_series *s = &shards[sh][i];
+      all[i].count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+      all[i].hits += __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+      all[i].sum += __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+      for (b = 0; b < STATS_BUCKETS; b ++)
+        all[i].buckets[b] += __atomic_load_n(&s->buckets[b], __ATOMIC_RELAXED);
+    }
+  }
+
+  return all;
+}
+
+
+//! add series to another one
+static void stats_sum(struct stats_series *to, struct stats_series *from) {
+  int b;
+  to->count += from->count;
+  to->hits += from->hits;
+  to->sum += from->sum;
+  for (b = 0; b < STATS_BUCKETS; b ++)
+    to->buckets[b] += from->buckets[b];
+}
+
+
+//! get latency quantile
+//! \param s series
+//! \param q quantile (0..1)
+//! \return quantile upper bound, nsecs
+static uint64_t stats_quantile(struct stats_series *s, double q) {
+  uint64_t want = (uint64_t)(s->count * q + 0.5), seen = 0;
+  int b;
+  for (b = 0; b < STATS_BUCKETS; b ++) {
+    seen += s->buckets[b];
+    if (seen >= want && seen)
+      return stats_bucket_end(b);
+  }
+  return 0;
+}
+
+
+//! print Prometheus histogram (power of 4 bounds, from ~1us to ~17s)
+//! \param fp where to print
+//! \param metric metric name
+//! \param labels series labels ('name="value",...' or empty string)
+//! \param s series
+static void stats_print_hist(FILE *fp, char *metric, char *labels, struct stats_series *s) {
+
+  char *sep = *labels ? "," : "";
+  uint64_t cum = 0, le = 1 << 10;
+  int b;
+  for (b = 0; b < STATS_BUCKETS && le <= (1ULL << 34); b ++) {
+    cum += s->buckets[b];
+    if (stats_bucket_end(b) == le) {
+      fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %llu\n", metric, labels, sep, le / 1e9, (unsigned long long)cum);
+      le <<= 2;
+    }
+  }
+  fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", metric, labels, sep, (unsigned long long)s->count);
+  if (*labels) {
+    fprintf(fp, "%s_sum{%s} %.9f\n", metric, labels, s->sum / 1e9);
+    fprintf(fp, "%s_count{%s} %llu\n", metric, labels, (unsigned long long)s->count);
+  } else {
+    fprintf(fp, "%s_sum %.9f\n", metric, s->sum / 1e9);
+    fprintf(fp, "%s_count %llu\n", metric, (unsigned long long)s->count);
+  }
+}
+
+
+//! print memory usage metrics: bytes go to the file, objects are
+//! collected into memory stream to be printed after them
+static void stats_print_mem(char *owner, char *kind, struct mem_usage *mu, void *arg) {
+  FILE **fps = arg;
+  fprintf(fps[0], "aclh_memory_bytes{owner=\"%s\",kind=\"%s\"} %zu\n", owner, kind, mu->bytes);
+  fprintf(fps[1], "aclh_memory_objects{owner=\"%s\",kind=\"%s\"} %zu\n", owner, kind, mu->objects);
+}
+
+
+//! write stats file in Prometheus text format
+//! \param all merged series
+static void stats_write(struct stats_series *all) {
+
+  char *tmp = malloc(strlen(config.stats_file) + 8);
+  assert(tmp);
+  sprintf(tmp, "%s.tmp", config.stats_file);
+
+  FILE *fp = fopen(tmp, "w");
+  if (! fp) {
+    wlog(L_ERR, "stats: failed to open '%s': %s", tmp, strerror(errno));
+    free(tmp);
+    return;
+  }
+
+  char labels[256];
+  int i, j;
+
+  fprintf(fp, "# HELP aclh_start_time_seconds Stats collection start time.\n"
+              "# TYPE aclh_start_time_seconds gauge\n"
+              "aclh_start_time_seconds %lu\n", (unsigned long)stats_start);
+
+  fprintf(fp, "# HELP aclh_request_duration_seconds Request processing time.\n"
+              "# TYPE aclh_request_duration_seconds histogram\n");
+  stats_print_hist(fp, "aclh_request_duration_seconds", "", &all[STATS_REQUEST]);
+
+  fprintf(fp, "# HELP aclh_request_queue_seconds Time from request read to processing start.\n"
+              "# TYPE aclh_request_queue_seconds histogram\n");
+  stats_print_hist(fp, "aclh_request_queue_seconds", "", &all[STATS_QUEUE]);
+
+  fprintf(fp, "# HELP aclh_checker_duration_seconds Checker match time.\n"
+              "# TYPE aclh_checker_duration_seconds histogram\n");
+  for (i = STATS_FIXED; i < series_num; i ++) {
+    snprintf(labels, sizeof(labels), "checker=\"%s\",driver=\"%s\"", series_names[i].name, series_names[i].driver);
+    stats_print_hist(fp, "aclh_checker_duration_seconds", labels, &all[i]);
+  }
+
+  fprintf(fp, "# HELP aclh_checker_matches_total Checker calls by result.\n"
+              "# TYPE aclh_checker_matches_total counter\n");
+  for (i = STATS_FIXED; i < series_num; i ++) {
+    fprintf(fp, "aclh_checker_matches_total{checker=\"%s\",result=\"hit\"} %llu\n",
+            series_names[i].name, (unsigned long long)all[i].hits);
+    fprintf(fp, "aclh_checker_matches_total{checker=\"%s\",result=\"miss\"} %llu\n",
+            series_names[i].name, (unsigned long long)(all[i].count - all[i].hits));
+  }
+
+  // drivers: sum of their checkers
+  fprintf(fp, "# HELP aclh_driver_duration_seconds Match time of all checkers of a driver.\n"
+              "# TYPE aclh_driver_duration_seconds histogram\n");
+  for (i = STATS_FIXED; i < series_num; i ++) {
+    for (j = STATS_FIXED; j < i && strcmp(series_names[j].driver, series_names[i].driver); j ++);
+    if (j < i)
+      continue;
+    struct stats_series drv = {0,};
+    for (j = i; j < series_num; j ++)
+      if (! strcmp(series_names[j].driver, series_names[i].driver))
+        stats_sum(&drv, &all[j]);
+    snprintf(labels, sizeof(labels), "driver=\"%s\"", series_names[i].driver);
+    stats_print_hist(fp, "aclh_driver_duration_seconds", labels, &drv);
+  }
+
+  // memory usage as of last full report (startup, reload, SIGUSR1)
+  char *objects = NULL;
+  size_t objects_len = 0;
+  FILE *fps[2] = {fp, open_memstream(&objects, &objects_len)};
+  assert(fps[1]);
+  fprintf(fp, "# HELP aclh_memory_bytes Memory used by objects of an owner.\n"
+              "# TYPE aclh_memory_bytes gauge\n");
+  mem_last_report(stats_print_mem, fps);
+  fclose(fps[1]);
+  fprintf(fp, "# HELP aclh_memory_objects Number of objects of an owner.\n"
+              "# TYPE aclh_memory_objects gauge\n");
+  fwrite(objects, 1, objects_len, fp);
+  free(objects);
+  fprintf(fp, "# HELP aclh_resident_memory_bytes Process resident memory size.\n"
+              "# TYPE aclh_resident_memory_bytes gauge\n"
+              "aclh_resident_memory_bytes %zu\n", mem_rss());
+
+  if (fclose(fp) || rename(tmp, config.stats_file))
+    wlog(L_ERR, "stats: failed to write '%s': %s", config.stats_file, strerror(errno));
+
+  free(tmp);
+}
+
+
+//! dump stats summary into the log
+//! \param all merged series
+static void stats_log(struct stats_series *all) {
+
+  int i;
+  for (i = 0; i < series_num; i ++) {
+    struct stats_series *s = &all[i];
+    char *name = i == STATS_REQUEST ? "request" : i == STATS_QUEUE ? "queue" : series_names[i].name;
+    wlog(L_INFO, "stats: %s: count %llu, hits %llu, avg %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus",
+         name, (unsigned long long)s->count, (unsigned long long)s->hits,
+         s->count ? s->sum / 1e3 / s->count : 0.0,
+         stats_quantile(s, 0.5) / 1e3, stats_quantile(s, 0.9) / 1e3, stats_quantile(s, 0.99) / 1e3);
+  }
+}
+
+
+//! stats export thread
+static void *stats_export(void *arg) {
+
+  while (1) {
+
+    // wait for dump request or next write time
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += config.stats_interval;
+    int dump = 0;
+    if (config.stats_file && config.stats_interval > 0) {
+      while ((dump = ! sem_timedwait(&stats_sem, &deadline)) == 0 && errno == EINTR);
+    } else {
+      while (sem_wait(&stats_sem) && errno == EINTR);
+      dump = 1;
+    }
+
+    struct stats_series *all = stats_merge();
+    if (dump) {
+      stats_log(all);
+      mem_log();
+      checkers_hits_dump();
+    }
+    if (config.stats_file)
+      stats_write(all);
+    free(all);
+  }
+
+  return NULL;
+}
+
+
+//! SIGUSR1 handler: wake up exporter
+static void stats_signal(int sig) {
+  sem_post(&stats_sem);
+}
+
+
+//! init stats counters (after all series are registered)
+void stats_init(void) {
+
+  int i;
+  for (i = 0; i < STATS_SHARDS; i ++) {
+    shards[i] = calloc(series_num, sizeof(struct stats_series));
+    assert(shards[i]);
+  }
+
+  stats_start = time(NULL);
+}
+
+
+//! print stats summary table
+//! \param fp where to print
+void stats_print(FILE *fp) {
+
+  struct stats_series *all = stats_merge();
+
+  fprintf(fp, "%-24s %10s %10s %10s %10s %10s %10s\n",
+          "series", "count", "hits", "avg,us", "p50,us", "p99,us", "p999,us");
+
+  int i;
+  for (i = 0; i < series_num; i ++) {
+    struct stats_series *s = &all[i];
+    char *name = i == STATS_REQUEST ? "(request)" : i == STATS_QUEUE ? "(queue)" : series_names[i].name;
+    if (! s->count)
+      continue;
+    fprintf(fp, "%-24s %10llu %10llu %10.1f %10.1f %10.1f %10.1f\n",
+            name, (unsigned long long)s->count, (unsigned long long)s->hits, s->sum / 1e3 / s->count,
+            stats_quantile(s, 0.5) / 1e3, stats_quantile(s, 0.99) / 1e3, stats_quantile(s, 0.999) / 1e3);
+  }
+
+  free(all);
+}
+
+
+//! start stats exporter (file writer and SIGUSR1 dumps)
+//! \return 0 if ok
+int stats_run(void) {
+
+  sem_init(&stats_sem, 0, 0);
+
+  struct sigaction sig_action;
+  memset(&sig_action, 0, sizeof(sig_action));
+  sig_action.sa_handler = stats_signal;
+  sigemptyset(&sig_action.sa_mask);
+  sig_action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sig_action, NULL);
+
+  pthread_t thread_id;
+  pthread_attr_t thread_attr;
+  pthread_attr_init(&thread_attr);
+  pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+  int err = pthread_create(&thread_id, &thread_attr, stats_export, NULL);
+  pthread_attr_destroy(&thread_attr);
+  if (err) {
+    wlog(L_ERR, "stats: failed to start export thread");
+    return 1;
+  }
+
+  if (config.stats_file)
+    wlog(L_INFO, "stats: writing stats to '%s' every %d secs", config.stats_file, config.stats_interval);
+
+  return 0;
+}
+
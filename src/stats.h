@@ -0,0 +1,45 @@
+/** \file */
+
+
+#ifndef __ACLH_STATS_H__
+#define __ACLH_STATS_H__
+
+//! number of counters shards (threads are spread over them)
+#define STATS_SHARDS        16
+
+//! histogram: sub-buckets per power of 2 (as bits)
+#define STATS_SUB_BITS      2
+
+//! histogram: max tracked latency is 2^STATS_MAX_BITS nsecs (~36 min)
+#define STATS_MAX_BITS      41
+
+//! histogram buckets number
+#define STATS_BUCKETS       ((STATS_MAX_BITS - STATS_SUB_BITS + 2) << STATS_SUB_BITS)
+
+//! default stats file write period, secs
+#define DEFAULT_STATS_INTERVAL  60
+
+//! latency series: counters and log-linear histogram (nsecs)
+struct stats_series {
+  uint64_t count;                    //!< number of events
+  uint64_t hits;                     //!< number of matches (checkers only)
+  uint64_t sum;                      //!< latencies sum
+  uint64_t buckets[STATS_BUCKETS];   //!< latencies histogram
+};
+
+//! fixed series indexes (checkers go after them)
+enum stats_fixed_series {
+  STATS_REQUEST,                     //!< end-to-end request processing
+  STATS_QUEUE,                       //!< request wait before processing starts
+  STATS_FIXED,                       //!< number of fixed series
+};
+
+extern int stats_series_add(char *, char *);
+extern void stats_init(void);
+extern int stats_run(void);
+extern void stats_print(FILE *);
+extern uint64_t stats_now(void);
+extern void stats_add(int, int, uint64_t);
+
+#endif //__ACLH_STATS_H__
+
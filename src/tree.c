@@ -75,3 +75,54 @@ void *_tree_search(void *key, node_t **root, int (*compar)(const void *, const v
   return p ? p->key : (errno = ENOENT, NULL);
 }
 
+
+//! walk the tree in keys order
+//! (no recursion: list-like trees may be millions nodes deep)
+//! \param root tree root node
+//! \param func function to call for each key
+//! \param arg function argument
+void tree_walk(node_t *root, void (*func)(void *, void *), void *arg) {
+
+  node_t **stack = NULL;
+  size_t depth = 0, size = 0;
+
+  // right branch holds lesser keys (see _tree_search())
+  while (root || depth) {
+    while (root) {
+      if (depth == size) {
+        size = size ? size * 2 : 64;
+        stack = realloc(stack, size * sizeof(node_t *));
+        assert(stack);
+      }
+      stack[depth ++] = root;
+      root = root->right;
+    }
+    root = stack[-- depth];
+    func(root->key, arg);
+    root = root->left;
+  }
+
+  free(stack);
+}
+
+
+//! free the tree nodes
+//! \param root tree root node
+//! \param func function to free node key (or NULL to keep keys)
+void tree_free(node_t *root, void (*func)(void *)) {
+  while (root) {
+    // rotate right child up until there is none, then the node may go
+    if (root->right) {
+      node_t *right = root->right;
+      root->right = right->left;
+      right->left = root;
+      root = right;
+      continue;
+    }
+    node_t *left = root->left;
+    if (func)
+      func(root->key);
+    free(root);
+    root = left;
+  }
+}
@@ -13,6 +13,8 @@ typedef struct node {
 
 
 extern void *_tree_search(void *, node_t **, int (*)(const void *, const void *), int);
+extern void tree_walk(node_t *, void (*)(void *, void *), void *);
+extern void tree_free(node_t *, void (*)(void *));
 
 //! frontend to _tree_search(): find a key or install it if not found
 #define tree_search(key, root, cmpf) _tree_search((key), (root), cmpf, 1)
@@ -0,0 +1,208 @@
+#! /bin/bash
+#
+# matchers benchmark: generate synthetic datasets of various sizes, load
+# each one into a single checker of every (local) driver and replay
+# generated queries through it in isolation ('acl-helper -b'); report
+# load time, memory and lookup latencies
+#
+# datasets (every one in random and sorted order, sorted input is the
+# worst case for unbalanced trees: its load time grows quadratically, so
+# sorted order is run up to BENCH_MAX_SORTED entries only):
+#   cidr   - IPv4 addresses and /24../30 networks (ip, resolve)
+#   domain - host names, queried with Zipf distribution (string, istring)
+#   url    - urls (string)
+#   shell  - '*.domain' patterns (match, imatch)
+#   regex  - anchored domain regexes (regex, iregex, pcre, ipcre)
+# 20% of queries miss the dataset; pattern sets are scanned linearly, so
+# they are capped at BENCH_MAX_PATTERNS entries and get fewer queries;
+# 'dresolve', 'ssl' and 'geoip2*' need DNS, network or GeoIP2 db and are
+# not run here (see bench-ssl.sh for SSL)
+#
+# usage: bench-match.sh [acl-helper binary] [sizes...]
+# env:   BENCH_QUERIES (100000), BENCH_PATTERN_QUERIES (2000),
+#        BENCH_MAX_PATTERNS (10000), BENCH_MAX_SORTED (20000),
+#        BENCH_TIMEOUT (600 secs per run, 'timeout' is reported in
+#        load_s of a killed run), BENCH_DRIVERS (all supported)
+#
+# output (csv): driver,dataset,order,entries,load_s,mem_bytes,rss_bytes,
+#               queries,hits,avg_us,p50_us,p99_us,p999_us
+#
+#####################################
+
+HELPER=${1:-./acl-helper}
+shift
+SIZES=${@:-1000 10000 100000 1000000}
+QUERIES=${BENCH_QUERIES:-100000}
+PATTERN_QUERIES=${BENCH_PATTERN_QUERIES:-2000}
+MAX_PATTERNS=${BENCH_MAX_PATTERNS:-10000}
+MAX_SORTED=${BENCH_MAX_SORTED:-20000}
+TIMEOUT=${BENCH_TIMEOUT:-600}
+
+WORKDIR=$(mktemp -d /tmp/acl-helper-bench.XXXXXX) || exit 1
+trap 'rm -rf $WORKDIR' EXIT
+
+# drivers compiled in
+FEATURES=$($HELPER -v | grep "features:")
+DRIVERS=${BENCH_DRIVERS:-"dummy string istring ip resolve match imatch regex iregex pcre ipcre"}
+supported() {
+  case $1 in
+    match|imatch) echo "$FEATURES" | grep -q "+match" ;;
+    regex|iregex) echo "$FEATURES" | grep -q "+regex" ;;
+    pcre|ipcre)   echo "$FEATURES" | grep -q "+pcre" ;;
+    resolve)      echo "$FEATURES" | grep -q "+resolve" ;;
+    *)            true ;;
+  esac
+}
+
+# dataset of a driver
+dataset() {
+  case $1 in
+    ip|resolve)             echo "cidr" ;;
+    string|istring)         echo "domain url" ;;
+    match|imatch)           echo "shell" ;;
+    regex|iregex|pcre|ipcre) echo "regex" ;;
+  esac
+}
+
+# generate dataset entries: entry i is derived from a bijective hash
+# of i, so queries know the set without keeping it in memory
+# usage: generate <dataset> <entries>
+generate() {
+  awk -v type=$1 -v n=$2 -f <(cat <<'EOF'
+function h(i) { return (i * 69069 + 12345) % 4294967296 }
+function ip(x) { return sprintf("%d.%d.%d.%d", int(x / 16777216), int(x / 65536) % 256, int(x / 256) % 256, x % 256) }
+function entry(i,   x) {
+  x = h(i)
+  if (type == "cidr")   return (i % 10 ? ip(x) : ip(x - x % 256) "/" (24 + i % 7))
+  if (type == "domain") return sprintf("www.d%x.example.com", x)
+  if (type == "url")    return sprintf("http://d%x.example.com/path/%d/index.html", x, i % 1000)
+  if (type == "shell")  return sprintf("*.d%x.example.com", x)
+  if (type == "regex")  return sprintf("^([a-z0-9]+\\.)*d%x\\.example\\.com$", x)
+}
+BEGIN { for (i = 0; i < n; i ++) print entry(i) }
+EOF
+)
+}
+
+# generate queries: 80% hit entries by Zipf-like rank, 20% miss
+# usage: generate_queries <dataset> <entries> <queries>
+generate_queries() {
+  awk -v type=$1 -v n=$2 -v q=$3 -f <(cat <<'EOF'
+function h(i) { return (i * 69069 + 12345) % 4294967296 }
+function ip(x) { return sprintf("%d.%d.%d.%d", int(x / 16777216), int(x / 65536) % 256, int(x / 256) % 256, x % 256) }
+function query(i,   x) {
+  x = h(i)
+  if (type == "cidr")   return (i % 10 ? ip(x) : ip(x - x % 256 + 1))
+  if (type == "domain") return sprintf("www.d%x.example.com", x)
+  if (type == "url")    return sprintf("http://d%x.example.com/path/%d/index.html", x, i % 1000)
+  if (type == "shell" || type == "regex") return sprintf("www.d%x.example.com", x)
+  return "x"
+}
+BEGIN {
+  srand(1)
+  for (j = 0; j < q; j ++) {
+    if (rand() < 0.2)
+      i = n + int(rand() * 4294967296)
+    else
+      i = int(exp(rand() * log(n + 1))) - 1
+    printf "%d %s\n", j, query(i)
+  }
+}
+EOF
+)
+}
+
+# sort dataset file in place
+# usage: sort_dataset <dataset> <file>
+sort_dataset() {
+  if [ $1 = cidr ]; then
+    LC_ALL=C sort -t. -k1,1n -k2,2n -k3,3n -k4,4n -o $2 $2
+  else
+    LC_ALL=C sort -o $2 $2
+  fi
+}
+
+# run one benchmark and print csv line
+# usage: run <driver> <dataset> <order> <entries>
+run() {
+  local driver=$1 set=$2 order=$3 entries=$4 queries=$QUERIES
+
+  case $set in
+    none)
+      echo "source = src_bench:dummy:" > $WORKDIR/source ;;
+    *)
+      echo "source = src_bench:file:$WORKDIR/$set.$order" > $WORKDIR/source ;;
+  esac
+  case $set in
+    shell|regex) queries=$PATTERN_QUERIES ;;
+  esac
+
+  cat > $WORKDIR/bench.conf <<EOF
+debug = 0
+concurrency = 1
+log = file::$WORKDIR/helper.log
+resolve_prefetch = off
+$(cat $WORKDIR/source)
+checker = bench:on:0:$driver:note:bench=1:src_bench:
+EOF
+
+  generate_queries $set $entries $queries > $WORKDIR/queries
+
+  : > $WORKDIR/helper.log
+  local started=$(date +%s.%N)
+  timeout $TIMEOUT $HELPER -c $WORKDIR/bench.conf -b $WORKDIR/queries -w 1 2> $WORKDIR/report
+  if [ $? = 124 ]; then
+    echo "$driver,$set,$order,$entries,timeout,,,,,,,,"
+    return
+  fi
+  local finished=$(date +%s.%N)
+
+  awk -v driver=$driver -v set=$set -v order=$order -v entries=$entries \
+      -v started=$started -v finished=$finished '
+    FILENAME ~ /helper.log$/ && /memory: total accounted/ {
+      for (i = 1; i < NF; i ++) {
+        if ($i == "accounted") mem = $(i + 1)
+        if ($i == "RSS") rss = $(i + 1)
+      }
+    }
+    FILENAME ~ /report$/ && / requests in / { queries = $1; elapsed = $4 }
+    FILENAME ~ /report$/ && $1 == "bench" { hits = $3; avg = $4; p50 = $5; p99 = $6; p999 = $7 }
+    END {
+      printf "%s,%s,%s,%d,%.3f,%d,%d,%d,%d,%s,%s,%s,%s\n", driver, set, order, entries,
+             finished - started - elapsed, mem, rss, queries, hits, avg, p50, p99, p999
+    }' $WORKDIR/helper.log $WORKDIR/report
+}
+
+
+echo "driver,dataset,order,entries,load_s,mem_bytes,rss_bytes,queries,hits,avg_us,p50_us,p99_us,p999_us"
+
+# no dataset: chain overhead baseline
+for DRIVER in $DRIVERS; do
+  [ $DRIVER = dummy ] && run dummy none none 0
+done
+
+for SIZE in $SIZES; do
+  for SET in cidr domain url shell regex; do
+    ENTRIES=$SIZE
+    case $SET in
+      shell|regex) [ $ENTRIES -gt $MAX_PATTERNS ] && continue ;;
+    esac
+    generate $SET $ENTRIES > $WORKDIR/$SET.random
+    [ $ENTRIES -gt $MAX_SORTED ] && continue
+    cp $WORKDIR/$SET.random $WORKDIR/$SET.sorted
+    sort_dataset $SET $WORKDIR/$SET.sorted
+  done
+
+  for DRIVER in $DRIVERS; do
+    supported $DRIVER || continue
+    for SET in $(dataset $DRIVER); do
+      [ -f $WORKDIR/$SET.random ] || continue
+      for ORDER in random sorted; do
+        [ $ORDER = sorted -a $SIZE -gt $MAX_SORTED ] && continue
+        run $DRIVER $SET $ORDER $SIZE
+      done
+    done
+  done
+
+  rm -f $WORKDIR/*.random $WORKDIR/*.sorted
+done
@@ -0,0 +1,67 @@
+#! /bin/bash
+#
+# SSL checker benchmark: run N verifications against local TLS server
+# in full and 'cert only' handshake modes and report verifications per
+# second and per CPU second (i.e. per core) of the helper
+#
+# usage: bench-ssl.sh [acl-helper binary] [requests] [port]
+#
+# output (csv): mode,requests,elapsed_s,cpu_s,verif_per_s,verif_per_cpu_s
+#
+#####################################
+
+HELPER=${1:-./acl-helper}
+REQUESTS=${2:-2000}
+PORT=${3:-24431}
+
+WORKDIR=$(mktemp -d /tmp/acl-helper-bench.XXXXXX) || exit 1
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf $WORKDIR' EXIT
+
+# test CA and server cert signed by it
+openssl req -x509 -newkey rsa:2048 -nodes -days 2 -subj "/CN=bench CA" \
+        -keyout $WORKDIR/ca.key -out $WORKDIR/ca.crt >/dev/null 2>&1 && \
+openssl req -newkey rsa:2048 -nodes -subj "/CN=localhost" \
+        -keyout $WORKDIR/srv.key -out $WORKDIR/srv.csr >/dev/null 2>&1 && \
+openssl x509 -req -days 2 -in $WORKDIR/srv.csr -CA $WORKDIR/ca.crt -CAkey $WORKDIR/ca.key \
+        -CAcreateserial -out $WORKDIR/srv.crt >/dev/null 2>&1 || { echo "failed to create certs" >&2; exit 1; }
+
+openssl s_server -quiet -accept $PORT -cert $WORKDIR/srv.crt -key $WORKDIR/srv.key -www >/dev/null 2>&1 &
+SERVER_PID=$!
+sleep 1
+
+echo "mode,requests,elapsed_s,cpu_s,verif_per_s,verif_per_cpu_s"
+
+for MODE in off on; do
+
+  cat > $WORKDIR/bench.conf <<EOF
+debug = 0
+concurrency = 100
+log = file::$WORKDIR/helper.log
+ssl_ca_file = $WORKDIR/ca.crt
+ssl_verify_ttl = 0
+ssl_cert_only = $MODE
+source = src_dummy:dummy:
+checker = ssl_cert:on:0:ssl:note::src_dummy:
+EOF
+
+  # every request gets its own loopback address to defeat result caching;
+  # stdin is kept open until all answers are received
+  : > $WORKDIR/out
+  TIMEFORMAT="%R %U %S"
+  TIMES=$( { time ( \
+    { awk -v n=$REQUESTS -v port=$PORT 'BEGIN {
+        for (i = 0; i < n; i ++)
+          printf "%d 127.%d.%d.%d %d\n", i, 1 + int(i / 62500) % 254, int(i / 250) % 250, 1 + i % 250, port
+      }'
+      while [ $(wc -l < $WORKDIR/out) -lt $REQUESTS ]; do sleep 0.05; done
+    } | $HELPER -c $WORKDIR/bench.conf > $WORKDIR/out ) ; } 2>&1 )
+
+  FAILED=$(grep -vc "ssl_error=0 " $WORKDIR/out)
+  [ "$FAILED" -gt 0 ] && echo "WARNING: $FAILED verifications failed in mode '$MODE'" >&2
+
+  echo $TIMES | awk -v mode=$MODE -v n=$REQUESTS '{
+    cpu = $2 + $3
+    printf "%s,%d,%.3f,%.3f,%.1f,%.1f\n", (mode == "on" ? "cert_only" : "full"), n, $1, cpu, n / $1, (cpu > 0 ? n / cpu : 0)
+  }'
+
+done
@@ -0,0 +1,94 @@
+#! /bin/bash
+#
+# SSL checker test: verify certs of local TLS servers serving good, expired
+# and self-signed certs and check reported errors (ssl_error=0, 10 and 18)
+#
+# usage: test-ssl.sh [acl-helper binary] [first port]
+#
+# output: case,expected,got,result per server; exit code is 0 if all
+# cases passed, 1 otherwise
+#
+#####################################
+
+HELPER=${1:-./acl-helper}
+PORT=${2:-24441}
+
+WORKDIR=$(mktemp -d /tmp/acl-helper-test.XXXXXX) || exit 1
+SERVER_PIDS=
+trap 'kill $SERVER_PIDS 2>/dev/null; rm -rf $WORKDIR' EXIT
+
+# test CA and its 'openssl ca' config (it sets exact validity dates)
+mkdir $WORKDIR/ca && touch $WORKDIR/ca/index.txt && echo 01 > $WORKDIR/ca/serial
+cat > $WORKDIR/ca.cnf <<EOF
+[ ca ]
+default_ca = test_ca
+[ test_ca ]
+dir = $WORKDIR/ca
+database = \$dir/index.txt
+serial = \$dir/serial
+new_certs_dir = \$dir
+certificate = $WORKDIR/ca.crt
+private_key = $WORKDIR/ca.key
+default_md = sha256
+policy = test_policy
+unique_subject = no
+[ test_policy ]
+commonName = supplied
+EOF
+
+# good (signed by test CA), expired (signed by test CA, valid in 2000 only)
+# and self-signed server certs
+openssl req -x509 -newkey rsa:2048 -nodes -days 2 -subj "/CN=test CA" \
+        -keyout $WORKDIR/ca.key -out $WORKDIR/ca.crt >/dev/null 2>&1 && \
+openssl req -newkey rsa:2048 -nodes -subj "/CN=localhost" \
+        -keyout $WORKDIR/good.key -out $WORKDIR/good.csr >/dev/null 2>&1 && \
+openssl ca -batch -config $WORKDIR/ca.cnf -days 2 \
+        -in $WORKDIR/good.csr -out $WORKDIR/good.crt >/dev/null 2>&1 && \
+openssl req -newkey rsa:2048 -nodes -subj "/CN=localhost" \
+        -keyout $WORKDIR/expired.key -out $WORKDIR/expired.csr >/dev/null 2>&1 && \
+openssl ca -batch -config $WORKDIR/ca.cnf -startdate 20000101000000Z -enddate 20001231000000Z \
+        -in $WORKDIR/expired.csr -out $WORKDIR/expired.crt >/dev/null 2>&1 && \
+openssl req -x509 -newkey rsa:2048 -nodes -days 2 -subj "/CN=localhost" \
+        -keyout $WORKDIR/self.key -out $WORKDIR/self.crt >/dev/null 2>&1 || { echo "failed to create certs" >&2; exit 1; }
+
+# case name, expected ssl_error, server port
+CASES="good 0 $PORT
+expired 10 $((PORT + 1))
+self 18 $((PORT + 2))"
+
+while read NAME EXPECTED CPORT; do
+  openssl s_server -quiet -accept $CPORT -cert $WORKDIR/$NAME.crt -key $WORKDIR/$NAME.key -www >/dev/null 2>&1 &
+  SERVER_PIDS="$SERVER_PIDS $!"
+done <<< "$CASES"
+sleep 1
+
+cat > $WORKDIR/test.conf <<EOF
+debug = 0
+concurrency = 0
+log = file::$WORKDIR/helper.log
+ssl_ca_file = $WORKDIR/ca.crt
+ssl_verify_ttl = 0
+source = src_dummy:dummy:
+checker = ssl_cert:on:0:ssl:note::src_dummy:
+EOF
+
+echo "case,expected,got,result"
+
+FAILED=0
+while read NAME EXPECTED CPORT; do
+  # stdin is kept open until the answer is received (or for ssl_timeout)
+  : > $WORKDIR/out
+  { echo "127.0.0.1 $CPORT"
+    for i in $(seq 100); do [ -s $WORKDIR/out ] && break; sleep 0.1; done
+  } | $HELPER -c $WORKDIR/test.conf > $WORKDIR/out
+  GOT=$(sed -n 's/.*ssl_error=\([0-9-]*\).*/\1/p' $WORKDIR/out)
+  if [ "$GOT" = "$EXPECTED" ]; then
+    RESULT=ok
+  else
+    RESULT=FAILED
+    FAILED=1
+  fi
+  echo "$NAME,$EXPECTED,${GOT:-none},$RESULT"
+done <<< "$CASES"
+
+exit $FAILED